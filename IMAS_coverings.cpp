@@ -651,6 +651,7 @@ void imasCoverings::loadsimulations2do(float covering_code,float radius, bool wr
     }
 
     _arearatio = Fcout(covering_element);
+    _radius = radius;
     my_Printf(" )\n Area ratio = %.3f  \n \n",Fcout(covering_element));
 
     if (writeimage)
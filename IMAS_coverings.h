@@ -66,7 +66,11 @@ protected:
     int totsimu2;
     float _arearatio;
 
-    static float transition_tilt(float t, float psi1, float s, float psi2);
+    /**
+     * @brief Radius of the selected covering, in terms of transition tilts
+     */
+    float _radius;
+
     static float Fcout(const std::vector<float>& tilt_element);
     static void drawpoint(float * data, int width, int i, int j, float radius, float value);
     static void getdisks(float t,float psi, float r, float phistep, std::vector<float>& phivec, std::vector<float>& tupvec,std::vector<float>& tlowvec);
@@ -79,6 +83,7 @@ protected:
 
 
 public:
+    static float transition_tilt(float t, float psi1, float s, float psi2);
     static void write_image_covering(const std::vector<float>& covering_element, float r,float region,float seenregion, int logseenregionpixels);
     void loadsimulations2do();
     void loadsimulations2do(std::vector<float>& vec_simtilts1, std::vector<float>& vec_simrot1,std::vector<float>& vec_simtilts2, std::vector<float>& vec_simrot2);
@@ -88,6 +93,7 @@ public:
     imasCoverings()
     {
         _arearatio = 0.0f;
+        _radius = 0.0f;
     }
     const std::vector<tilt_simu> getSimuDetails1()
     {
@@ -110,6 +116,10 @@ public:
     {
         return(_arearatio);
     }
+    float getRadius()
+    {
+        return(_radius);
+    }
     ~imasCoverings()
     {
         simu_details1.clear();
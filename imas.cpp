@@ -1,8 +1,11 @@
 #include "imas.h"
 #include <math.h>
 #include <algorithm>
+#include <queue>
+#include <map>
 #include <ctime>
 #include <cstdlib>
+#include <cassert>
 
 #include "mex_and_omp.h"
 
@@ -58,6 +61,11 @@ int Filter_num_min = 5;
  */
 double Filter_precision=24;
 
+/**
+ * @brief Seed of the random samples drawn by ORSA. For a given seed, filtered matches do not depend on the number of threads.
+ */
+unsigned int orsa_seed = 0;
+
 /**
  * @brief IdentifiedMaps Stores meaningful transformations identified by ORSA
  */
@@ -68,6 +76,11 @@ std::vector<TypeMap> IdentifiedMaps;
  */
 std::vector<IMAS::IMAS_KeyPoint*> keys3;
 
+/**
+ * @brief Owns the descriptors the SIIM keypoints of <keys3> point into.
+ */
+std::vector<IMAS::IMAS_Descriptors*> keys3_descriptors;
+
 /**
  * @brief Fixes the number of generalised keypoints in the third image to be used.
  * If this number is less than the size of <keys3> then a random part of it is selected as a-contrario model.
@@ -79,10 +92,95 @@ int fixed_number_of_keypoints = -1;
  */
 int rho = 4;
 
+/**
+ * @brief Maximum number of SIIM keypoints kept in a generalised keypoint once all simulations have been merged.
+ * The most representative ones are kept. If set to -1 no bound is imposed.
+ */
+int group_cap = -1;
+
+/**
+ * @brief SIIM keypoints whose descriptor lies within this distance of an already kept one (in the same generalised keypoint) are dropped.
+ * The norm is the one of the matcher. If set to 0 no SIIM keypoint is dropped this way.
+ */
+float group_tolerance = 0.0f;
+
+/**
+ * @brief Generalised keypoints found in fewer than <min_support> simulated views are dropped once all simulations have been merged.
+ * If set to 0 no generalised keypoint is dropped this way.
+ */
+float min_support = 0.0f;
+
+/**
+ * @brief If true, a simulated view of tilt t only counts as 1/t towards the support of a generalised keypoint,
+ * as rotations are sampled more densely at high tilts.
+ */
+bool support_tilt_weight = false;
+
+/**
+ * @brief Maximum number of scale-space peaks kept in one simulated view (SIFT and SURF), the strongest ones.
+ * Selection is done before computing orientations and descriptors, so a SIFT peak may still give several
+ * SIIM keypoints, one per dominant orientation. If set to 0 there is no limit.
+ */
+int keypoint_budget = 0;
+
+/**
+ * @brief Maximum number of scale-space peaks kept in all simulated views of one image.
+ * It is shared among simulations in proportion to their area, i.e. to 1/t. If set to 0 there is no limit.
+ */
+int keypoint_budget_image = 0;
+
+/**
+ * @brief If true, the budgeted peaks are selected by adaptive non-maximal suppression instead of by response alone.
+ */
+bool keypoint_anms = false;
+
+/**
+ * @brief If true, the SIFT scale space of each simulated view is stored in half precision (see siftPar::HalfStorage).
+ */
+bool sift_half_storage = false;
+
+/**
+ * @brief If true, SIFT based descriptors are computed after hyper-keypoints are formed: simulated views are first only
+ * searched for scale-space peaks, which are grouped, and only the peaks kept in the hyper-keypoints are then described.
+ * The scale space of every view is kept meanwhile.
+ */
+bool defer_description = false;
+
+/**
+ * @brief Detectors/descriptors computed on the same simulated views as the current one. Their matches are added to
+ * those of the current one before filtering. Set with GetDetectorDescriptor().
+ */
+std::vector<IMAS::IMAS_Extractor> extra_extractors;
+
+/**
+ * @brief Number of target hyper-keypoints, ranked by their SIFT distance, on which the a-contrario matchers compute the NFA of a query hyper-keypoint.
+ * If set to 0 every pair of hyper-keypoints is tested.
+ */
+int ac_shortlist_k = 0;
+
+/**
+ * @brief If true, pairs left out by the SIFT shortlist are also tested so as to report how many a-contrario matches fall outside it.
+ */
+bool ac_shortlist_check = false;
+
+/**
+ * @brief If true, the patches of the a-contrario descriptors are interpolated from the SIFT gradient images instead of being
+ * resampled from the blurred images. Faster, but derivatives are then taken at pixel spacing instead of patch spacing, which loses matches.
+ */
+bool ac_gradient_patches = false;
+
+
+/**
+ * @brief Number of query hyper-keypoints matched exhaustively in order to find out which pairs of simulated views
+ * correspond (see estimate_simulation_gate()). SIIM keypoints are then only compared within those pairs and their neighbours.
+ * If set to 0 every pair of SIIM keypoints is compared.
+ */
+int sim_gating = 0;
 
 
 
 float _arearatio;
+float _covering_radius;
 
 
 //these are global variables
@@ -129,6 +227,26 @@ double IMAS::IMAS_getTickFrequency()
 #endif
 }
 
+#ifdef _NO_OPENCV
+IMAS::IMAS_Descriptors::IMAS_Descriptors(): sift(NULL), acpool(NULL), surf(NULL), levels(NULL) {}
+
+IMAS::IMAS_Descriptors::~IMAS_Descriptors()
+{
+    delete sift;
+    delete acpool;
+    delete surf;
+    delete levels;
+#ifdef _LDAHASH
+    for (int i=0; i<(int)lda.size(); i++)
+        delete static_cast<ldadescriptor*>(lda[i]);
+#endif
+}
+#else
+IMAS::IMAS_Descriptors::IMAS_Descriptors() {}
+
+IMAS::IMAS_Descriptors::~IMAS_Descriptors() {}
+#endif
+
 #ifdef _NO_OPENCV
 bool IMAS::IMAS_Matrix::empty()
 {
@@ -180,6 +298,7 @@ void updateparams()
     {
         siftparameters.half_sift_trick = true;
     }
+    siftparameters.DescType = desc_type;
 #else
     // .... Put params to update here
 #endif
@@ -430,6 +549,7 @@ std::string SetDetectorDescriptor(int DDIndex)
         NewOriSize1 = 18;
         quant_prec = 0.032;
         step_sigma = 1.5;
+        set_quantised_layout(NewOriSize1, NewOriSize1);
         break;
     }
 #endif
@@ -482,6 +602,30 @@ std::string SetDetectorDescriptor(int DDIndex)
         normType = IMAS::NORM_HAMMING;
         break;
     }
+    case IMAS_PCASIFT:
+    {
+        desc_name="PCA-SIFT";
+        nndrRatio = 0.8f;
+        desc_type = IMAS_PCASIFT;
+        binary_desc = false;
+        default_radius = 1.7f;
+        rooted = false;
+        sift_desc = true;
+        normType = IMAS::NORM_L2;
+        break;
+    }
+    case IMAS_PCAROOTSIFT:
+    {
+        desc_name="PCA-RootSIFT";
+        nndrRatio = 0.8f;
+        desc_type = IMAS_PCAROOTSIFT;
+        binary_desc = false;
+        default_radius = 1.7f;
+        rooted = true;
+        sift_desc = true;
+        normType = IMAS::NORM_L2;
+        break;
+    }
 #endif
 #endif
     }
@@ -491,6 +635,70 @@ std::string SetDetectorDescriptor(int DDIndex)
 
 
 
+IMAS::IMAS_Extractor CurrentDetectorDescriptor()
+{
+    IMAS::IMAS_Extractor ex;
+    ex.desc_name = desc_name;
+    ex.desc_type = desc_type;
+    ex.nndrRatio = nndrRatio;
+    ex.normType = normType;
+    ex.binary_desc = binary_desc;
+    ex.rooted = rooted;
+    ex.sift_desc = sift_desc;
+    ex.default_radius = default_radius;
+    return ex;
+}
+
+
+#ifdef _NO_OPENCV
+/**
+ * @brief SIFT parameters of an extractor: the current ones (thresholds set by update_*()) with the variant of <ex>.
+ */
+siftPar extractor_sift_parameters(const IMAS::IMAS_Extractor& ex)
+{
+    siftPar par = siftparameters;
+    par.L2norm = (ex.normType==IMAS::NORM_L2);
+    par.MODE_ROOT = ex.rooted;
+    par.half_sift_trick = (ex.desc_type==IMAS_HALFSIFT);
+    par.DescType = ex.desc_type;
+    return par;
+}
+#endif
+
+
+void UseDetectorDescriptor(const IMAS::IMAS_Extractor& ex)
+{
+    desc_name = ex.desc_name;
+    desc_type = ex.desc_type;
+    nndrRatio = ex.nndrRatio;
+    normType = ex.normType;
+    binary_desc = ex.binary_desc;
+    rooted = ex.rooted;
+    sift_desc = ex.sift_desc;
+    default_radius = ex.default_radius;
+#ifdef _NO_OPENCV
+    siftparameters = extractor_sift_parameters(ex);
+#endif
+}
+
+
+IMAS::IMAS_Extractor GetDetectorDescriptor(int DDIndex)
+{
+    IMAS::IMAS_Extractor current = CurrentDetectorDescriptor();
+#ifdef _NO_OPENCV
+    siftPar par = siftparameters;
+#endif
+    SetDetectorDescriptor(DDIndex);
+    IMAS::IMAS_Extractor ex = CurrentDetectorDescriptor();
+    UseDetectorDescriptor(current);
+#ifdef _NO_OPENCV
+    siftparameters = par;
+#endif
+    return ex;
+}
+
+
+
 void vectorimage2imasimage(std::vector<float>& input_image, IMAS::IMAS_Matrix &output_image, int width, int height)
 {
 #ifdef _NO_OPENCV
@@ -498,7 +706,7 @@ void vectorimage2imasimage(std::vector<float>& input_image, IMAS::IMAS_Matrix &o
     //output_image = *(new IMAS::IMAS_Matrix(input_image,width,height));
 
     //JUST BIND
-    output_image = *(new IMAS::IMAS_Matrix());
+    output_image = IMAS::IMAS_Matrix();
     output_image.data = input_image.data();
     output_image.cols = width;
     output_image.rows = height;
@@ -542,7 +750,7 @@ void imasimage2vectorimage(IMAS::IMAS_Matrix input_image,std::vector<float>& out
 void floatarray2imasimage(float *input_image, IMAS::IMAS_Matrix &output_image, int width, int height)
 {
 #ifdef _NO_OPENCV
-    output_image = *(new IMAS::IMAS_Matrix);
+    output_image = IMAS::IMAS_Matrix();
     output_image.data = input_image;
     output_image.cols = width;
     output_image.rows = height;
@@ -562,9 +770,9 @@ void floatarray2imasimage(float *input_image, IMAS::IMAS_Matrix &output_image, i
 
 
 #ifndef _NO_OPENCV
-void detector_and_descriptor(cv::Ptr<cv::FeatureDetector> &detector, cv::Ptr<cv::DescriptorExtractor> &extractor)
+void detector_and_descriptor(cv::Ptr<cv::FeatureDetector> &detector, cv::Ptr<cv::DescriptorExtractor> &extractor, int type)
 {
-    switch (desc_type)
+    switch (type)
     {
     case IMAS_SIFT:
     {
@@ -657,50 +865,131 @@ void detector_and_descriptor(cv::Ptr<cv::FeatureDetector> &detector, cv::Ptr<cv:
 
 
 
-void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypointlist& KPs, float t, float theta)
+#ifdef _NO_OPENCV
+/**
+ * @brief SIFT parameters of <ex> on a simulated view with keypoint budget <budget>.
+ */
+siftPar view_sift_parameters(const IMAS::IMAS_Extractor& ex, int budget)
+{
+    siftPar par = extractor_sift_parameters(ex);
+    par.MaxKeypoints = budget;
+    par.ANMS = keypoint_anms;
+    par.HalfStorage = sift_half_storage;
+    return par;
+}
+
+/**
+ * @brief Descriptors the SIIM keypoints of owner->sift point into: the keypoints themselves or, for LDAHash and PCA
+ * descriptors, their projections, which are computed here.
+ * @param ptrs Receives one pointer per keypoint.
+ */
+void sift_descriptor_pointers(IMAS::IMAS_Descriptors* owner, const IMAS::IMAS_Extractor& ex, std::vector<void*>& ptrs)
+{
+    keypointslist& keys = *owner->sift;
+    ptrs.resize(keys.size());
+#ifdef _LDAHASH
+    if (ex.desc_type>=41 && ex.desc_type<=44)
+    {
+        for (int i=0; i<(int)keys.size(); i++)
+        {
+            ptrs[i] = lda_describe_from_SIFT(keys[i], ex.desc_type);
+            owner->lda.push_back(ptrs[i]);
+        }
+        return;
+    }
+    if ( (ex.desc_type==IMAS_PCASIFT || ex.desc_type==IMAS_PCAROOTSIFT) && !keys.empty() )
+    {
+        // Reduced vectors of the whole view are computed at once
+        owner->pca.resize(keys.size()*pca_projection.dim);
+        pca_describe_from_SIFT(keys, &owner->pca[0]);
+        for (int i=0; i<(int)keys.size(); i++)
+            ptrs[i] = &owner->pca[i*pca_projection.dim];
+        return;
+    }
+#endif
+    for (int i=0; i<(int)keys.size(); i++)
+        ptrs[i] = &keys[i];
+}
+
+/**
+ * @brief Releases the full SIFT vectors of a view when SIIM keypoints point to their reductions (PCA descriptors).
+ */
+void release_reduced_sift(IMAS::IMAS_Descriptors* owner, const IMAS::IMAS_Extractor& ex)
+{
+#ifdef _LDAHASH
+    if (ex.desc_type==IMAS_PCASIFT || ex.desc_type==IMAS_PCAROOTSIFT)
+    {
+        delete owner->sift;
+        owner->sift = NULL;
+    }
+#endif
+}
+
+/**
+ * @brief Whether SIIM keypoints of <ex> are described after hyper-keypoints are formed (see defer_description).
+ */
+bool deferred_extractor(const IMAS::IMAS_Extractor& ex)
+{
+    return defer_description && ex.sift_desc;
+}
+#endif
+
+
+/**
+ * @brief Computes the SIIM keypoints of a simulated view.
+ * @param budget Maximum number of scale-space peaks (see keypoint_budget). 0 means no limit.
+ * @param owner Receives the descriptors of the view, which the keypoints in <KPs> point into.
+ * @param ex The detector/descriptor to compute.
+ */
+void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypointlist& KPs, float t, float theta, int budget, IMAS::IMAS_Descriptors* owner, const IMAS::IMAS_Extractor& ex)
 {
 
     if(!queryImg.empty())
     {
 #ifdef _NO_OPENCV
-        if (sift_desc)
+        if (ex.sift_desc)
         {
-            keypointslist* keys = new keypointslist;
-            compute_sift_keypoints(queryImg.data,*keys,queryImg.cols,queryImg.rows,siftparameters);
+            keypointslist* keys = owner->sift = new keypointslist;
+            siftPar par = view_sift_parameters(ex, budget);
+#ifdef _ACD
+            // AC patches of this simulation live as long as its keypoints
+            if (ex.desc_type == IMAS_AC || ex.desc_type ==IMAS_AC_Q || ex.desc_type == IMAS_AC_W)
+                owner->acpool = new ac_patch_pool;
+            compute_sift_keypoints(queryImg.data,*keys,queryImg.cols,queryImg.rows,par,owner->acpool);
+#else
+            compute_sift_keypoints(queryImg.data,*keys,queryImg.cols,queryImg.rows,par);
+#endif
+            std::vector<void*> ptrs;
+            sift_descriptor_pointers(owner, ex, ptrs);
+
             //KPs.DescList.resize(keys->size());
             KPs.resize(keys->size());
             for(int i=0; i<(int)keys->size();i++)
             {
                 KPs[i].pt.x = (*keys)[i].x;
                 KPs[i].pt.y = (*keys)[i].y;
-
-#ifdef _LDAHASH
-                if (desc_type>=41 && desc_type<=44)
-                    KPs[i].pt.kp_ptr = lda_describe_from_SIFT( (*keys)[i], desc_type);
-                else
-                    KPs[i].pt.kp_ptr = &((*keys)[i]);
-#else
-                KPs[i].pt.kp_ptr = &((*keys)[i]);
-#endif
+                KPs[i].pt.kp_ptr = ptrs[i];
                 KPs[i].size = (*keys)[i].radius;
                 KPs[i].scale = (*keys)[i].scale;
                 KPs[i].angle = (*keys)[i].angle;
                 KPs[i].t = t;
                 KPs[i].theta = theta;
             }
+            release_reduced_sift(owner, ex);
         }
         else
         {
-            listDescriptor* keys = extract_surf(queryImg.data, queryImg.cols,queryImg.rows);
+            listDescriptor* keys = extract_surf(queryImg.data, queryImg.cols,queryImg.rows,budget,keypoint_anms);
+            owner->surf = keys;
             KPs.resize(keys->size());
             for(int i=0; i<(int)keys->size();i++)
             {
-                KPs[i].pt.x = (*keys)[i]->kP->x;
-                KPs[i].pt.y = (*keys)[i]->kP->y;
-                KPs[i].pt.kp_ptr = (*keys)[i];
-                KPs[i].size = 2*(*keys)[i]->kP->scale-1;
-                KPs[i].scale = (*keys)[i]->kP->scale;
-                KPs[i].angle = (*keys)[i]->kP->orientation;
+                KPs[i].pt.x = (*keys)[i].kP.x;
+                KPs[i].pt.y = (*keys)[i].kP.y;
+                KPs[i].pt.kp_ptr = &(*keys)[i];
+                KPs[i].size = 2*(*keys)[i].kP.scale-1;
+                KPs[i].scale = (*keys)[i].kP.scale;
+                KPs[i].angle = (*keys)[i].kP.orientation;
                 KPs[i].t = t;
                 KPs[i].theta = theta;
             }
@@ -711,7 +1000,7 @@ void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypo
         ////////////////////////////
         cv::Ptr<cv::FeatureDetector> detector;
         cv::Ptr<cv::DescriptorExtractor> extractor;
-        detector_and_descriptor(detector, extractor);
+        detector_and_descriptor(detector, extractor, ex.desc_type);
 
 
         cv::Mat dlist;
@@ -719,7 +1008,7 @@ void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypo
         detector->detect(queryImg, klist);
         extractor->compute(queryImg, klist, dlist);
 
-        if (desc_type==IMAS_ROOTSIFT)
+        if (ex.desc_type==IMAS_ROOTSIFT)
         {
             int rows;
             rows = dlist.rows;
@@ -733,7 +1022,7 @@ void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypo
             }
 
         }
-        if (desc_type==IMAS_HALFSIFT)
+        if (ex.desc_type==IMAS_HALFSIFT)
         {
             int rows;
             cv::Mat temp;
@@ -754,6 +1043,7 @@ void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypo
         int rows;
         rows = dlist.rows;
         KPs.resize(klist.size());
+        owner->rows.resize(rows);
         for (int i=0;i<rows;i++)
         {
             KPs[i].pt.x = klist[i].pt.x;
@@ -764,13 +1054,47 @@ void compute_local_descriptor_keypoints(IMAS::IMAS_Matrix &queryImg,  IMAS_keypo
             KPs[i].t = t;
             KPs[i].theta = theta;
 
-            KPs[i].pt.kp_ptr = new cv::Mat(dlist.row(i));
+            owner->rows[i] = dlist.row(i);
+            KPs[i].pt.kp_ptr = &owner->rows[i];
         }
 #endif
     }
 }
 
 
+#ifdef _NO_OPENCV
+/**
+ * @brief Finds the SIFT peaks of a simulated view, to be described later by describe_deferred_peaks().
+ * Keypoints in <KPs> point to the IMAS_Peak of owner->peaks they stand for and have no orientation yet.
+ * @param budget Maximum number of peaks (see keypoint_budget). 0 means no limit.
+ * @param owner Keeps the scale space of the view and its peaks.
+ * @param ex The detector/descriptor to compute.
+ */
+void detect_local_peaks(IMAS::IMAS_Matrix &queryImg,  IMAS_keypointlist& KPs, float t, float theta, int budget, IMAS::IMAS_Descriptors* owner, const IMAS::IMAS_Extractor& ex)
+{
+    if(queryImg.empty())
+        return;
+
+    siftPar par = view_sift_parameters(ex, budget);
+    owner->levels = compute_sift_peaks(queryImg.data,queryImg.cols,queryImg.rows,par);
+
+    int npeaks = (int) owner->levels->peaks.size();
+    owner->peaks.resize(npeaks);
+    KPs.resize(npeaks);
+    for(int i=0; i<npeaks;i++)
+    {
+        owner->peaks[i].owner = owner;
+        owner->peaks[i].peak = i;
+        sift_peak_geometry(*owner->levels, i, KPs[i].pt.x, KPs[i].pt.y, KPs[i].scale, KPs[i].size, par);
+        KPs[i].pt.kp_ptr = &owner->peaks[i];
+        KPs[i].angle = 0.0f;
+        KPs[i].t = t;
+        KPs[i].theta = theta;
+    }
+}
+#endif
+
+
 
 
 
@@ -960,7 +1284,7 @@ void ORSA_EpipolarFilter(matchingslist& matchings,int w1,int h1,int w2,int h2, d
     libNumerics::matrix<double> F(3,3);
     std::vector<int> vec_inliers;
     double nfa;
-    orsa::orsa_fundamental(match_coor, w1,h1,w2,h2, precision, ITER_ORSA,F, vec_inliers,nfa,verb);
+    orsa::orsa_fundamental(match_coor, w1,h1,w2,h2, precision, ITER_ORSA,F, vec_inliers,nfa,verb,orsa_seed);
 
 
 
@@ -1035,7 +1359,7 @@ void ORSA_HomographyFilter(matchingslist& matchings,int w1,int h1,int w2,int h2,
     libNumerics::matrix<double> H(3,3);
     std::vector<int> vec_inliers;
     double nfa;
-    orsa::ORSA_homography(match_coor, w1,h1,w2,h2, precision, ITER_ORSA,H, vec_inliers,nfa,verb);
+    orsa::ORSA_homography(match_coor, w1,h1,w2,h2, precision, ITER_ORSA,H, vec_inliers,nfa,verb,orsa_seed);
 
 
 
@@ -1139,6 +1463,70 @@ float distance_sift(cv::Mat* k1, cv::Mat* k2, float tdist, bool L2norm)
 #endif
 
 
+/**
+ * @brief Computes the distance between two SIIM keypoints but stops computing
+ * when this distance gets bigger than dist.
+ * @param (kp1,kp2) Pair of SIIM keypoints
+ * @param dist Current minimum distance. It is returned if descriptors can not be compared (SURF with different Laplacian signs).
+ * @param tnorm Which norm to use (either L1 or L2)
+ * @return \f$\delta(kp1,kp2)\f$ where  \f$\delta(x,y)\f$  is either  \f$\Vert x - y \Vert_{L_1} \f$  or  \f$\Vert x - y \Vert_{L_2}^2 \f$
+ * @author Mariano Rodríguez
+ */
+float distance_skewedKP(const IMAS::skewed_KeyPoint& kp1, const IMAS::skewed_KeyPoint& kp2, float dist, int tnorm)
+{
+    float tdist = dist;
+#ifndef _NO_OPENCV
+    if (sift_desc)
+        tdist = distance_sift(static_cast<IMAS::IMAS_Matrix*>(kp1.pt.kp_ptr),static_cast<IMAS::IMAS_Matrix*>(kp2.pt.kp_ptr),dist,tnorm==cv::NORM_L2);
+    else
+        tdist = (float)cv::norm(*static_cast<IMAS::IMAS_Matrix*>(kp1.pt.kp_ptr),*static_cast<IMAS::IMAS_Matrix*>(kp2.pt.kp_ptr),tnorm);
+#else
+    if (sift_desc)
+#ifdef _LDAHASH
+        if (desc_type>=41 && desc_type<=44)
+            tdist = lda_hamming_distance(static_cast<ldadescriptor*>(kp1.pt.kp_ptr) , static_cast<ldadescriptor*>(kp2.pt.kp_ptr), dist);
+        else if (desc_type==IMAS_PCASIFT || desc_type==IMAS_PCAROOTSIFT)
+            tdist = pca_distance(static_cast<float*>(kp1.pt.kp_ptr) , static_cast<float*>(kp2.pt.kp_ptr), dist);
+        else
+            tdist = distance_sift(static_cast<keypoint*>(kp1.pt.kp_ptr) , static_cast<keypoint*>(kp2.pt.kp_ptr), dist, tnorm==IMAS::NORM_L2);
+#else
+        tdist = distance_sift(static_cast<keypoint*>(kp1.pt.kp_ptr) , static_cast<keypoint*>(kp2.pt.kp_ptr), dist, tnorm==IMAS::NORM_L2);
+#endif
+    else
+        if (static_cast<descriptor*>(kp1.pt.kp_ptr)->kP.signLaplacian==static_cast<descriptor*>(kp2.pt.kp_ptr)->kP.signLaplacian)
+            tdist = euclideanDistance(static_cast<descriptor*>(kp1.pt.kp_ptr) , static_cast<descriptor*>(kp2.pt.kp_ptr));
+#endif
+    return tdist;
+}
+
+
+#ifdef _NO_OPENCV
+/**
+ * @brief Minimum of the SURF distances between k1->KPvec[b1..e1) and k2->KPvec[b2..e2), which are
+ * assumed to share the same sign of the Laplacian.
+ * @param dist Current minimum distance. It is updated along with (ind1,ind2) if a smaller one is found.
+ * @author Mariano Rodríguez
+ */
+void distance_surf_block(IMAS::IMAS_KeyPoint *k1, int b1, int e1, IMAS::IMAS_KeyPoint *k2, int b2, int e2, float& dist, int &ind1, int &ind2)
+{
+    for(int i1=b1;i1<e1;i1++)
+    {
+        const descriptor* d1 = static_cast<const descriptor*>(k1->KPvec[i1].pt.kp_ptr);
+        for(int i2=b2;i2<e2;i2++)
+        {
+            float tdist = euclideanDistance(d1, static_cast<const descriptor*>(k2->KPvec[i2].pt.kp_ptr));
+            if ( dist>tdist )
+            {
+                dist = tdist;
+                ind1 = i1;
+                ind2 = i2;
+            }
+        }
+    }
+}
+#endif
+
+
 /**
  * @brief Computes the generalised distance proposed in \cite imas_IPOL_2017 but stops computing
  * when this distance gets bigger than tdist.
@@ -1152,32 +1540,20 @@ float distance_sift(cv::Mat* k1, cv::Mat* k2, float tdist, bool L2norm)
  */
 float distance_imasKP(IMAS::IMAS_KeyPoint *k1,IMAS::IMAS_KeyPoint *k2, float& dist,int &ind1, int &ind2, int tnorm)
 {
-    float tdist = dist;
+    float tdist;
+#ifdef _NO_OPENCV
+    if ( k1->npositive>=0 && k2->npositive>=0 )
+    {
+        // SURF: only blocks with the same sign of the Laplacian are compared
+        distance_surf_block(k1, 0, k1->npositive, k2, 0, k2->npositive, dist, ind1, ind2);
+        distance_surf_block(k1, k1->npositive, (int)k1->KPvec.size(), k2, k2->npositive, (int)k2->KPvec.size(), dist, ind1, ind2);
+        return(dist);
+    }
+#endif
     for(int i1=0;i1<(int)k1->KPvec.size();i1++)
         for(int i2=0;i2<(int)k2->KPvec.size();i2++)
         {
-#ifndef _NO_OPENCV
-            if (sift_desc)
-                tdist = distance_sift(static_cast<IMAS::IMAS_Matrix*>(k1->KPvec[i1].pt.kp_ptr),static_cast<IMAS::IMAS_Matrix*>(k2->KPvec[i2].pt.kp_ptr),dist,tnorm==cv::NORM_L2);
-            else
-                tdist = (float)cv::norm(*static_cast<IMAS::IMAS_Matrix*>(k1->KPvec[i1].pt.kp_ptr),*static_cast<IMAS::IMAS_Matrix*>(k2->KPvec[i2].pt.kp_ptr),tnorm);
-            //#pragma omp critical
-            //            cout<<tdist<<" "<<tdist1<<endl;
-            //tdist = opencv_distance(static_cast<IMAS::IMAS_Matrix*>(k1->KPvec[i1].pt.kp_ptr) , static_cast<IMAS::IMAS_Matrix*>(k2->KPvec[i2].pt.kp_ptr));
-#else
-            if (sift_desc)
-#ifdef _LDAHASH
-                if (desc_type>=41 && desc_type<=44)
-                    tdist = lda_hamming_distance(static_cast<ldadescriptor*>(k1->KPvec[i1].pt.kp_ptr) , static_cast<ldadescriptor*>(k2->KPvec[i2].pt.kp_ptr), dist);
-                else
-                    tdist = distance_sift(static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr) , static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr), dist, tnorm==IMAS::NORM_L2);
-#else
-                tdist = distance_sift(static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr) , static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr), dist, tnorm==IMAS::NORM_L2);
-#endif
-            else
-                if (static_cast<descriptor*>(k1->KPvec[i1].pt.kp_ptr)->kP->signLaplacian==static_cast<descriptor*>(k2->KPvec[i2].pt.kp_ptr)->kP->signLaplacian)
-                    tdist = euclideanDistance(static_cast<descriptor*>(k1->KPvec[i1].pt.kp_ptr) , static_cast<descriptor*>(k2->KPvec[i2].pt.kp_ptr));
-#endif
+            tdist = distance_skewedKP(k1->KPvec[i1], k2->KPvec[i2], dist, tnorm);
             if ( dist>tdist )
             {
                 dist = tdist;
@@ -1192,6 +1568,45 @@ float distance_imasKP(IMAS::IMAS_KeyPoint *k1,IMAS::IMAS_KeyPoint *k2, float& di
 }
 
 
+/**
+ * @brief Pairs of simulated views whose SIIM keypoints are compared by IMAS_match() (see sim_gating).
+ */
+struct simulation_gate
+{
+    std::vector< std::pair<float,float> > sims1, sims2;  // (t,theta) of the simulated views of each image
+    std::vector< std::vector<int> > views1, views2;      // simulated view of every SIIM keypoint of keys1 and keys2
+    std::vector<char> allowed;                           // allowed[v1*sims2.size()+v2]
+};
+
+
+/**
+ * @brief Same as distance_imasKP() but only SIIM keypoints coming from allowed pairs of simulated views are compared.
+ * @param (v1,v2) Simulated views of the SIIM keypoints in k1 and k2 (see simulation_gate)
+ * @author Mariano Rodríguez
+ */
+float distance_imasKP_gated(IMAS::IMAS_KeyPoint *k1, const int* v1, IMAS::IMAS_KeyPoint *k2, const int* v2, const simulation_gate& gate, float& dist, int &ind1, int &ind2, int tnorm)
+{
+    int n2 = (int) gate.sims2.size();
+    for(int i1=0;i1<(int)k1->KPvec.size();i1++)
+    {
+        const char* allowed = &gate.allowed[v1[i1]*n2];
+        for(int i2=0;i2<(int)k2->KPvec.size();i2++)
+        {
+            if (!allowed[v2[i2]])
+                continue;
+            float tdist = distance_skewedKP(k1->KPvec[i1], k2->KPvec[i2], dist, tnorm);
+            if ( dist>tdist )
+            {
+                dist = tdist;
+                ind1 = i1;
+                ind2 = i2;
+            }
+        }
+    }
+    return(dist);
+}
+
+
 /**
  * @brief Implements the ratio between first and second closest generalised keypoints proposed in \cite imas_IPOL_2017  based on the second-closest neighbor acceptance criterion
 initially proposed by D. Lowe in \cite Lowe2004.
@@ -1200,10 +1615,11 @@ initially proposed by D. Lowe in \cite Lowe2004.
  * @param min Returns the index for which the minimum distance is attained
  * @param (ind1,ind2) Returns where the minimum was found in  \f$(ind1,ind2) \in key \times klist[min]\f$
  * @param par Which norm to use (either L1 or L2) for computing distances
+ * @param gate If not NULL, only allowed pairs of simulated views are compared. <n1> is then the index of <key> in keys1.
  * @return Found minimal ratio
  * @author Mariano Rodríguez
  */
-float CheckForMatchIMAS(IMAS::IMAS_KeyPoint* key, std::vector<IMAS::IMAS_KeyPoint*>& klist, int& min, int& ind1, int& ind2, int tnorm)
+float CheckForMatchIMAS(IMAS::IMAS_KeyPoint* key, std::vector<IMAS::IMAS_KeyPoint*>& klist, int& min, int& ind1, int& ind2, int tnorm, const simulation_gate* gate = NULL, int n1 = -1)
 {
     float	dsq, distsq1, distsq2;
 #ifdef _NO_OPENCV
@@ -1221,7 +1637,10 @@ float CheckForMatchIMAS(IMAS::IMAS_KeyPoint* key, std::vector<IMAS::IMAS_KeyPoin
     for (int j=0; j< (int) klist.size(); j++)
     {
         int i1=-1 ,i2=-1;
-        dsq = distance_imasKP(key, klist[j], distsq2,i1,i2, tnorm);
+        if (gate)
+            dsq = distance_imasKP_gated(key, &gate->views1[n1][0], klist[j], &gate->views2[j][0], *gate, distsq2,i1,i2, tnorm);
+        else
+            dsq = distance_imasKP(key, klist[j], distsq2,i1,i2, tnorm);
 
         if (dsq < distsq1) {
             distsq2 = distsq1;
@@ -1312,19 +1731,276 @@ float CheckForMatchIMAS_acontrario(IMAS::IMAS_KeyPoint* key, std::vector<IMAS::I
 }
 
 
-#ifdef _ACD
-
-#ifndef FALSE
-#define FALSE 0
-#endif /* !FALSE */
+/**
+ * @brief Lists the simulated views found in a set of generalised keypoints and tells which of them each SIIM keypoint comes from.
+ * @param keys Generalised keypoints
+ * @param sims Returns the (t,theta) of every simulated view
+ * @param views Returns the index in <sims> of every SIIM keypoint of <keys>
+ * @author Mariano Rodríguez
+ */
+void simulation_views(const std::vector<IMAS::IMAS_KeyPoint*>& keys, std::vector< std::pair<float,float> >& sims, std::vector< std::vector<int> >& views)
+{
+    views.resize(keys.size());
+    for (int i=0; i<(int)keys.size(); i++)
+    {
+        views[i].resize(keys[i]->KPvec.size());
+        for (int j=0; j<(int)keys[i]->KPvec.size(); j++)
+        {
+            std::pair<float,float> sim(keys[i]->KPvec[j].t, keys[i]->KPvec[j].theta);
+            int v = (int) (std::find(sims.begin(), sims.end(), sim) - sims.begin());
+            if ( v==(int)sims.size() )
+                sims.push_back(sim);
+            views[i][j] = v;
+        }
+    }
+}
 
-#ifndef TRUE
-#define TRUE 1
-#endif /* !TRUE */
 
-/*----------------------------------------------------------------------------*/
-/** PI */
-#ifndef M_PI
+/**
+ * @brief Tells which simulated views lie within a transition tilt of <r> from each other.
+ * @param sims (t,theta) of the simulated views, theta in degrees
+ * @return near[a*sims.size()+b] is 1 if views a and b are neighbours
+ * @author Mariano Rodríguez
+ */
+std::vector<char> neighbouring_simulations(const std::vector< std::pair<float,float> >& sims, float r)
+{
+    int n = (int) sims.size();
+    std::vector<char> near(n*n, 1);
+    for (int a=0; a<n; a++)
+        for (int b=0; b<n; b++)
+            if (a!=b)
+            {
+                float tau = imasCoverings::transition_tilt(sims[a].first, sims[a].second*M_PI/180, sims[b].first, sims[b].second*M_PI/180);
+                // tau is NaN when both views almost coincide
+                near[a*n+b] = !(tau>r);
+            }
+    return near;
+}
+
+
+/**
+ * @brief Estimates which pairs of simulated views are worth comparing in IMAS_match().
+ * The first <sim_gating> query generalised keypoints, evenly spread over keys1, are matched exhaustively. Pairs of simulated
+ * views giving at least two confident matches (ratio below nndrRatio^2) are dominant. Then SIIM keypoints may only be compared
+ * if their views are, on both images, within a transition tilt of r^2 from a dominant pair, r being the covering radius,
+ * i.e. if they come from the dominant pair or from overlapping neighbours of it.
+ * @param (keys1,keys2) Query and target generalised keypoints
+ * @param gate Returns the simulated views of both images and the allowed pairs
+ * @return false if the estimate is weak: too few confident matches, or less than half of them in dominant pairs.
+ * In that case every pair should be compared.
+ * @author Mariano Rodríguez
+ */
+bool estimate_simulation_gate(std::vector<IMAS::IMAS_KeyPoint*>& keys1, std::vector<IMAS::IMAS_KeyPoint*>& keys2, simulation_gate& gate)
+{
+    const int min_confident = 20;
+
+    simulation_views(keys1, gate.sims1, gate.views1);
+    simulation_views(keys2, gate.sims2, gate.views2);
+    int n1 = (int) gate.sims1.size(), n2 = (int) gate.sims2.size();
+
+    int num_queries = std::min(sim_gating, (int) keys1.size());
+    float confidence = nndrRatio*nndrRatio;
+    std::vector<int> counts(n1*n2, 0);
+    int confident = 0;
+#pragma omp parallel for reduction(+:confident)
+    for (int q=0; q<num_queries; q++)
+    {
+        int i = (int) ( (double)q*keys1.size()/num_queries );
+        int imatch=-1, ind1 = -1, ind2 = -1;
+        if ( CheckForMatchIMAS(keys1[i], keys2, imatch, ind1, ind2, normType) < confidence )
+        {
+            confident++;
+            int p = gate.views1[i][ind1]*n2 + gate.views2[imatch][ind2];
+#pragma omp atomic
+            counts[p]++;
+        }
+    }
+
+    std::vector<int> dominant;
+    int supported = 0;
+    for (int p=0; p<n1*n2; p++)
+        if (counts[p]>=2)
+        {
+            dominant.push_back(p);
+            supported += counts[p];
+        }
+    my_Printf("   Simulation gating: %d confident matches out of %d queries, %d dominant pairs of simulated views \n", confident, num_queries, (int)dominant.size());
+    if ( confident<min_confident || 2*supported<confident )
+        return false;
+
+    float r = (_covering_radius>0) ? _covering_radius : default_radius;
+    std::vector<char> near1 = neighbouring_simulations(gate.sims1, r*r), near2 = neighbouring_simulations(gate.sims2, r*r);
+    gate.allowed.assign(n1*n2, 0);
+    for (int d=0; d<(int)dominant.size(); d++)
+    {
+        int d1 = dominant[d]/n2, d2 = dominant[d]%n2;
+        for (int a=0; a<n1; a++)
+            if (near1[d1*n1+a])
+                for (int b=0; b<n2; b++)
+                    if (near2[d2*n2+b])
+                        gate.allowed[a*n2+b] = 1;
+    }
+    return true;
+}
+
+
+/**
+ * @brief Uniform grid over the target image that indexes generalised keypoints by their position (guided matching).
+ */
+struct spatial_grid
+{
+    float cell;
+    int nx, ny;
+    std::vector< std::vector<int> > cells;
+};
+
+
+/**
+ * @brief Indexes generalised keypoints in a uniform grid.
+ * @param keys Generalised keypoints of an image
+ * @param (w,h) Size of the image
+ * @param cell Side of the cells in pixels
+ * @param grid Returns the grid
+ * @author Mariano Rodríguez
+ */
+void build_spatial_grid(const std::vector<IMAS::IMAS_KeyPoint*>& keys, int w, int h, float cell, spatial_grid& grid)
+{
+    grid.cell = cell;
+    grid.nx = std::max(1, (int) ceil(w/cell));
+    grid.ny = std::max(1, (int) ceil(h/cell));
+    grid.cells.assign(grid.nx*grid.ny, std::vector<int>());
+    for (int i=0; i<(int)keys.size(); i++)
+    {
+        int cx = std::min(grid.nx-1, std::max(0, (int) floor(keys[i]->x/cell)));
+        int cy = std::min(grid.ny-1, std::max(0, (int) floor(keys[i]->y/cell)));
+        grid.cells[cy*grid.nx+cx].push_back(i);
+    }
+}
+
+
+/**
+ * @brief Lists the generalised keypoints lying within a distance <r> of (x,y).
+ * @param grid Grid built on <keys> by build_spatial_grid()
+ * @param found Returns the indices in <keys> of those generalised keypoints
+ * @author Mariano Rodríguez
+ */
+void spatial_neighbours(const spatial_grid& grid, const std::vector<IMAS::IMAS_KeyPoint*>& keys, float x, float y, float r, std::vector<int>& found)
+{
+    found.clear();
+    if ( x+r<0 || y+r<0 || x-r>grid.nx*grid.cell || y-r>grid.ny*grid.cell )
+        return;
+    int x0 = std::max(0, (int) floor((x-r)/grid.cell)), x1 = std::min(grid.nx-1, (int) floor((x+r)/grid.cell));
+    int y0 = std::max(0, (int) floor((y-r)/grid.cell)), y1 = std::min(grid.ny-1, (int) floor((y+r)/grid.cell));
+    for (int cy=y0; cy<=y1; cy++)
+        for (int cx=x0; cx<=x1; cx++)
+        {
+            const std::vector<int>& cell = grid.cells[cy*grid.nx+cx];
+            for (int k=0; k<(int)cell.size(); k++)
+            {
+                float dx = keys[cell[k]]->x - x, dy = keys[cell[k]]->y - y;
+                if ( dx*dx+dy*dy <= r*r )
+                    found.push_back(cell[k]);
+            }
+        }
+}
+
+
+/**
+ * @brief Lists the generalised keypoints lying within a distance <r> of the line a*x+b*y+c=0. The band around the line
+ * is walked one column (or row, for steep lines) of cells at a time, so only the cells it crosses are visited.
+ * @param grid Grid built on <keys> by build_spatial_grid()
+ * @param found Returns the indices in <keys> of those generalised keypoints, in increasing order
+ * @author Mariano Rodríguez
+ */
+void line_neighbours(const spatial_grid& grid, const std::vector<IMAS::IMAS_KeyPoint*>& keys, double a, double b, double c, float r, std::vector<int>& found)
+{
+    found.clear();
+    double bound = r*sqrt(a*a+b*b);
+    if ( a==0.0 && b==0.0 )
+    {
+        if ( c==0.0 ) // every point lies on a degenerate line
+            for (int k=0; k<(int)keys.size(); k++)
+                found.push_back(k);
+        return;
+    }
+
+    // along the walk, coordinate s goes through the cells and t = -(p*s+c)/q follows the line
+    bool steep = fabs(a)>fabs(b);
+    double p = steep ? b : a, q = steep ? a : b, half = bound/fabs(q);
+    int nu = steep ? grid.ny : grid.nx, nv = steep ? grid.nx : grid.ny;
+    for (int u=0; u<nu; u++)
+    {
+        double t0 = -(p*u*grid.cell + c)/q, t1 = -(p*(u+1)*grid.cell + c)/q;
+        double v0 = std::max(0.0, floor((std::min(t0,t1) - half)/grid.cell));
+        double v1 = std::min(nv-1.0, floor((std::max(t0,t1) + half)/grid.cell));
+        for (int v=(int)v0; v<=(int)v1 && v0<=v1; v++)
+        {
+            const std::vector<int>& cell = grid.cells[ steep ? u*grid.nx+v : v*grid.nx+u ];
+            for (int k=0; k<(int)cell.size(); k++)
+                if ( fabs(a*keys[cell[k]]->x + b*keys[cell[k]]->y + c)<=bound )
+                    found.push_back(cell[k]);
+        }
+    }
+    std::sort(found.begin(), found.end());
+}
+
+
+/**
+ * @brief Position in the target image predicted by a homography for a point of the query image.
+ * @param H Homography from the query image to the target image
+ * @param (x,y) Point in the query image
+ * @param (px,py) Returns the predicted position
+ * @return false if the point is sent to infinity (or behind the camera)
+ * @author Mariano Rodríguez
+ */
+bool predict_position(const TypeMap& H, float x, float y, float& px, float& py)
+{
+    double z = H(2,0)*x + H(2,1)*y + H(2,2);
+    if ( z<=1e-12 )
+        return false;
+    px = (float) ( (H(0,0)*x + H(0,1)*y + H(0,2))/z );
+    py = (float) ( (H(1,0)*x + H(1,1)*y + H(1,2))/z );
+    return true;
+}
+
+
+/**
+ * @brief Lists the target generalised keypoints compatible with a prior model for a query point (x,y): those lying within <r> pixels
+ * of its position predicted by a homography or, if <epipolar>, of its epipolar line given by a fundamental matrix (x1^T F x2 = 0).
+ * @param grid Grid built on <keys> by build_spatial_grid().
+ * @param found Returns the indices in <keys> of those generalised keypoints
+ * @author Mariano Rodríguez
+ */
+void prior_neighbours(const TypeMap& prior, bool epipolar, const spatial_grid& grid, const std::vector<IMAS::IMAS_KeyPoint*>& keys, float x, float y, float r, std::vector<int>& found)
+{
+    found.clear();
+    if (epipolar)
+    {
+        double a = prior(0,0)*x + prior(1,0)*y + prior(2,0);
+        double b = prior(0,1)*x + prior(1,1)*y + prior(2,1);
+        double c = prior(0,2)*x + prior(1,2)*y + prior(2,2);
+        line_neighbours(grid, keys, a, b, c, r, found);
+        return;
+    }
+    float px, py;
+    if ( predict_position(prior, x, y, px, py) )
+        spatial_neighbours(grid, keys, px, py, r, found);
+}
+
+
+#ifdef _ACD
+
+#ifndef FALSE
+#define FALSE 0
+#endif /* !FALSE */
+
+#ifndef TRUE
+#define TRUE 1
+#endif /* !TRUE */
+
+/*----------------------------------------------------------------------------*/
+/** PI */
+#ifndef M_PI
 #define M_PI   3.14159265358979323846
 #endif /* !M_PI */
 
@@ -1570,49 +2246,222 @@ double quantised_patch_comparison( double * grad_angle1, double * grad_angle2,
     return logNFAC;
 }
 
-#endif
+/**
+ * @brief Bit-packed version of quantised_patch_comparison. Patches are given as the
+ * bitplanes built by pack_quantised_orientations, so that n (pixels defined in at
+ * least one patch) and k (defined pixels falling in the same orientation bin) are
+ * obtained with AND/XOR and popcount over 64-pixel words.
+ * @param bits1
+ * @param bits2
+ * @param logNT
+ * @return
+ * @author Mariano Rodríguez
+ */
+double packed_quantised_patch_comparison( const unsigned long long * bits1,
+                                          const unsigned long long * bits2,
+                                          double logNT )
+{
+    int n = 0;      /* count of angles compared */
+    int k = 0;      /* count of angles in the same bin */
+
+    for (int w=0; w<acq_words; w++)
+    {
+        unsigned long long def1 = bits1[w], def2 = bits2[w];
+        unsigned long long agree = def1 & def2;
+        for (int p=1; p<=acq_planes && agree; p++)
+            agree &= ~( bits1[p*acq_words+w] ^ bits2[p*acq_words+w] );
+
+        n += __builtin_popcountll( def1 | def2 );
+        k += __builtin_popcountll( agree );
+    }
+
+    if (n==0)
+        return logNT;
+
+    return nfa(logNT,n,k,1.0/acq_bins);
+}
 
 
 /**
- * @brief Computes matches among hyper-descriptors coming from query and target images as described in \cite imas_IPOL_2017
+ * @brief Computes the best a-contrario comparison among all pairs of SIIM keypoints in k1 x k2.
+ * @param (k1,k2) Pair of generalised keypoints
+ * @param logNT Logarithm of the number of tests
+ * @param (ind1,ind2) Returns where the minimum was found.  \f$(ind1,ind2) \in k1 \times k2\f$
+ * @return The minimal logNFA found, or logNT if no pair gave a negative logNFA
+ * @author Mariano Rodríguez
+ */
+double best_logNFA_imasKP(IMAS::IMAS_KeyPoint *k1, IMAS::IMAS_KeyPoint *k2, double logNT, int &ind1, int &ind2)
+{
+    double bestlogNFA = logNT, logNFA = 1000.0;
+    for(int i1=0;i1<(int)k1->KPvec.size();i1++)
+        for(int i2=0;i2<(int)k2->KPvec.size();i2++)
+        {
+            switch (desc_type) {
+            case IMAS_AC: // without weights
+            {
+                logNFA = patch_comparison(
+                            static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradangle,
+                            static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradangle,
+                            NewOriSize1,NewOriSize1,logNT);
+                break;
+            }
+            case IMAS_AC_W: //weighted
+            {
+                logNFA = weighted_patch_comparison(
+                            static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradangle,
+                            static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradangle,
+                            static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradmod,
+                            static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradmod,
+                            NewOriSize1,NewOriSize1,logNT);
+                break;
+            }
+            case IMAS_AC_Q: //quantised
+            {
+                logNFA = packed_quantised_patch_comparison(
+                            static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->acq_bits,
+                            static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->acq_bits,
+                            logNT);
+                break;
+            }
+
+            }
+
+            if ( (0>logNFA) && (bestlogNFA>logNFA) )
+            {
+                ind1 = i1;
+                ind2 = i2;
+                bestlogNFA = logNFA;
+            }
+        }
+    return bestlogNFA;
+}
+
+/**
+ * @brief Marks the k target generalised keypoints closest to key in terms of the SIFT descriptors carried by a-contrario keypoints.
+ * @param key A generalised query keypoint.
+ * @param klist The whole list of target generalised keypoints.
+ * @param k Size of the shortlist.
+ * @param shortlisted Returns true for the elements in klist belonging to the shortlist.
+ * @author Mariano Rodríguez
+ */
+void SIFT_shortlist(IMAS::IMAS_KeyPoint* key, std::vector<IMAS::IMAS_KeyPoint*>& klist, int k, std::vector<bool>& shortlisted)
+{
+    // max-heap on the distance, its top is the k-th closest found so far
+    std::priority_queue< std::pair<float,int> > closest;
+    for (int n2=0; n2<(int)klist.size(); n2++)
+    {
+        int ind1, ind2;
+        float dist = ((int)closest.size()<k) ? BIG_NUMBER_L2 : closest.top().first;
+        float bound = dist;
+        distance_imasKP(key, klist[n2], dist, ind1, ind2, IMAS::NORM_L2);
+        if ( dist<bound || (int)closest.size()<k )
+        {
+            closest.push( std::make_pair(dist,n2) );
+            if ((int)closest.size()>k)
+                closest.pop();
+        }
+    }
+    while (!closest.empty())
+    {
+        shortlisted[closest.top().second] = true;
+        closest.pop();
+    }
+}
+#endif
+
+/**
+ * @brief Computes RAW matches among hyper-descriptors coming from query and target images as described in \cite imas_IPOL_2017,
+ * with the current detector/descriptor.
  * @param w1 Width of image1
  * @param h1 Height of image1
  * @param w2 Width of image2
  * @param h2 Height of image2
  * @param keys1 Keypoints and hyper-descriptors found on all simulated optical tilts of query image
  * @param keys2 Keypoints and hyper-descriptors found on all simulated optical tilts of target image
- * @param matchings Returns a vector of matches after filtering
- * @param applyfilter filter to apply to RAW matches. It could be ORSA Homography \cite Moisan2012 or ORSA Fundamental \cite Moisan2016.
- * @return Total number of matches
+ * @param matchings Matches are added to it
+ * @param prior If not NULL, a homography from image1 to image2 known in advance. A query hyper-descriptor is then only compared
+ * to the target ones within <prior_radius> pixels of its predicted position, and the ratio test is evaluated among them.
+ * When a single target lies there, its second nearest neighbour is looked for among all targets: it is kept only if it is
+ * the nearest of all targets and passes the ratio test against the second one.
+ * @param epipolar If true, <prior> is a fundamental matrix and targets are looked for around epipolar lines.
  * @author Mariano Rodríguez
  */
-int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint*>& keys1, std::vector<IMAS::IMAS_KeyPoint*>& keys2, matchingslist &matchings, int applyfilter)
+void IMAS_match(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint*>& keys1, std::vector<IMAS::IMAS_KeyPoint*>& keys2, matchingslist &matchings, const TypeMap* prior = NULL, float prior_radius = 0.0f, bool epipolar = false)
 {
     IMAS_time tstart = IMAS::IMAS_getTickCount();
     my_Printf("IMAS-Matcher...\n");
+#ifndef _ACD
+    // the size of the query image only enters the a-contrario number of tests
+    (void) w1; (void) h1;
+#endif
 
-    float	minratio, sqratio;
+    float	minratio;
 
     minratio = nndrRatio;
+
+    // matches are kept per query and appended in query order, so that the
+    // list handed to ORSA does not depend on the number of threads
+    std::vector<matchingslist> per_query(keys1.size());
+
+    // targets indexed by position for guided matching
+    spatial_grid grid;
+    if (prior)
+    {
+        build_spatial_grid(keys2, w2, h2, prior_radius, grid);
+        my_Printf("   Guided matching: targets within %.1f pixels of the %s predicted by the prior are compared \n", prior_radius, epipolar ? "epipolar line" : "position");
+    }
+
 #ifdef _ACD
     if (!(desc_type == IMAS_AC || desc_type ==IMAS_AC_Q || desc_type == IMAS_AC_W))
 #endif
     {
+        // optional restriction to corresponding pairs of simulated views
+        simulation_gate gate;
+        bool gated = false;
+        if ( sim_gating>0 && !prior && keys3.empty() && !keys1.empty() && !keys2.empty() )
+        {
+            gated = estimate_simulation_gate(keys1, keys2, gate);
+            if (gated)
+                my_Printf("   %d pairs of simulated views out of %d are compared \n", (int)std::count(gate.allowed.begin(), gate.allowed.end(), 1), (int)gate.allowed.size());
+            else
+                my_Printf("   The estimate is weak, all pairs of simulated views are compared \n");
+        }
+
 #pragma omp parallel for
         for (int i=0; i< (int) keys1.size(); i++)
         {
             int imatch=-1, ind1 = -1, ind2 = -1;
+            float sqratio;
+
+            // with a prior, only targets around the predicted position are compared
+            std::vector<int> near;
+            std::vector<IMAS::IMAS_KeyPoint*> nearby;
+            if (prior)
+            {
+                prior_neighbours(*prior, epipolar, grid, keys2, keys1[i]->x, keys1[i]->y, prior_radius, near);
+                if (near.empty())
+                    continue;
+                for (int k=0; k<(int)near.size(); k++)
+                    nearby.push_back(keys2[near[k]]);
+            }
+            // a lone target has no second nearest neighbour around it, all targets are compared instead
+            bool lone = ( prior && near.size()==1 );
+            std::vector<IMAS::IMAS_KeyPoint*>& targets = (prior && !lone) ? nearby : keys2;
 
             if (!keys3.empty())
             {
-                sqratio = CheckForMatchIMAS_acontrario(keys1[i], keys2, imatch,ind1,ind2,normType);
+                sqratio = CheckForMatchIMAS_acontrario(keys1[i], targets, imatch,ind1,ind2,normType);
             }
             else
             {
-                sqratio = CheckForMatchIMAS(keys1[i], keys2, imatch,ind1,ind2,normType);
+                sqratio = CheckForMatchIMAS(keys1[i], targets, imatch,ind1,ind2,normType, gated ? &gate : NULL, i);
             }
+            if (lone && imatch!=near[0])
+                continue;
             if (sqratio< minratio)
             {
+                if (prior && !lone)
+                    imatch = near[imatch];
 
 
                 //my_Printf("par.MatchRatio = %f, sqratio = %f, sqratiomin = %f \n",par.MatchRatio,sqratio,sqminratio);
@@ -1641,11 +2490,9 @@ int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint
 
 
 #ifdef SaveDist
-                #pragma omp critical
-                matchings.push_back( matching(k1,k2,dist) );
+                per_query[i].push_back( matching(k1,k2,dist) );
 #else
-                #pragma omp critical
-                matchings.push_back( matching(k1,k2) );
+                per_query[i].push_back( matching(k1,k2) );
 #endif
 
             }
@@ -1664,61 +2511,41 @@ int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint
                 + log10( log( 2.0 * max(X2,Y2) ) / log(2.0) )
                 + 2.0*log10(_arearatio);
 
-#pragma omp parallel for
+        bool use_shortlist = !prior && (ac_shortlist_k>0) && (ac_shortlist_k<(int)keys2.size());
+        if (use_shortlist)
+            my_Printf("   NFA is computed on the %d closest hyper-keypoints (SIFT distance) of each query \n", ac_shortlist_k);
+        int missed = 0, found = 0;
+
+#pragma omp parallel for reduction(+:missed,found)
         for (int n1=0; n1< (int) keys1.size(); n1++)
-            for (int n2=0; n2< (int) keys2.size(); n2++)
+        {
+            std::vector<bool> shortlisted(keys2.size(), !use_shortlist && !prior);
+            if (use_shortlist)
+                SIFT_shortlist(keys1[n1], keys2, ac_shortlist_k, shortlisted);
+            if (prior)
             {
-                IMAS::IMAS_KeyPoint *k1, *k2;
-                k1 = keys1[n1];
-                k2 = keys2[n2];
-                int ind1 = -1, ind2 = -1;
-                double bestlogNFA = logNT, logNFA = 1000.0;
-                for(int i1=0;i1<(int)k1->KPvec.size();i1++)
-                    for(int i2=0;i2<(int)k2->KPvec.size();i2++)
-                    {
-
-                        switch (desc_type) {
-                        case IMAS_AC: // without weights
-                        {
-                            logNFA = patch_comparison(
-                                        static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradangle,
-                                        static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradangle,
-                                        NewOriSize1,NewOriSize1,logNT);
-                            break;
-                        }
-                        case IMAS_AC_W: //weighted
-                        {
-                            logNFA = weighted_patch_comparison(
-                                        static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradangle,
-                                        static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradangle,
-                                        static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradmod,
-                                        static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradmod,
-                                        NewOriSize1,NewOriSize1,logNT);
-                            break;
-                        }
-                        case IMAS_AC_Q: //quantised
-                        {
-                            logNFA = quantised_patch_comparison(
-                                        static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradangle,
-                                        static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradangle,
-                                        static_cast<keypoint*>(k1->KPvec[i1].pt.kp_ptr)->gradmod,
-                                        static_cast<keypoint*>(k2->KPvec[i2].pt.kp_ptr)->gradmod,
-                                        NewOriSize1,NewOriSize1,logNT);
-                            break;
-                        }
+                std::vector<int> near;
+                prior_neighbours(*prior, epipolar, grid, keys2, keys1[n1]->x, keys1[n1]->y, prior_radius, near);
+                for (int k=0; k<(int)near.size(); k++)
+                    shortlisted[near[k]] = true;
+            }
 
-                        }
+            for (int n2=0; n2< (int) keys2.size(); n2++)
+            {
+                if ( !shortlisted[n2] && (prior || !ac_shortlist_check) )
+                    continue;
 
-                        if ( (0>logNFA) && (bestlogNFA>logNFA) )
-                        {
-                            ind1 = i1;
-                            ind2 = i2;
-                            bestlogNFA = logNFA;
-                        }
-                    }
+                int ind1 = -1, ind2 = -1;
+                double bestlogNFA = best_logNFA_imasKP(keys1[n1], keys2[n2], logNT, ind1, ind2);
 
                 if (bestlogNFA<0)
                 {
+                    if (!shortlisted[n2])
+                    {
+                        missed++;
+                        continue;
+                    }
+                    found++;
                     {
                         keypoint_simple k1, k2;
 
@@ -1739,19 +2566,39 @@ int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint
                         k2.size = keys2[n2]->KPvec[ind2].size;
 
 
-#pragma omp critical
-                        matchings.push_back( matching(k1,k2) );
+                        per_query[n1].push_back( matching(k1,k2) );
                     }
 
                 }
             }
+        }
+
+        if (use_shortlist && ac_shortlist_check)
+            my_Printf("   %d a-contrario matches (%.2f%%) fall outside the SIFT shortlist \n", missed, (missed+found)>0 ? 100.0*missed/(missed+found) : 0.0);
     }
 #endif
+    for (int i=0; i< (int) per_query.size(); i++)
+        matchings.insert(matchings.end(), per_query[i].begin(), per_query[i].end());
+
     my_Printf("   %d possible matches have been found. \n", (int) matchings.size());
     my_Printf("IMAS-Matcher accomplished in %.2f seconds.\n \n", (IMAS::IMAS_getTickCount() - tstart)/ IMAS::IMAS_getTickFrequency());
+}
 
 
-    tstart = IMAS::IMAS_getTickCount();
+/**
+ * @brief Filters RAW matches
+ * @param w1 Width of image1
+ * @param h1 Height of image1
+ * @param w2 Width of image2
+ * @param h2 Height of image2
+ * @param matchings RAW matches. Returns the matches after filtering
+ * @param applyfilter filter to apply to RAW matches. It could be ORSA Homography \cite Moisan2012 or ORSA Fundamental \cite Moisan2016.
+ * @return Total number of matches
+ * @author Mariano Rodríguez
+ */
+int IMAS_filter(int w1, int h1, int w2, int h2, matchingslist &matchings, int applyfilter)
+{
+    IMAS_time tstart = IMAS::IMAS_getTickCount();
 
     // If (enough matches to do epipolar filtering)
     if ( ( (int) matchings.size() >= Filter_num_min ) )
@@ -1814,6 +2661,27 @@ int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint
 }
 
 
+/**
+ * @brief Computes matches among hyper-descriptors coming from query and target images as described in \cite imas_IPOL_2017
+ * @param w1 Width of image1
+ * @param h1 Height of image1
+ * @param w2 Width of image2
+ * @param h2 Height of image2
+ * @param keys1 Keypoints and hyper-descriptors found on all simulated optical tilts of query image
+ * @param keys2 Keypoints and hyper-descriptors found on all simulated optical tilts of target image
+ * @param matchings Returns a vector of matches after filtering
+ * @param applyfilter filter to apply to RAW matches. It could be ORSA Homography \cite Moisan2012 or ORSA Fundamental \cite Moisan2016.
+ * @param (prior,prior_radius,epipolar) Optional model from image1 to image2 guiding the matches (see IMAS_match())
+ * @return Total number of matches
+ * @author Mariano Rodríguez
+ */
+int IMAS_matcher(int w1, int h1, int w2, int h2, std::vector<IMAS::IMAS_KeyPoint*>& keys1, std::vector<IMAS::IMAS_KeyPoint*>& keys2, matchingslist &matchings, int applyfilter, const TypeMap* prior = NULL, float prior_radius = 0.0f, bool epipolar = false)
+{
+    IMAS_match(w1, h1, w2, h2, keys1, keys2, matchings, prior, prior_radius, epipolar);
+    return IMAS_filter(w1, h1, w2, h2, matchings, applyfilter);
+}
+
+
 
 
 
@@ -2084,6 +2952,163 @@ void Add_IMAS_KP(IMAS_keypointlist& keys, std::vector<IMAS::IMAS_KeyPoint*>& map
 
 
 
+/**
+ * @brief Block of a SIIM keypoint: SURF keypoints are only compared to those with the same sign of the Laplacian
+ * (1 if positive, 2 if negative). Other keypoints are all in block 0.
+ * @author Mariano Rodríguez
+ */
+int comparison_block(const IMAS::skewed_KeyPoint& kp)
+{
+#ifdef _NO_OPENCV
+    if (!sift_desc)
+        return static_cast<descriptor*>(kp.pt.kp_ptr)->kP.signLaplacian ? 1 : 2;
+#else
+    (void) kp;
+#endif
+    return 0;
+}
+
+/**
+ * @brief Reduces the SIIM keypoints of a generalised keypoint to a set of representatives.
+ * Descriptors are clustered greedily: each one either joins the first representative of its block (see comparison_block())
+ * lying within <group_tolerance> or becomes a new representative. Then, if more than <group_cap> representatives of a block
+ * remain, those gathering the largest clusters are kept. As blocks are never matched against each other, each one keeps
+ * at least a representative.
+ * @param kp A generalised keypoint
+ * @return The number of SIIM keypoints that have been removed
+ * @author Mariano Rodríguez
+ */
+int reduce_IMAS_KP(IMAS::IMAS_KeyPoint* kp)
+{
+    int n = (int)kp->KPvec.size();
+    if ( n<=1 || (group_tolerance<=0.0f && (group_cap<0 || n<=group_cap)) )
+        return 0;
+
+#ifdef _NO_OPENCV
+    bool squared = (normType==IMAS::NORM_L2);
+#else
+    bool squared = (normType==cv::NORM_L2) && sift_desc;
+#endif
+    float tol = squared ? group_tolerance*group_tolerance : group_tolerance;
+
+    // distance_skewedKP() returns tol for pairs that can not be compared, hence the blocks
+    std::vector<int> reps, support, block;
+    int blocks_before[3] = {0, 0, 0};
+    for (int i=0; i<n; i++)
+    {
+        int b = comparison_block(kp->KPvec[i]), joined = -1;
+        blocks_before[b]++;
+        if (group_tolerance>0.0f)
+            for (int r=0; r<(int)reps.size() && joined<0; r++)
+                if ( block[r]==b && distance_skewedKP(kp->KPvec[i], kp->KPvec[reps[r]], tol, normType) <= tol )
+                    joined = r;
+        if (joined<0)
+        {
+            reps.push_back(i);
+            support.push_back(1);
+            block.push_back(b);
+        }
+        else
+            support[joined]++;
+    }
+
+    std::vector<bool> keep(reps.size(), true);
+    if ( group_cap>0 && (int)reps.size()>group_cap )
+    {
+        std::vector< std::pair<int,int> > order(reps.size());
+        for (int r=0; r<(int)reps.size(); r++)
+            order[r] = std::make_pair(-support[r], r);
+        std::stable_sort(order.begin(), order.end());
+        int kept_in_block[3] = {0, 0, 0};
+        for (int k=0; k<(int)order.size(); k++)
+        {
+            int r = order[k].second;
+            if (kept_in_block[block[r]]<group_cap)
+                kept_in_block[block[r]]++;
+            else
+                keep[r] = false;
+        }
+    }
+
+    std::vector<IMAS::skewed_KeyPoint> kept;
+    int blocks_after[3] = {0, 0, 0};
+    for (int r=0; r<(int)reps.size(); r++)
+        if (keep[r])
+        {
+            kept.push_back(kp->KPvec[reps[r]]);
+            blocks_after[block[r]]++;
+        }
+    kp->KPvec.swap(kept);
+
+    // a generalised keypoint with both signs of the Laplacian keeps both blocks
+    for (int b=0; b<3; b++)
+        assert( blocks_before[b]==0 || blocks_after[b]>0 );
+
+    return n - (int)kp->KPvec.size();
+}
+
+
+/**
+ * @brief Support of a generalised keypoint, i.e. the number of distinct simulated views its SIIM keypoints come from.
+ * Views are weighted by 1/t if <support_tilt_weight> is set.
+ * @param kp A generalised keypoint
+ * @author Mariano Rodríguez
+ */
+float support_IMAS_KP(const IMAS::IMAS_KeyPoint* kp)
+{
+    std::vector< std::pair<float,float> > views;
+    float support = 0.0f;
+    for (int i=0; i<(int)kp->KPvec.size(); i++)
+    {
+        std::pair<float,float> view(kp->KPvec[i].t, kp->KPvec[i].theta);
+        if ( std::find(views.begin(), views.end(), view)==views.end() )
+        {
+            views.push_back(view);
+            support += support_tilt_weight ? 1.0f/view.first : 1.0f;
+        }
+    }
+    return support;
+}
+
+
+#ifdef _NO_OPENCV
+bool positive_laplacian(const IMAS::skewed_KeyPoint& kp)
+{
+    return static_cast<descriptor*>(kp.pt.kp_ptr)->kP.signLaplacian;
+}
+
+/**
+ * @brief Moves the SURF keypoints with a positive Laplacian sign ahead of the others inside a generalised keypoint,
+ * so that distance_imasKP() only goes through pairs of keypoints that can be matched.
+ * @param kp A generalised keypoint
+ * @author Mariano Rodríguez
+ */
+void partition_IMAS_KP(IMAS::IMAS_KeyPoint* kp)
+{
+    std::vector<IMAS::skewed_KeyPoint>::iterator negative = std::stable_partition(kp->KPvec.begin(), kp->KPvec.end(), positive_laplacian);
+    kp->npositive = (int) (negative - kp->KPvec.begin());
+}
+#endif
+
+
+/**
+ * @brief Keypoint budget of a simulated view with tilt t.
+ * @param budget_density Share of the image budget per unit of simulated area (0 if there is no image budget).
+ * @return The smallest of keypoint_budget and the share of the image budget, 0 if there is no budget.
+ * @author Mariano Rodríguez
+ */
+int simulation_budget(float budget_density, float t)
+{
+    int budget = keypoint_budget;
+    if (budget_density>0.0f)
+    {
+        int share = (std::max)(1, (int) (budget_density/t + 0.5f));
+        budget = (budget>0) ? (std::min)(budget, share) : share;
+    }
+    return budget;
+}
+
+
 /**
  * @brief Computes all hyper-descriptors comming from a set of optical tilts digitally generated.
  * @param image Input image.
@@ -2095,19 +3120,244 @@ void Add_IMAS_KP(IMAS_keypointlist& keys, std::vector<IMAS::IMAS_KeyPoint*>& map
  * @return The total number of generalised keypoints that have been found.
  * @author Mariano Rodríguez
  */
-int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vector<IMAS::IMAS_KeyPoint*>& imasKP, const std::vector<tilt_simu>& simu_details,std::vector<float>& stats)
+int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vector<IMAS::IMAS_KeyPoint*>& imasKP, std::vector<IMAS::IMAS_Descriptors*>& descriptors, const std::vector<tilt_simu>& simu_details,std::vector<float>& stats)
 {
-    std::vector<IMAS::IMAS_KeyPoint*> mapKP;
-    mapKP.resize(width*height);
+    std::vector<IMAS::IMAS_Extractor> extractors(1, CurrentDetectorDescriptor());
+    std::vector< std::vector<IMAS::IMAS_KeyPoint*> > imasKPs;
+    std::vector< std::vector<IMAS::IMAS_Descriptors*> > descriptorss;
+    std::vector< std::vector<float> > statss;
+
+    int num_keys_total = IMAS_detectAndCompute(image, width, height, extractors, imasKPs, descriptorss, simu_details, statss);
+
+    imasKP.insert(imasKP.end(), imasKPs[0].begin(), imasKPs[0].end());
+    descriptors.insert(descriptors.end(), descriptorss[0].begin(), descriptorss[0].end());
+    stats.insert(stats.end(), statss[0].begin(), statss[0].end());
+    return num_keys_total;
+}
+
+
+/**
+ * @brief Describes a simulated view with every extractor and adds its SIIM keypoints to the generalised keypoints of each one.
+ * @param queryImg The simulated view.
+ * @param (width,height) Size of the input image.
+ * @param (t,theta) The simulated optical tilt, theta in degrees. Keypoints are brought back to the input image when t!=1.
+ * @param budget Keypoint budget of the view.
+ * @param extractors Detectors/descriptors to compute.
+ * @param mapKP Generalised keypoints of each extractor, indexed by position in the input image.
+ * @param descriptors Receive the descriptors of the view, per extractor.
+ * @author Mariano Rodríguez
+ */
+void describe_simulation(IMAS::IMAS_Matrix& queryImg, int width, int height, float t, float theta, int budget, const std::vector<IMAS::IMAS_Extractor>& extractors, std::vector< std::vector<IMAS::IMAS_KeyPoint*> >& mapKP, std::vector< std::vector<IMAS::IMAS_Descriptors*> >& descriptors)
+{
+    for (int e = 0; e < (int) extractors.size(); e++)
+    {
+        // compute keypoint descriptors on simulated images.
+        IMAS_keypointlist keypoints, keys;
+        IMAS::IMAS_Descriptors* owner = new IMAS::IMAS_Descriptors;
+#ifdef _NO_OPENCV
+        if (deferred_extractor(extractors[e]))
+            detect_local_peaks(queryImg, (t==1) ? keys : keypoints, t, theta, budget, owner, extractors[e]);
+        else
+#endif
+        compute_local_descriptor_keypoints(queryImg, (t==1) ? keys : keypoints, t, theta, budget, owner, extractors[e]);
+
+        if (t != 1)
+        {
+            keys.reserve(keypoints.size());
+
+            /* check if the keypoint is located on the boundary of the parallelogram (i.e., the boundary of the distorted input image). If so, remove it to avoid boundary artifacts. */
+            for ( int cc = 0; cc < (int) keypoints.size(); cc++ )
+            {
+
+                float x0, y0, BorderTh;
+
+                x0 = keypoints[cc].pt.x;
+                y0 = keypoints[cc].pt.y;
+
+                //Keep the descriptor off the border... BorderTh = diagonal length of the descriptor
+                BorderTh = keypoints[cc].size;
+
+                if (tiltedcoor2imagecoor(x0, y0, width, height,BorderTh, t, theta* M_PI / 180))
+                {
+                    // Normalize the coordinates of the matched points by compensate the simulate affine transformations
+                    keypoints[cc].pt.x = x0;
+                    keypoints[cc].pt.y = y0;
+
+                    keys.push_back(keypoints[cc]);
+
+                }
+
+            }
+        }
+
+        //std::random_shuffle(keys.KeyList.begin(),keys.KeyList.end());
+#pragma omp critical
+        {
+            descriptors[e].push_back(owner);
+            if ( keys.size() != 0 )
+                Add_IMAS_KP(keys, mapKP[e], width,height);
+        }
+    }
+}
 
-    for(int i=0;i<width*height;i++)
-        mapKP[0]= 0;
+
+#ifdef _NO_OPENCV
+bool smaller_peak(const std::pair<int,IMAS::skewed_KeyPoint>& a, const std::pair<int,IMAS::skewed_KeyPoint>& b)
+{
+    return a.first < b.first;
+}
+
+/**
+ * @brief Describes the peaks found by detect_local_peaks() that are kept in generalised keypoints, and forms the
+ * generalised keypoints again from the SIIM keypoints they give.
+ * @param mapKP Generalised keypoints of the extractor, indexed by position in the input image.
+ * @param (width,height) Size of the input image.
+ * @param descriptors Simulated views of the extractor. Their scale spaces are released.
+ * @param ex The detector/descriptor to compute.
+ * @param (pruned,pruned_peaks) Return the number of generalised keypoints dropped by <min_support> before description,
+ * and of their peaks, which are not described.
+ * @author Mariano Rodríguez
+ */
+void describe_deferred_peaks(std::vector<IMAS::IMAS_KeyPoint*>& mapKP, int width, int height, std::vector<IMAS::IMAS_Descriptors*>& descriptors, const IMAS::IMAS_Extractor& ex, int& pruned, int& pruned_peaks)
+{
+    int num_views = (int) descriptors.size();
+    std::map<IMAS::IMAS_Descriptors*, int> view;
+    std::vector< std::vector<bool> > wanted(num_views);
+    for (int v = 0; v < num_views; v++)
+    {
+        view[descriptors[v]] = v;
+        if (descriptors[v]->levels)
+            wanted[v].assign(descriptors[v]->peaks.size(), false);
+    }
+
+    // The support of a generalised keypoint only depends on the simulated views of its peaks, so those found in too few views
+    // are dropped before any description, and before any reduction as without deferred description.
+    // Without tolerance, reduce_IMAS_KP() keeps the first group_cap SIIM keypoints, which come from the first group_cap peaks at most.
+    bool capped = ( group_cap>0 && group_tolerance<=0.0f );
+    int num_peaks = 0, num_described = 0;
+    pruned = pruned_peaks = 0;
+    for (int v = 0; v < num_views; v++)
+        num_peaks += (int) descriptors[v]->peaks.size();
+    for (int i = 0; i < (int) mapKP.size(); i++)
+        if (mapKP[i]!=0)
+        {
+            if ( min_support>0.0f && support_IMAS_KP(mapKP[i])<min_support )
+            {
+                pruned++;
+                pruned_peaks += mapKP[i]->KPvec.size();
+                delete mapKP[i];
+                mapKP[i] = 0;
+                continue;
+            }
+            if ( capped && (int)mapKP[i]->KPvec.size()>group_cap )
+                mapKP[i]->KPvec.resize(group_cap);
+            for (int j = 0; j < (int) mapKP[i]->KPvec.size(); j++)
+            {
+                IMAS::IMAS_Peak* pk = static_cast<IMAS::IMAS_Peak*>(mapKP[i]->KPvec[j].pt.kp_ptr);
+                wanted[view[pk->owner]][pk->peak] = true;
+                num_described++;
+            }
+        }
+
+    // Descriptors of every view, one task per view
+    std::vector< std::vector<int> > first(num_views);
+    std::vector< std::vector<void*> > ptrs(num_views);
+#pragma omp parallel
+#pragma omp master
+    {
+        for (int v = 0; v < num_views; v++)
+            if (descriptors[v]->levels)
+            {
+#pragma omp task firstprivate(v) shared(descriptors, wanted, first, ptrs, ex)
+                {
+                    IMAS::IMAS_Descriptors* owner = descriptors[v];
+                    siftPar par = view_sift_parameters(ex, 0);
+                    owner->sift = new keypointslist;
+#ifdef _ACD
+                    if (ex.desc_type == IMAS_AC || ex.desc_type ==IMAS_AC_Q || ex.desc_type == IMAS_AC_W)
+                        owner->acpool = new ac_patch_pool;
+#endif
+                    describe_sift_peaks(*owner->levels, &wanted[v], *owner->sift, first[v], par, owner->acpool);
+                    sift_descriptor_pointers(owner, ex, ptrs[v]);
+                    delete owner->levels;
+                    owner->levels = NULL;
+                }
+            }
+    }
+
+    // Kept peaks of every view, in their order, at their position in the input image
+    std::vector< std::vector< std::pair<int,IMAS::skewed_KeyPoint> > > kept(num_views);
+    for (int i = 0; i < (int) mapKP.size(); i++)
+        if (mapKP[i]!=0)
+        {
+            for (int j = 0; j < (int) mapKP[i]->KPvec.size(); j++)
+            {
+                IMAS::IMAS_Peak* pk = static_cast<IMAS::IMAS_Peak*>(mapKP[i]->KPvec[j].pt.kp_ptr);
+                kept[view[pk->owner]].push_back(std::make_pair(pk->peak, mapKP[i]->KPvec[j]));
+            }
+            delete mapKP[i];
+            mapKP[i] = 0;
+        }
+
+    // Generalised keypoints are formed again from the SIIM keypoints given by the peaks, view after view,
+    // so that peaks rejected at description do not take part in them
+    for (int v = 0; v < num_views; v++)
+    {
+        std::sort(kept[v].begin(), kept[v].end(), smaller_peak);
+        IMAS_keypointlist keys;
+        for (int j = 0; j < (int) kept[v].size(); j++)
+        {
+            int p = kept[v][j].first;
+            for (int k = first[v][p]; k < first[v][p+1]; k++)
+            {
+                const keypoint& key = (*descriptors[v]->sift)[k];
+                IMAS::skewed_KeyPoint kp = kept[v][j].second;
+                kp.pt.kp_ptr = ptrs[v][k];
+                kp.size = key.radius;
+                kp.scale = key.scale;
+                kp.angle = key.angle;
+                keys.push_back(kp);
+            }
+        }
+        if ( keys.size() != 0 )
+            Add_IMAS_KP(keys, mapKP, width, height);
+    }
+
+    for (int v = 0; v < num_views; v++)
+    {
+        std::vector<IMAS::IMAS_Peak>().swap(descriptors[v]->peaks);
+        if (descriptors[v]->sift)
+            release_reduced_sift(descriptors[v], ex);
+    }
+    my_Printf("   Deferred description: %d scale-space peaks out of %d have been described\n", num_described, num_peaks);
+}
+#endif
+
+
+int IMAS_detectAndCompute(vector<float>& image, int width, int height, const std::vector<IMAS::IMAS_Extractor>& extractors, std::vector< std::vector<IMAS::IMAS_KeyPoint*> >& imasKP, std::vector< std::vector<IMAS::IMAS_Descriptors*> >& descriptors, const std::vector<tilt_simu>& simu_details, std::vector< std::vector<float> >& stats)
+{
+    int num_extractors = (int) extractors.size();
+    std::vector< std::vector<IMAS::IMAS_KeyPoint*> > mapKP(num_extractors, std::vector<IMAS::IMAS_KeyPoint*>(width*height, (IMAS::IMAS_KeyPoint*) 0));
+    imasKP.resize(num_extractors);
+    descriptors.resize(num_extractors);
+    stats.resize(num_extractors);
 
     int num_tilt, tt;
     int num_keys_total=0;
 
 
     num_tilt = simu_details.size();
+
+    // keypoint budget of the image, shared among simulations in proportion to their area
+    float budget_density = 0.0f;
+    if (keypoint_budget_image>0)
+    {
+        float total_area = 0.0f;
+        for (tt = 1; tt <= num_tilt; tt++)
+            total_area += ( (simu_details[tt-1].t==1) ? 1 : simu_details[tt-1].rots.size() ) / simu_details[tt-1].t;
+        budget_density = keypoint_budget_image / total_area;
+    }
+
 #pragma omp parallel
 #pragma omp master
     {
@@ -2116,18 +3366,13 @@ int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vecto
             float t = simu_details[tt-1].t;
             if ( t == 1 )  // it will ignore rotations for tilts=1 !!!
             {
-#pragma omp task firstprivate(t) shared(image, mapKP)
+#pragma omp task firstprivate(t) shared(image, mapKP, descriptors, extractors)
                 {
-                    IMAS_keypointlist keys;
                     IMAS::IMAS_Matrix queryImg;
 #pragma omp critical
                     vectorimage2imasimage(image, queryImg, width, height);
 
-                    compute_local_descriptor_keypoints(queryImg,keys,t,0.0f);
-
-                    //std::random_shuffle(keys.KeyList.begin(),keys.KeyList.end());
-#pragma omp critical
-                    Add_IMAS_KP(keys, mapKP, width,height);
+                    describe_simulation(queryImg, width, height, t, 0.0f, simulation_budget(budget_density,t), extractors, mapKP, descriptors);
                 }
 
             }
@@ -2139,7 +3384,7 @@ int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vecto
                 // Loop on rotations.
                 for ( int rr = 1; rr <= num_rot1; rr++ )
                 {
-#pragma omp task firstprivate(tt,rr,t,width,height) shared(mapKP,image)
+#pragma omp task firstprivate(tt,rr,t,width,height) shared(mapKP,image,descriptors,extractors)
                     {
 
                         float theta = simu_details[tt-1].rots[rr-1];
@@ -2158,74 +3403,151 @@ int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vecto
                         IMAS::IMAS_Matrix queryImg;
                         vectorimage2imasimage(image_tmp, queryImg, width_t, height_t);
 
-                        // compute keypoint descriptors on simulated images.
-                        IMAS_keypointlist keypoints, keys;
-                        IMAS_keypointlist* keypoints_filtered = &(keys);
-                        keys.clear();
+                        // The simulated view is described by every extractor
+                        describe_simulation(queryImg, width, height, t, theta, simulation_budget(budget_density,t), extractors, mapKP, descriptors);
+                    }
+                }// end of for loop on rotation
+            }
+        } // end of foor loop on tilts
+    }
+
+    // Reduction and partition of generalised keypoints depend on the descriptor
+    IMAS::IMAS_Extractor current = CurrentDetectorDescriptor();
+    for (int e = 0; e < num_extractors; e++)
+    {
+        UseDetectorDescriptor(extractors[e]);
 
+        // optional pruning of generalised keypoints found in few simulated views,
+        // first done on the peaks with deferred description so that they are not described,
+        // and then on the generalised keypoints formed again from the described ones
+        int pruned = 0, pruned_siim = 0;
+#ifdef _NO_OPENCV
+        if (deferred_extractor(extractors[e]))
+            describe_deferred_peaks(mapKP[e], width, height, descriptors[e], extractors[e], pruned, pruned_siim);
+#endif
 
-                        compute_local_descriptor_keypoints(queryImg,(keypoints),t,theta);
+        if ( min_support>0.0f )
+            for (int i = 0; i < (int) mapKP[e].size(); i++)
+                if ( mapKP[e][i]!=0 && support_IMAS_KP(mapKP[e][i])<min_support )
+                {
+                    pruned++;
+                    pruned_siim += mapKP[e][i]->KPvec.size();
+                    delete mapKP[e][i];
+                    mapKP[e][i] = 0;
+                }
 
+        // optional reduction of SIIM keypoints inside each generalised keypoint
+        if ( group_tolerance>0.0f || group_cap>0 )
+        {
+            int removed = 0, before = 0;
+            for (int i = 0; i < (int) mapKP[e].size(); i++)
+                if (mapKP[e][i]!=0)
+                {
+                    before += mapKP[e][i]->KPvec.size();
+                    removed += reduce_IMAS_KP(mapKP[e][i]);
+                }
+            my_Printf("   Reduction of hyper-descriptors: %d SIIM descriptors out of %d have been dropped (cap = %d, tolerance = %.2f)\n", removed, before, group_cap, group_tolerance);
+        }
 
-                        /* check if the keypoint is located on the boundary of the parallelogram (i.e., the boundary of the distorted input image). If so, remove it to avoid boundary artifacts. */
-                        if ( keypoints.size() != 0 )
-                        {
-                            for ( int cc = 0; cc < (int) keypoints.size(); cc++ )
-                            {
+#ifdef _NO_OPENCV
+        // SURF keypoints are only compared when their Laplacian signs agree
+        if ( desc_type==IMAS_SURF )
+            for (int i = 0; i < (int) mapKP[e].size(); i++)
+                if (mapKP[e][i]!=0)
+                    partition_IMAS_KP(mapKP[e][i]);
+#endif
 
-                                float x0, y0, BorderTh;
+        // save in imasKP and do stats
+        int num_max = 0, num_min = 500000, total = 0, num_keys = 0;
+        float num_mean = 0;
+        for (int i = 0; i < (int) mapKP[e].size(); i++)
+            if (mapKP[e][i]!=0)
+            {
+                imasKP[e].push_back(mapKP[e][i]);
+                total +=mapKP[e][i]->KPvec.size();
+                num_keys += 1;//(int) mapKP[i]->KPvec.size();
+                if (num_max<(int)mapKP[e][i]->KPvec.size())
+                    num_max = mapKP[e][i]->KPvec.size();
+                if (num_min>(int)mapKP[e][i]->KPvec.size())
+                    num_min = mapKP[e][i]->KPvec.size();
+                num_mean +=mapKP[e][i]->KPvec.size();
+            }
+        num_mean = num_mean/num_keys;
+        stats[e].push_back((float)total);
+        stats[e].push_back((float)num_min);
+        stats[e].push_back(num_mean);
+        stats[e].push_back((float)num_max);
+        stats[e].push_back((float)pruned);
+        stats[e].push_back((float)pruned_siim);
+        num_keys_total += num_keys;
+    }
+    UseDetectorDescriptor(current);
 
-                                x0 = keypoints[cc].pt.x;
-                                y0 = keypoints[cc].pt.y;
+    // image buffers cached for the simulations of this image are not kept for the next one
+    flimage_pool::trim_all();
 
-                                //Keep the descriptor off the border... BorderTh = diagonal length of the descriptor
-                                BorderTh = keypoints[cc].size;
+    return num_keys_total;
+}
 
-                                if (tiltedcoor2imagecoor(x0, y0, width, height,BorderTh, t, theta* M_PI / 180))
-                                {
-                                    // Normalize the coordinates of the matched points by compensate the simulate affine transformations
-                                    keypoints[cc].pt.x = x0;
-                                    keypoints[cc].pt.y = y0;
 
-                                    keypoints_filtered->push_back(keypoints[cc]);
 
-                                }
 
-                            }
+/**
+ * @brief Frees generalised keypoints and the descriptors they point into, as returned by IMAS_detectAndCompute(). Both lists are left empty.
+ * @param imasKP Generalised keypoints
+ * @param descriptors Descriptors of the simulated views
+ * @author Mariano Rodríguez
+ */
+void IMAS_release(std::vector<IMAS::IMAS_KeyPoint*>& imasKP, std::vector<IMAS::IMAS_Descriptors*>& descriptors)
+{
+    for (int i = 0; i < (int) imasKP.size(); i++)
+        delete imasKP[i];
+    imasKP.clear();
+    for (int i = 0; i < (int) descriptors.size(); i++)
+        delete descriptors[i];
+    descriptors.clear();
+}
 
-                            //std::random_shuffle(keys.KeyList.begin(),keys.KeyList.end());
-#pragma omp critical
-                            Add_IMAS_KP(keys, mapKP, width,height);
-                        }
-                    }
-                }// end of for loop on rotation
-            }
-        } // end of foor loop on tilts
-    }
 
-    // save in imasKP and do stats
-    int num_max = 0, num_min = 500000, total = 0;
-    float num_mean = 0;
-    for (int i = 0; i < (int) mapKP.size(); i++)
-        if (mapKP[i]!=0)
-        {
-            imasKP.push_back(mapKP[i]);
-            total +=mapKP[i]->KPvec.size();
-            num_keys_total += 1;//(int) mapKP[i]->KPvec.size();
-            if (num_max<(int)mapKP[i]->KPvec.size())
-                num_max = mapKP[i]->KPvec.size();
-            if (num_min>(int)mapKP[i]->KPvec.size())
-                num_min = mapKP[i]->KPvec.size();
-            num_mean +=mapKP[i]->KPvec.size();
-        }
-    num_mean = num_mean/num_keys_total;
-    stats.push_back((float)total);
-    stats.push_back((float)num_min);
-    stats.push_back(num_mean);
-    stats.push_back((float)num_max);
+#ifdef _LDAHASH
+int IMAS_load_projection(const char* filename)
+{
+    if (!pca_load(filename))
+        return 0;
+    return pca_projection.dim;
+}
 
-    return num_keys_total;
+int IMAS_train_projection(std::vector<float>& ipixels1, int w1, int h1, std::vector<float>& ipixels2, int w2, int h2, imasCoverings& ic, int dim, const char* filename)
+{
+    // Full SIFT vectors of the current method, even if it is a reduced one
+    IMAS::IMAS_Extractor ex = CurrentDetectorDescriptor();
+    if (ex.desc_type==IMAS_PCASIFT || ex.desc_type==IMAS_PCAROOTSIFT)
+        ex.desc_type = ex.rooted ? IMAS_ROOTSIFT : IMAS_SIFT;
+    std::vector<IMAS::IMAS_Extractor> extractors(1, ex);
+
+    std::vector< std::vector<IMAS::IMAS_KeyPoint*> > keys1, keys2;
+    std::vector< std::vector<IMAS::IMAS_Descriptors*> > descriptors1, descriptors2;
+    std::vector< std::vector<float> > stats1, stats2;
+    IMAS_detectAndCompute(ipixels1, w1, h1, extractors, keys1, descriptors1, ic.getSimuDetails1(), stats1);
+    IMAS_detectAndCompute(ipixels2, w2, h2, extractors, keys2, descriptors2, ic.getSimuDetails2(), stats2);
+
+    std::vector<const float*> samples;
+    for (int i = 0; i < (int) keys1[0].size(); i++)
+        for (int j = 0; j < (int) keys1[0][i]->KPvec.size(); j++)
+            samples.push_back(static_cast<keypoint*>(keys1[0][i]->KPvec[j].pt.kp_ptr)->vec);
+    for (int i = 0; i < (int) keys2[0].size(); i++)
+        for (int j = 0; j < (int) keys2[0][i]->KPvec.size(); j++)
+            samples.push_back(static_cast<keypoint*>(keys2[0][i]->KPvec[j].pt.kp_ptr)->vec);
+
+    int num_samples = (int) samples.size();
+    if (!pca_train(samples, dim, filename))
+        num_samples = 0;
+
+    IMAS_release(keys1[0], descriptors1[0]);
+    IMAS_release(keys2[0], descriptors2[0]);
+    return num_samples;
 }
+#endif
 
 
 
@@ -2308,39 +3630,83 @@ int IMAS_detectAndCompute(vector<float>& image, int width, int height,std::vecto
  * @param Minfoall Returns more info on the matches
  * @param flag_resize Tells the algo if you want to resize the image
  * @param applyfilter Tells which filters should be applied in the function compute_IMAS_matches()
+ * @param prior Model from image1 to image2 known in advance (e.g. from a previous frame): a homography, or a fundamental matrix
+ * if <applyfilter> estimates one. Hyper-descriptors of image1 are only matched to those of image2 lying within <prior_radius> pixels
+ * of their predicted position (or epipolar line). Not used if <prior_radius> is not positive.
  */
-void IMAS_Impl(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2, int w2, int h2, vector<float>& data, matchingslist& matchings,imasCoverings& ic, int applyfilter)
+void IMAS_Impl(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2, int w2, int h2, vector<float>& data, matchingslist& matchings,imasCoverings& ic, int applyfilter, const TypeMap& prior, float prior_radius)
 {
+    const TypeMap* guide = (prior_radius>0.0f) ? &prior : NULL;
+    bool epipolar = (applyfilter==ORSA_FUNDAMENTAL || applyfilter==USAC_FUNDAMENTAL);
 
     ///// Compute IMAS keypoints
-    std::vector<IMAS::IMAS_KeyPoint*> keys1;
-    std::vector<IMAS::IMAS_KeyPoint*> keys2;
-    keys1.clear();
-    keys2.clear();
-
-    int num_keys1=0, num_keys2=0;
+    // The current detector/descriptor and the extra ones are computed on the same simulated views
+    std::vector<IMAS::IMAS_Extractor> extractors(1, CurrentDetectorDescriptor());
+    extractors.insert(extractors.end(), extra_extractors.begin(), extra_extractors.end());
+    int num_extractors = (int) extractors.size();
 
+    std::vector< std::vector<IMAS::IMAS_KeyPoint*> > keys1;
+    std::vector< std::vector<IMAS::IMAS_KeyPoint*> > keys2;
+    std::vector< std::vector<IMAS::IMAS_Descriptors*> > descriptors1, descriptors2;
 
-    my_Printf("IMAS-Detector with %s...\n",desc_name.c_str());
+    std::string names = desc_name;
+    for (int e=1; e<num_extractors; e++)
+        names += " + " + extractors[e].desc_name;
+    my_Printf("IMAS-Detector with %s...\n",names.c_str());
 
     IMAS_time tstart = IMAS::IMAS_getTickCount();
 
     _arearatio = ic.getAreaRatio();
+    _covering_radius = ic.getRadius();
 
-    std::vector<float> stats1,stats2;
-    num_keys1 = IMAS_detectAndCompute(ipixels1, w1, h1, keys1, ic.getSimuDetails1(),stats1);
-    num_keys2 = IMAS_detectAndCompute(ipixels2, w2, h2, keys2, ic.getSimuDetails2(),stats2);
+    std::vector< std::vector<float> > stats1,stats2;
+    IMAS_detectAndCompute(ipixels1, w1, h1, extractors, keys1, descriptors1, ic.getSimuDetails1(),stats1);
+    IMAS_detectAndCompute(ipixels2, w2, h2, extractors, keys2, descriptors2, ic.getSimuDetails2(),stats2);
 
-    my_Printf("   %d hyper-descriptors from %d SIIM descriptors have been found in %d simulated versions of image 1\n", num_keys1,(int)stats1[0],ic.getTotSimu1());
-    my_Printf("      stats: group_min = %d , group_mean = %.3f, group_max = %d\n",(int)stats1[1],stats1[2],(int)stats1[3]);
+    for (int e=0; e<num_extractors; e++)
+    {
+        if (num_extractors>1)
+            my_Printf("   %s:\n", extractors[e].desc_name.c_str());
+        my_Printf("   %d hyper-descriptors from %d SIIM descriptors have been found in %d simulated versions of image 1\n", (int)keys1[e].size(),(int)stats1[e][0],ic.getTotSimu1());
+        my_Printf("      stats: group_min = %d , group_mean = %.3f, group_max = %d\n",(int)stats1[e][1],stats1[e][2],(int)stats1[e][3]);
+        if (min_support>0.0f)
+            my_Printf("      support: %d hyper-descriptors (%d SIIM descriptors) found in less than %.2f simulated versions have been dropped\n",(int)stats1[e][4],(int)stats1[e][5],min_support);
 
-    my_Printf("   %d hyper-descriptors from %d SIIM descriptors have been found in %d simulated versions of image 2\n", num_keys2,(int)stats2[0],ic.getTotSimu2());
-    my_Printf("      stats: group_min = %d , group_mean = %.3f, group_max = %d\n",(int)stats2[1],stats2[2],(int)stats2[3]);
+        my_Printf("   %d hyper-descriptors from %d SIIM descriptors have been found in %d simulated versions of image 2\n", (int)keys2[e].size(),(int)stats2[e][0],ic.getTotSimu2());
+        my_Printf("      stats: group_min = %d , group_mean = %.3f, group_max = %d\n",(int)stats2[e][1],stats2[e][2],(int)stats2[e][3]);
+        if (min_support>0.0f)
+            my_Printf("      support: %d hyper-descriptors (%d SIIM descriptors) found in less than %.2f simulated versions have been dropped\n",(int)stats2[e][4],(int)stats2[e][5],min_support);
+    }
 
     my_Printf("IMAS-Detector accomplished in %.2f seconds.\n \n", (IMAS::IMAS_getTickCount() - tstart)/ IMAS::IMAS_getTickFrequency());
 
 
-    IMAS_matcher(w1, h1, w2, h2, keys1, keys2, matchings, applyfilter);
+    if (num_extractors==1)
+        IMAS_matcher(w1, h1, w2, h2, keys1[0], keys2[0], matchings, applyfilter, guide, prior_radius, epipolar);
+    else
+    {
+        // RAW matches of every extractor are filtered together.
+        // The a-contrario image is only described by the current extractor.
+        std::vector<IMAS::IMAS_KeyPoint*> no_keys3;
+        for (int e=0; e<num_extractors; e++)
+        {
+            UseDetectorDescriptor(extractors[e]);
+            my_Printf("%s ", desc_name.c_str());
+            matchingslist matchings_e;
+            if (e>0)
+                keys3.swap(no_keys3);
+            IMAS_match(w1, h1, w2, h2, keys1[e], keys2[e], matchings_e, guide, prior_radius, epipolar);
+            if (e>0)
+                keys3.swap(no_keys3);
+
+            if (normType==IMAS::NORM_L2) //the square wasn't taken before for speed
+                for (int i = 0; i < (int) matchings_e.size(); i++)
+                    matchings_e[i].distance = sqrt(matchings_e[i].distance);
+            matchings.insert(matchings.end(), matchings_e.begin(), matchings_e.end());
+        }
+        UseDetectorDescriptor(extractors[0]);
+        IMAS_filter(w1, h1, w2, h2, matchings, applyfilter);
+    }
 
 
 
@@ -2365,7 +3731,7 @@ void IMAS_Impl(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2,
         data.push_back(ptr_in->second.t); //t_im2_2
         data.push_back(ptr_in->second.theta); //theta2
 
-        if (normType==IMAS::NORM_L2) //the square wasn't taken before for speed
+        if (num_extractors==1 && normType==IMAS::NORM_L2) //the square wasn't taken before for speed
             data.push_back(sqrt(ptr_in->distance));
         else
             data.push_back(ptr_in->distance);
@@ -2373,9 +3739,18 @@ void IMAS_Impl(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2,
 
 
     my_Printf("Done.\n\n");
-    keys1.clear();
-    keys2.clear();
+    for (int e=0; e<num_extractors; e++)
+    {
+        IMAS_release(keys1[e], descriptors1[e]);
+        IMAS_release(keys2[e], descriptors2[e]);
+    }
     ipixels1.clear();
     ipixels2.clear();
 
 }
+
+
+void IMAS_Impl(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2, int w2, int h2, vector<float>& data, matchingslist& matchings,imasCoverings& ic, int applyfilter)
+{
+    IMAS_Impl(ipixels1, w1, h1, ipixels2, w2, h2, data, matchings, ic, applyfilter, TypeMap::eye(3), 0.0f);
+}
@@ -53,6 +53,8 @@
     #define IMAS_LDA128   42
     #define IMAS_DIF64    43
     #define IMAS_LDA64    44
+    #define IMAS_PCASIFT      45    // SIFT reduced by the projection of pca_load()
+    #define IMAS_PCAROOTSIFT  46    // RootSIFT reduced by the projection of pca_load()
 #endif
 
 #else
@@ -83,8 +85,30 @@ typedef libNumerics::matrix<double> TypeMap;
 
 extern std::vector<TypeMap> IdentifiedMaps;
 
+extern unsigned int orsa_seed;
+
 extern int rho;
 
+extern int group_cap;
+extern float group_tolerance;
+
+extern float min_support;
+extern bool support_tilt_weight;
+
+extern int keypoint_budget;
+extern int keypoint_budget_image;
+extern bool keypoint_anms;
+
+extern bool sift_half_storage;
+
+extern bool defer_description;
+
+extern int sim_gating;
+
+extern int ac_shortlist_k;
+extern bool ac_shortlist_check;
+extern bool ac_gradient_patches;
+
 #ifdef _NO_OPENCV
 typedef double IMAS_time;
 #else
@@ -106,6 +130,13 @@ extern std::string desc_name;
  */
 extern float default_radius;
 
+#ifdef _NO_OPENCV
+// demo_lib_sift.h includes this file
+struct keypoint;
+class ac_patch_pool;
+struct sift_levels;
+#endif
+
 namespace IMAS
 {
 #ifdef _NO_OPENCV
@@ -145,14 +176,76 @@ struct skewed_KeyPoint
 
 struct IMAS_KeyPoint
 {
+    IMAS_KeyPoint(): x(0), y(0), sum_x(0), sum_y(0), npositive(-1) {}
     float x, y, sum_x, sum_y;
     std::vector< skewed_KeyPoint> KPvec;
+    /**
+     * @brief SURF only: KPvec[0..npositive) have a positive Laplacian sign and the others a negative one
+     * (see partition_IMAS_KP()). -1 if KPvec is not partitioned.
+     */
+    int npositive;
+};
+
+#ifdef _NO_OPENCV
+class IMAS_Descriptors;
+
+/**
+ * @brief A SIFT peak of a simulated view, standing for the SIIM keypoints it will give once described
+ * (see defer_description).
+ */
+struct IMAS_Peak
+{
+    IMAS_Descriptors* owner;
+    int peak;   // index in owner->levels->peaks
+};
+#endif
+
+/**
+ * @brief Owns the descriptors computed on one simulated view.
+ * SIIM keypoints of the view point into it (see point_data::kp_ptr), so it is to be kept until matching is over
+ * and then released with IMAS_release().
+ */
+class IMAS_Descriptors
+{
+public:
+    IMAS_Descriptors();
+    ~IMAS_Descriptors();
+#ifdef _NO_OPENCV
+    std::vector<keypoint>* sift;
+    ac_patch_pool* acpool;
+    listDescriptor* surf;
+    std::vector<void*> lda;
+    std::vector<float> pca;
+    sift_levels* levels;            // scale space of the view until its peaks are described
+    std::vector<IMAS_Peak> peaks;
+#else
+    std::vector<cv::Mat> rows;
+#endif
+private:
+    IMAS_Descriptors(const IMAS_Descriptors&);
+    IMAS_Descriptors& operator=(const IMAS_Descriptors&);
 };
 
 const int NORM_L1 = 1;
 const int NORM_L2 = 2;
 const int NORM_HAMMING = 3;
 
+/**
+ * @brief Settings of a detector/descriptor, as selected by SetDetectorDescriptor().
+ * Several of them can be computed on the same simulated views, see IMAS_detectAndCompute().
+ */
+struct IMAS_Extractor
+{
+    std::string desc_name;
+    int desc_type;
+    float nndrRatio;
+    int normType;
+    bool binary_desc;
+    bool rooted;
+    bool sift_desc;
+    float default_radius;
+};
+
 }
 
 
@@ -191,6 +284,7 @@ public:
 typedef std::vector<matching> matchingslist;
 
 extern std::vector<IMAS::IMAS_KeyPoint*> keys3;
+extern std::vector<IMAS::IMAS_Descriptors*> keys3_descriptors;
 
 
 /**
@@ -204,6 +298,29 @@ extern std::vector<IMAS::IMAS_KeyPoint*> keys3;
 std::string SetDetectorDescriptor(int DDIndex);
 
 
+/**
+ * @brief Returns the settings of the current detector/descriptor.
+ */
+IMAS::IMAS_Extractor CurrentDetectorDescriptor();
+
+/**
+ * @brief Returns the settings of a detector/descriptor without changing the current one.
+ * Match ratio and thresholds set by update_*() are not carried over.
+ * @param DDIndex The IMAS Index of the matching method.
+ */
+IMAS::IMAS_Extractor GetDetectorDescriptor(int DDIndex);
+
+/**
+ * @brief Makes <ex> the current detector/descriptor. Thresholds of the SIFT detector set by update_*() are kept.
+ */
+void UseDetectorDescriptor(const IMAS::IMAS_Extractor& ex);
+
+/**
+ * @brief Detectors/descriptors computed on the same simulated views as the current one by IMAS_Impl().
+ * Their matches are added to those of the current one before filtering.
+ */
+extern std::vector<IMAS::IMAS_Extractor> extra_extractors;
+
 void update_matchratio(float matchratio);
 void update_edge_threshold(float edge_thres);
 void update_tensor_threshold(float tensor_thres);
@@ -215,12 +332,50 @@ void update_tensor_threshold(float tensor_thres);
  * @param width Width of the input image.
  * @param height Height of the input image.
  * @param imasKP Returns a list of generalised keypoints.
+ * @param descriptors Returns the descriptors of the simulated views, which the SIIM keypoints of <imasKP> point into.
  * @param simu_details Specifies the optical tilts that are to be simulated.
  * @param stats A vector with statistics on found generalised keypoints. Mean, min or max of SIIM keypoints over all found generalised keypoints.
  * @return The total number of generalised keypoints that have been found.
  * @author Mariano Rodríguez
  */
-int IMAS_detectAndCompute(std::vector<float>& image, int width, int height, std::vector<IMAS::IMAS_KeyPoint *> &imasKP, const std::vector<tilt_simu>& simu_details, std::vector<float> &stats);
+int IMAS_detectAndCompute(std::vector<float>& image, int width, int height, std::vector<IMAS::IMAS_KeyPoint *> &imasKP, std::vector<IMAS::IMAS_Descriptors*>& descriptors, const std::vector<tilt_simu>& simu_details, std::vector<float> &stats);
+
+/**
+ * @brief Computes the hyper-keypoints of several detectors/descriptors at once. Each simulated view is computed
+ * only once and then described by every extractor.
+ * @param extractors Detectors/descriptors to compute, see GetDetectorDescriptor(). At most one of them may be an a-contrario one.
+ * @param imasKP Returns a list of generalised keypoints per extractor.
+ * @param descriptors Returns the descriptors of the simulated views per extractor.
+ * @param stats Returns the statistics of IMAS_detectAndCompute() per extractor.
+ * @return The total number of generalised keypoints that have been found, over all extractors.
+ * @author Mariano Rodríguez
+ */
+int IMAS_detectAndCompute(std::vector<float>& image, int width, int height, const std::vector<IMAS::IMAS_Extractor>& extractors, std::vector< std::vector<IMAS::IMAS_KeyPoint *> > &imasKP, std::vector< std::vector<IMAS::IMAS_Descriptors*> >& descriptors, const std::vector<tilt_simu>& simu_details, std::vector< std::vector<float> > &stats);
+
+/**
+ * @brief Frees generalised keypoints and the descriptors they point into, as returned by IMAS_detectAndCompute(). Both lists are left empty.
+ * @author Mariano Rodríguez
+ */
+void IMAS_release(std::vector<IMAS::IMAS_KeyPoint *> &imasKP, std::vector<IMAS::IMAS_Descriptors*>& descriptors);
+
+#ifdef _LDAHASH
+/**
+ * @brief Loads the projection of PCA-SIFT and PCA-RootSIFT, see pca_load().
+ * @return The number of dimensions of the reduced descriptors, 0 if the file could not be read.
+ * @author Mariano Rodríguez
+ */
+int IMAS_load_projection(const char* filename);
+
+/**
+ * @brief Trains the projection of PCA-SIFT and PCA-RootSIFT (see pca_train()) on the SIIM descriptors of two images
+ * and writes it to a file to be read by pca_load(). Descriptors are computed by the current method (RootSIFT if it is PCA-RootSIFT)
+ * on the simulated views of <ic>.
+ * @param dim Number of dimensions kept.
+ * @return The number of SIIM descriptors used for training, 0 if it failed.
+ * @author Mariano Rodríguez
+ */
+int IMAS_train_projection(std::vector<float>& ipixels1, int w1, int h1, std::vector<float>& ipixels2, int w2, int h2, imasCoverings& ic, int dim, const char* filename);
+#endif
 
 
 /**
@@ -301,4 +456,15 @@ int IMAS_detectAndCompute(std::vector<float>& image, int width, int height, std:
  * @param applyfilter Tells which filters should be applied in the function compute_IMAS_matches()
  */
 void IMAS_Impl(std::vector<float>& ipixels1, int w1, int h1, std::vector<float>& ipixels2, int w2, int h2, std::vector<float>& data, matchingslist& matchings, imasCoverings &ic, int applyfilter);
+
+/**
+ * @brief Same as IMAS_Impl() but guided by a homography from image1 to image2 known in advance (e.g. from a previous frame or from GNSS/INS).
+ * Target hyper-descriptors are indexed in a uniform grid, and each query one is only compared to those lying within
+ * <prior_radius> pixels of its predicted position. The ratio test is evaluated among them.
+ * If <applyfilter> estimates a fundamental matrix, <prior> is a fundamental matrix (x1^T F x2 = 0) and targets are looked for
+ * within <prior_radius> pixels of epipolar lines instead.
+ * @param prior Homography (or fundamental matrix) from image1 to image2
+ * @param prior_radius Uncertainty on the predicted positions, in pixels of image2
+ */
+void IMAS_Impl(std::vector<float>& ipixels1, int w1, int h1, std::vector<float>& ipixels2, int w2, int h2, std::vector<float>& data, matchingslist& matchings, imasCoverings &ic, int applyfilter, const TypeMap& prior, float prior_radius);
 #endif // _LIB_IMAS_H
@@ -7,6 +7,7 @@
   */
 
 #include "lib_ldahash.h"
+#include <cstdio>
 
 
 using namespace std;
@@ -53,7 +54,7 @@ ldadescriptor* lda_describe_from_SIFT(keypoint & siftdesc, int method)
 {
 
     assert(siftdesc.veclength==128);
-    BIN_WORD *singleBitWord = new BIN_WORD[64];
+    BIN_WORD singleBitWord[64];
 
     // compute words with particular bit turned on
     // singleBitWord[0] :  000000...000001  <=> 1 = 2^0
@@ -155,3 +156,149 @@ float lda_hamming_distance(ldadescriptor *k1,ldadescriptor *k2, float tdist)
     return(dist);
 }
 
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+pcaprojection pca_projection;
+
+/// Loads pca_projection from a text file:
+///   dim 128
+///   the 128 values of the mean
+///   dim rows of 128 values (the rows of A)
+bool pca_load(const char* filename)
+{
+    std::ifstream in(filename);
+    int dim, len;
+    if ( !(in >> dim >> len) || len!=128 || dim<1 || dim>128 )
+        return false;
+
+    std::vector<float> mean(128), A(dim*128);
+    for (int j=0; j<128; j++)
+        if ( !(in >> mean[j]) )
+            return false;
+    for (int j=0; j<dim*128; j++)
+        if ( !(in >> A[j]) )
+            return false;
+
+    pca_projection.dim = dim;
+    pca_projection.A.swap(A);
+    pca_projection.offset.resize(dim);
+    for (int r=0; r<dim; r++)
+        pca_projection.offset[r] = sseg_dot(&pca_projection.A[r*128], &mean[0], 128);
+    return true;
+}
+
+
+/// Principal components of <samples> (SIFT vectors): writes their mean and the <dim> eigenvectors
+/// of their covariance with largest eigenvalues to a file that pca_load() can read.
+bool pca_train(const std::vector<const float*>& samples, int dim, const char* filename)
+{
+    int n = (int) samples.size();
+    if ( n<2 || dim<1 || dim>128 )
+        return false;
+
+    std::vector<double> mean(128, 0.0), cov(128*128, 0.0), d(128);
+    for (int k=0; k<n; k++)
+        for (int j=0; j<128; j++)
+            mean[j] += samples[k][j];
+    for (int j=0; j<128; j++)
+        mean[j] /= n;
+
+    for (int k=0; k<n; k++)
+    {
+        for (int j=0; j<128; j++)
+            d[j] = samples[k][j] - mean[j];
+        for (int i=0; i<128; i++)
+            for (int j=i; j<128; j++)
+                cov[i*128+j] += d[i]*d[j];
+    }
+
+    libNumerics::matrix<double> C(128,128);
+    for (int i=0; i<128; i++)
+        for (int j=i; j<128; j++)
+            C(i,j) = C(j,i) = cov[i*128+j]/(n-1);
+
+    // C is symmetric: its eigenvectors are the columns of U, sorted by decreasing eigenvalue
+    libNumerics::SVD svd(C);
+
+    FILE* f = fopen(filename, "w");
+    if (!f)
+        return false;
+    fprintf(f, "%d 128\n", dim);
+    for (int j=0; j<128; j++)
+        fprintf(f, "%.8g ", mean[j]);
+    fprintf(f, "\n");
+    for (int r=0; r<dim; r++)
+    {
+        for (int j=0; j<128; j++)
+            fprintf(f, "%.8g ", svd.U(j,r));
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return true;
+}
+
+
+/// out = P (B^T) with B the vectors of <keys> and P pca_projection: one reduced vector of
+/// pca_projection.dim values per keypoint. Keypoints are taken four at a time so that each row of A is
+/// loaded once for the four of them.
+void pca_describe_from_SIFT(const keypointslist& keys, float* out)
+{
+    const int n = (int) keys.size(), dim = pca_projection.dim;
+    const float* A = &pca_projection.A[0];
+    const float* offset = &pca_projection.offset[0];
+
+    int k = 0;
+    for (; k+4<=n; k+=4)
+    {
+        const float *b0 = keys[k].vec, *b1 = keys[k+1].vec, *b2 = keys[k+2].vec, *b3 = keys[k+3].vec;
+        for (int r=0; r<dim; r++)
+        {
+            const float* a = A + r*128;
+            F128 s0, s1, s2, s3;
+            s0.pack = s1.pack = s2.pack = s3.pack = _mm_set1_ps(0.0);
+            for (int j=0; j<128; j+=4)
+            {
+                __m128 xmm_a = _mm_loadu_ps(a+j);
+                s0.pack = _mm_add_ps(s0.pack, _mm_mul_ps(xmm_a, _mm_loadu_ps(b0+j)));
+                s1.pack = _mm_add_ps(s1.pack, _mm_mul_ps(xmm_a, _mm_loadu_ps(b1+j)));
+                s2.pack = _mm_add_ps(s2.pack, _mm_mul_ps(xmm_a, _mm_loadu_ps(b2+j)));
+                s3.pack = _mm_add_ps(s3.pack, _mm_mul_ps(xmm_a, _mm_loadu_ps(b3+j)));
+            }
+            out[k*dim+r]     = s0.f[0]+s0.f[1]+s0.f[2]+s0.f[3] - offset[r];
+            out[(k+1)*dim+r] = s1.f[0]+s1.f[1]+s1.f[2]+s1.f[3] - offset[r];
+            out[(k+2)*dim+r] = s2.f[0]+s2.f[1]+s2.f[2]+s2.f[3] - offset[r];
+            out[(k+3)*dim+r] = s3.f[0]+s3.f[1]+s3.f[2]+s3.f[3] - offset[r];
+        }
+    }
+    for (; k<n; k++)
+        for (int r=0; r<dim; r++)
+            out[k*dim+r] = sseg_dot(A + r*128, keys[k].vec, 128) - offset[r];
+}
+
+
+/// Squared L2 distance between two reduced vectors. Stops once it gets bigger than tdist.
+float pca_distance(const float* a, const float* b, float tdist)
+{
+    const int dim = pca_projection.dim;
+    F128 xmm_s;
+    xmm_s.pack = _mm_set1_ps(0.0);
+    float dist = 0.0;
+    int j = 0;
+    while ( j+16<=dim && dist<=tdist )
+    {
+        for (int e=j+16; j<e; j+=4)
+        {
+            __m128 dif = _mm_sub_ps(_mm_loadu_ps(a+j), _mm_loadu_ps(b+j));
+            xmm_s.pack = _mm_add_ps(xmm_s.pack, _mm_mul_ps(dif,dif));
+        }
+        dist = xmm_s.f[0]+xmm_s.f[1]+xmm_s.f[2]+xmm_s.f[3];
+    }
+    for (; j<dim && dist<=tdist; j++)
+        dist += (a[j]-b[j])*(a[j]-b[j]);
+    return dist;
+}
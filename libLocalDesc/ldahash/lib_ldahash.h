@@ -32,8 +32,12 @@ ldadescriptor(int nrdim, int method):dim(nrdim),method_id(method)
 {
     ldadesc = new BIN_WORD[nrdim];
 }
+~ldadescriptor(){delete[] ldadesc;}
 const int dim;
 const int method_id;
+private:
+ldadescriptor(const ldadescriptor&);
+ldadescriptor& operator=(const ldadescriptor&);
 };
 
 
@@ -51,4 +55,22 @@ void sseg_matrix_vector_mul(const float* A, int ar, int ac, int ald, const float
 ldadescriptor* lda_describe_from_SIFT(keypoint & siftdesc, int method);
 float lda_hamming_distance(ldadescriptor *k1,ldadescriptor *k2, float tdist);
 
+
+/// Real-valued reduction of SIFT vectors: p = A (v - mean), A being dim x 128 (PCA, whitening...)
+struct pcaprojection
+{
+    int dim;
+    std::vector<float> A;       // dim rows of 128
+    std::vector<float> offset;  // A mean
+    pcaprojection():dim(0){}
+};
+
+/// Projection used by the PCA descriptors, see pca_load()
+extern pcaprojection pca_projection;
+
+bool pca_load(const char* filename);
+bool pca_train(const std::vector<const float*>& samples, int dim, const char* filename);
+void pca_describe_from_SIFT(const keypointslist& keys, float* out);
+float pca_distance(const float* a, const float* b, float tdist);
+
 #endif // _LIB_IMAS_H
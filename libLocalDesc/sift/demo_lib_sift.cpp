@@ -57,12 +57,93 @@
 #include <sstream>
 #include <iostream>
 
+#include "mex_and_omp.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define BIG_NUMBER_L1 2800.0f
 #define BIG_NUMBER_L2 1000000000000.0f
 
 std::stringstream tobeprinted;
 
 
+/*----------------------------------------------------------------------------*/
+
+ac_patch_pool::ac_patch_pool(): current(NULL), used(AC_POOL_BLOCK) {}
+
+ac_patch_pool::~ac_patch_pool()
+{
+    for (int i=0; i<(int)blocks.size(); i++)
+        delete[] blocks[i];
+}
+
+/**
+ * @brief Returns 16-byte aligned storage carved out of the current block.
+ * A new block is started whenever the current one is exhausted.
+ * Keypoints of one image may be described concurrently, hence the critical section.
+ * @author Mariano Rodríguez
+ */
+void * ac_patch_pool::allocate(size_t bytes)
+{
+    void * p;
+    bytes = (bytes + 15) & ~((size_t)15);
+#pragma omp critical(ac_patch_pool)
+    {
+        if (bytes > AC_POOL_BLOCK)
+        {
+            blocks.push_back( new char[bytes] );
+            p = blocks.back();
+        }
+        else
+        {
+            if (used + bytes > AC_POOL_BLOCK)
+            {
+                current = new char[AC_POOL_BLOCK];
+                blocks.push_back(current);
+                used = 0;
+            }
+            p = current + used;
+            used += bytes;
+        }
+    }
+    return p;
+}
+
+
+/////////////////////////////////////////////////
+/// LOOKUP TABLES OF ORIENTATION AND DESCRIPTOR STAGES:
+/////////////////////////////////////////////////
+
+/* exp(-x) for 0 <= x < LUTMAX, read with slut */
+#define SIFT_EXP_LUT_SIZE ((int)(LUTMAX * LUTPRECISION) + 2)
+float sift_exp_lut[SIFT_EXP_LUT_SIZE];
+
+/* Gradient orientations are read pre-binned: compute_gradient_orientation quantises
+   them into SIFT_ORI_BINS bins of [-PI, PI], 7 sub-bins of each of the 36 bins of the
+   orientation histogram (1.4 degrees, against 45 degrees for a descriptor bin).
+   Angle, cosine and sine of the centre of each bin. */
+#define SIFT_ORI_BINS 252
+float sift_bin_angle[SIFT_ORI_BINS], sift_bin_cos[SIFT_ORI_BINS], sift_bin_sin[SIFT_ORI_BINS];
+
+/* Filled once, before main */
+bool fill_sift_luts()
+{
+    fill_exp_lut(sift_exp_lut, SIFT_EXP_LUT_SIZE);
+    for (int i = 0; i < SIFT_ORI_BINS; i++)
+    {
+        double angle = 2.0 * PI * (i + 0.5) / SIFT_ORI_BINS - PI - 0.001;
+        sift_bin_angle[i] = (float) angle;
+        sift_bin_cos[i] = (float) cos(angle);
+        sift_bin_sin[i] = (float) sin(angle);
+    }
+    return true;
+}
+bool sift_luts_filled = fill_sift_luts();
+
+
+
 #ifdef _ACD
 
 #include "imas.h"
@@ -73,181 +154,272 @@ double step_sigma = -1.0;
 /*----------------------------------------------------------------------------*/
 
 /**
- * @brief Returns the value of an image at given coordinates, zero when of domain.
- * @author Rafael Grompone von Gioi
+ * @brief Storage for AC patches: from the pool of the current simulation if any, from the heap otherwise.
  */
-double image_at(float * image, int X, int Y, int x, int y)
+static void * ac_allocate(ac_patch_pool * pool, size_t bytes)
 {
-  if( x>=0 && y>=0 && x<X && y<Y ) return image[x+y*X];
-  else return NOTDEF;
+    if (pool)
+        return pool->allocate(bytes);
+    return new char[bytes];
 }
 
-/*---------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
 /**
- * @brief Returns the value of an image interpolated to real coordinates.
- * @author Rafael Grompone von Gioi
+ * @brief Samples the gradient orientation (relative to theta) and modulus on a
+ * rectangular patch of given size, position and resolution. Instead of sampling
+ * the blurred image and differentiating the patch, the gradient images already
+ * computed by FindMaxMin at the keypoint scale are bilinearly interpolated.
+ * The modulus is expressed in the patch resolution so that gradients below 3.0
+ * remain undefined. Edges of the patch and samples out of the image have no
+ * gradient defined.
+ * @authors Rafael Grompone von Gioi, Mariano Rodríguez
  */
-double interpolation(float * image, int X, int Y, double x, double y)
+void sample_gradient_patch(const flimage& gradim, const unsigned char* oribin,
+                           double xc, double yc, double theta, double step,
+                           int X, int Y, double * grad_angle, double * grad_mod)
 {
-  int xx = (int)floor(x);
-  int yy = (int)floor(y);
-  double cx = x - floor(x);
-  double cy = y - floor(y);
-  double a00 = image_at(image,X,Y, xx  , yy  );
-  double a01 = image_at(image,X,Y, xx+1, yy  );
-  double a10 = image_at(image,X,Y, xx  , yy+1);
-  double a11 = image_at(image,X,Y, xx+1, yy+1);
-
-  /* bilinear interpolation */
-  if ((a00==NOTDEF)||(a01==NOTDEF)||(a10==NOTDEF)||(a11==NOTDEF))
-      return(NOTDEF);
-  else
-    return ((double) a00 * (1.0-cx) * (1.0-cy) +
-           a01 *      cx  * (1.0-cy) +
-           a10 * (1.0-cx) *      cy  +
-           a11 *      cx  *      cy);
+  int W = gradim.nwidth(), H = gradim.nheight();
+  double ox = X%2==0 ? X/2 - 0.5 : X/2;  /* X and Y offset to coordinates 0,0 in patch */
+  double oy = Y%2==0 ? Y/2 - 0.5 : Y/2;
+  double dx = step * cos(theta);
+  double dy = step * sin(theta);
+  /* grad is twice the image derivative, the patch one is step times the latter */
+  double modfactor = 0.5 * step;
+
+  /* edges have not gradient defined */
+  for(int x=0; x<X; x++) grad_angle[x+0*X] = grad_angle[x+(Y-1)*X] = NOTDEF;
+  for(int y=0; y<Y; y++) grad_angle[0+y*X] = grad_angle[X-1+y*X]   = NOTDEF;
+  for(int x=0; x<X; x++) grad_mod[x+0*X]   = grad_mod[x+(Y-1)*X]   = 0.0;
+  for(int y=0; y<Y; y++) grad_mod[0+y*X]   = grad_mod[X-1+y*X]     = 0.0;
+
+  for(int y=1; y<Y-1; y++)
+    {
+      double x_sample = xc + dx * (1 - ox) - dy * (y - oy);
+      double y_sample = yc + dy * (1 - ox) + dx * (y - oy);
+      for(int x=1; x<X-1; x++, x_sample += dx, y_sample += dy)
+        {
+          int xx = (int) floor(x_sample);
+          int yy = (int) floor(y_sample);
+          if ( xx<0 || yy<0 || xx+1>=W || yy+1>=H )
+            {
+              grad_angle[x+y*X] = NOTDEF;
+              grad_mod[x+y*X] = 0.0;
+              continue;
+            }
+          double cx = x_sample - xx, cy = y_sample - yy;
+          double w[4] = { (1.0-cx)*(1.0-cy), cx*(1.0-cy), (1.0-cx)*cy, cx*cy };
+          int nx[4] = { xx, xx+1, xx, xx+1 }, ny[4] = { yy, yy, yy+1, yy+1 };
+
+          /* interpolate the gradient vector, not its angle */
+          double gx = 0.0, gy = 0.0;
+          for (int i=0; i<4; i++)
+            {
+              double g = w[i] * gradim(nx[i],ny[i]);
+              int b = oribin[ny[i]*W+nx[i]];
+              gx += g * sift_bin_cos[b];
+              gy += g * sift_bin_sin[b];
+            }
+
+          double mod = modfactor * sqrt(gx*gx + gy*gy);
+          grad_mod[x+y*X] = mod;
+          if ( mod < 3.0 )
+            grad_angle[x+y*X] = NOTDEF;
+          else
+            {
+              double a = atan2(gy,gx) - theta;
+              if (a <= -M_PI) a += 2.0*M_PI;
+              else if (a > M_PI) a -= 2.0*M_PI;
+              grad_angle[x+y*X] = a;
+            }
+        }
+    }
 }
 
 
+int acq_bins = 0;
+int acq_planes = 0;
+int acq_words = 0;
+
 /**
- * @brief Memory allocation, print an error and exit if fail.
- * @author Rafael Grompone von Gioi
+ * @brief Sets the bitplane layout of AC-Q patches of size X x Y. Orientations
+ * are quantised into round(1/quant_prec) bins of width 2*pi*quant_prec, so that
+ * two defined pixels agree by chance with probability 1/acq_bins.
+ * @param X
+ * @param Y
+ * @author Mariano Rodríguez
  */
-void * xmalloc(size_t size)
+void set_quantised_layout(int X, int Y)
 {
-  void * p;
-  if( size == 0 ) cerr<<"xmalloc: zero size"<<endl;
-  p = malloc(size);
-  if( p == NULL ) cerr<<"xmalloc: out of memory"<<endl;
-  return p;
+    acq_bins = (int) floor( 1.0/quant_prec + 0.5 );
+    if (acq_bins<2)
+        acq_bins = 2;
+    acq_planes = 0;
+    while ( (1<<acq_planes) < acq_bins )
+        acq_planes++;
+    acq_words = ( (X-2)*(Y-2) + 63 )/64;
 }
 
-/*---------------------------------------------------------------------------*/
 /**
- * @brief Sample a rectangular patch of an image of give size, position an resolution.
- * @author Rafael Grompone von Gioi
+ * @brief Packs the quantised gradient orientations of a keypoint patch into
+ * acq_planes+1 bitplanes of acq_words words each. Plane 0 is the mask of defined
+ * pixels and plane p+1 holds bit p of the orientation bin. Only interior pixels
+ * are packed, in the order visited by quantised_patch_comparison.
+ * @param key
+ * @param X
+ * @param Y
+ * @author Mariano Rodríguez
  */
-double * extract_rectangle(float * image, int X, int Y,
-                           double xc, double yc, double theta, double step,
-                           int XX, int YY)
+void pack_quantised_orientations(keypoint & key, int X, int Y, ac_patch_pool * pool)
 {
-  double * rect;
-  double ox,oy;     /* X and Y offset to coordinates 0,0 in out image */
-  double dx,dy,x_sample,y_sample;
-  int x,y;
-
-  /* get memory */
-  rect = (double *) xmalloc( XX * YY * sizeof(double) );
-
-  /* extract rectangle */
-  ox = XX%2==0 ? XX/2 - 0.5 : XX/2;
-  oy = YY%2==0 ? YY/2 - 0.5 : YY/2;
-  dx = step * cos(theta);
-  dy = step * sin(theta);
-  for(x=0; x<XX; x++)
-    for(y=0; y<YY; y++)
-      {
-        x_sample = xc + dx * (x - ox) - dy * (y - oy);
-        y_sample = yc + dy * (x - ox) + dx * (y - oy);
-        rect[x+y*XX] = interpolation(image,X,Y,x_sample,y_sample);
-      }
+    key.acq_bits = (unsigned long long *) ac_allocate(pool, (acq_planes+1)*acq_words*sizeof(unsigned long long));
+    memset(key.acq_bits, 0, (acq_planes+1)*acq_words*sizeof(unsigned long long));
 
-  return rect;
+    int i = 0;
+    for(int x=1; x<X-1; x++)
+        for(int y=1; y<Y-1; y++, i++)
+        {
+            double a = key.gradangle[x+y*X];
+            if (a==NOTDEF)
+                continue;
+            int bin = (int) floor( (a + M_PI) * acq_bins / (2.0*M_PI) );
+            if (bin>=acq_bins) bin = acq_bins-1;
+            if (bin<0) bin = 0;
+
+            unsigned long long bit = 1ULL << (i & 63);
+            int w = i >> 6;
+            key.acq_bits[w] |= bit;
+            for (int p=0; p<acq_planes; p++)
+                if ( (bin>>p) & 1 )
+                    key.acq_bits[(p+1)*acq_words + w] |= bit;
+        }
 }
 
+
 /*----------------------------------------------------------------------------*/
 /**
- * @brief Compute the image gradient orientation.
+ * @brief Samples a rectangular patch of the blurred image of given size, position
+ * and resolution and computes its gradient orientation (relative to theta) and
+ * modulus, so that derivatives are taken at the patch spacing. Gives the values
+ * of extract_rectangle followed by gradient_angle, the patch being sampled into
+ * the caller's buffer.
  * @authors Rafael Grompone von Gioi, Mariano Rodríguez
  */
-double * gradient_angle(double * image, int X, int Y, double ** modgrad)
+template <class image_t>
+void sample_blur_patch(const image_t& blur, double xc, double yc, double theta, double step,
+                       int X, int Y, double * patch, double * grad_angle, double * grad_mod)
 {
-  double * grad_angle;
-  double * grad_mod;
-  double dx,dy;
-  int x,y;
-
-  /* get memory */
-  grad_angle = (double *) xmalloc( X * Y * sizeof(double) );
-  grad_mod   = (double *) xmalloc( X * Y * sizeof(double) );
-
-  /* edges have not gradient defined */
-  for(x=0; x<X; x++) grad_angle[x+0*X] = grad_angle[x+(Y-1)*X] = NOTDEF;
-  for(y=0; y<Y; y++) grad_angle[0+y*X] = grad_angle[X-1+y*X]   = NOTDEF;
-  for(x=0; x<X; x++) grad_mod[x+0*X]   = grad_mod[x+(Y-1)*X]   = 0.0;
-  for(y=0; y<Y; y++) grad_mod[0+y*X]   = grad_mod[X-1+y*X]     = 0.0;
-
-  /* process */
-  for(x=1; x<X-1; x++)
-    for(y=1; y<Y-1; y++)
+  int W = blur.nwidth(), H = blur.nheight();
+  double ox = X%2==0 ? X/2 - 0.5 : X/2;  /* X and Y offset to coordinates 0,0 in patch */
+  double oy = Y%2==0 ? Y/2 - 0.5 : Y/2;
+  double dx = step * cos(theta);
+  double dy = step * sin(theta);
+
+  /* bilinear interpolation, undefined when a neighbour is out of the image */
+  for(int x=0; x<X; x++)
+    for(int y=0; y<Y; y++)
       {
-        dx = 0.5 * (image[(x+1)+y*X] - image[(x-1)+y*X]);
-        dy = 0.5 * (image[x+(y+1)*X] - image[x+(y-1)*X]);
+        double x_sample = xc + dx * (x - ox) - dy * (y - oy);
+        double y_sample = yc + dy * (x - ox) + dx * (y - oy);
+        int xx = (int) floor(x_sample);
+        int yy = (int) floor(y_sample);
+        if ( xx<0 || yy<0 || xx+1>=W || yy+1>=H )
+          {
+            patch[x+y*X] = NOTDEF;
+            continue;
+          }
+        double cx = x_sample - floor(x_sample);
+        double cy = y_sample - floor(y_sample);
+        patch[x+y*X] = (double) blur(xx,yy) * (1.0-cx) * (1.0-cy) +
+                       blur(xx+1,yy) *      cx  * (1.0-cy) +
+                       blur(xx,yy+1) * (1.0-cx) *      cy  +
+                       blur(xx+1,yy+1) *    cx  *      cy;
+      }
 
-        grad_mod[x+y*X] = sqrt(dx*dx + dy*dy);
+  /* edges have not gradient defined */
+  for(int x=0; x<X; x++) grad_angle[x+0*X] = grad_angle[x+(Y-1)*X] = NOTDEF;
+  for(int y=0; y<Y; y++) grad_angle[0+y*X] = grad_angle[X-1+y*X]   = NOTDEF;
+  for(int x=0; x<X; x++) grad_mod[x+0*X]   = grad_mod[x+(Y-1)*X]   = 0.0;
+  for(int y=0; y<Y; y++) grad_mod[0+y*X]   = grad_mod[X-1+y*X]     = 0.0;
 
-        if((image[(x+1)+y*X]==NOTDEF)||(image[(x-1)+y*X]==NOTDEF)||(image[x+(y+1)*X]==NOTDEF)||(image[x+(y-1)*X]==NOTDEF))
-        {
+  for(int x=1; x<X-1; x++)
+    for(int y=1; y<Y-1; y++)
+      {
+        if((patch[(x+1)+y*X]==NOTDEF)||(patch[(x-1)+y*X]==NOTDEF)||(patch[x+(y+1)*X]==NOTDEF)||(patch[x+(y-1)*X]==NOTDEF))
+          {
             grad_angle[x+y*X] = NOTDEF;
             grad_mod[x+y*X] = 0;
-        }
-        else
+            continue;
+          }
+        double gx = 0.5 * (patch[(x+1)+y*X] - patch[(x-1)+y*X]);
+        double gy = 0.5 * (patch[x+(y+1)*X] - patch[x+(y-1)*X]);
+
+        grad_mod[x+y*X] = sqrt(gx*gx + gy*gy);
         if( grad_mod[x+y*X] < 3.0 ) grad_angle[x+y*X] = NOTDEF;
-        //if( grad_mod[x+y*X] == (double)0 ) grad_angle[x+y*X] = NOTDEF;
-        else
-                grad_angle[x+y*X] = atan2(dy,dx);
+        else grad_angle[x+y*X] = atan2(gy,gx);
       }
-
-  /* return values */
-  *modgrad = grad_mod;
-  return grad_angle;
 }
 
 
-/*----------------------------------------------------------------------------*/
 /**
- * @brief grad
- * @param grad_mod
- * @param x
- * @param y
- * @param theta
- * @param sigma
- * @param blur
- * @param XX
- * @param YY
- * @param X
- * @param Y
- * @param key
- * @param radius
- * @param par
- * @return
- * @author Rafael Grompone von Gioi
+ * @brief Patch step of a keypoint found at octave scale "scale".
  */
-double * grad( double ** grad_mod, double x, double y, double theta, double sigma,float * blur, int XX, int YY, int X, int Y, keypoint& key, float & radius, siftPar &par)
+static double ac_patch_step(float scale, siftPar &par)
 {
-  double step = sigma*par.OriSigma;//or InitSigma
-  if (step_sigma>0)
-    step = step_sigma*sigma;
-  double * patch;
-  double * grad_angle;
-
-  patch = extract_rectangle(blur,XX,YY,x,y,theta,step,X,Y);
-  grad_angle = gradient_angle(patch,X,Y,grad_mod);
+    if (step_sigma>0)
+        return step_sigma*scale;
+    return scale*par.OriSigma;//or InitSigma
+}
 
-  free( (void *) patch );
-  return grad_angle;
+/**
+ * @brief Storage of the AC patch of a keypoint.
+ */
+static void allocate_ac_patch(keypoint & key, ac_patch_pool * pool)
+{
+    key.gradangle = (double *) ac_allocate(pool, NewOriSize1*NewOriSize1*sizeof(double));
+    key.gradmod = (double *) ac_allocate(pool, NewOriSize1*NewOriSize1*sizeof(double));
 }
 
 
+/**
+ * @brief Records where the keypoint was found. Its AC patch is sampled here from
+ * the gradient images only with ac_gradient_patches, otherwise UpdateKeypoints_AC
+ * samples it from the blurred level once the keypoints of the level are known.
+ */
 void UpdateKeypoint_AC(
-        flimage & blur,
+        const flimage& grad, const unsigned char* oribin,
         keypoint & key,
-        float scale, float row, float col,siftPar &par)
+        float scale, float row, float col,siftPar &par, ac_patch_pool * pool)
 {
-    key.gradangle = grad( &key.gradmod ,col,row,key.angle,scale,blur.getPlane(),blur.nwidth(),blur.nheight(),NewOriSize1,NewOriSize1 ,key, key.radius, par);
     key.octscale = scale;
     key.octcol = col;
     key.octrow = row;
+    key.gradangle = key.gradmod = NULL;
+    key.acq_bits = NULL;
+    if (!ac_gradient_patches)
+        return;
+
+    allocate_ac_patch(key, pool);
+    sample_gradient_patch(grad, oribin, col, row, key.angle, ac_patch_step(scale, par), NewOriSize1, NewOriSize1, key.gradangle, key.gradmod);
+    if (par.DescType==IMAS_AC_Q)
+        pack_quantised_orientations(key, NewOriSize1, NewOriSize1, pool);
+}
+
+/**
+ * @brief AC patches of keys[i0] to keys[i1-1], sampled from the blurred level they were found at.
+ */
+template <class image_t>
+void SampleKeypoints_AC(const image_t* blur, keypoint* keys, int i0, int i1, siftPar* par, ac_patch_pool * pool)
+{
+    int X = NewOriSize1, Y = NewOriSize1;
+    std::vector<double> patch(X*Y);
+    for (int i = i0; i < i1; i++)
+    {
+        keypoint& key = keys[i];
+        allocate_ac_patch(key, pool);
+        sample_blur_patch(*blur, key.octcol, key.octrow, key.angle, ac_patch_step(key.octscale, *par), X, Y, &patch[0], key.gradangle, key.gradmod);
+        if (par->DescType==IMAS_AC_Q)
+            pack_quantised_orientations(key, X, Y, pool);
+    }
 }
 
 #endif
@@ -282,6 +454,10 @@ void default_sift_parameters(siftPar &par)
     par.MODE_ROOT=true;
     par.half_sift_trick=false;
     par.L2norm = true; //false = L1 Norm
+    par.MaxKeypoints = 0;
+    par.ANMS = false;
+    par.HalfStorage = false;
+    par.DescType = IMAS_SIFT;
 
 }
 
@@ -292,9 +468,24 @@ void default_sift_parameters(siftPar &par)
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void OctaveKeypoints(flimage & image, float octSize, keypointslist& keys,siftPar &par);
+int sift_threads();
+
+int sift_bands(int rows);
+
+void banded_gaussian_convolution(float *u, float *v, int width, int height, float sigma);
+
+void OctaveKeypoints(flimage & image, float octSize, keypointslist& keys,siftPar &par, ac_patch_pool * pool, sift_levels * levels);
+
+void SelectPeaks(sift_levels& levels, siftPar &par);
 
-void FindMaxMin(  flimage* dogs,  flimage* blur, float octSize ,keypointslist& keys,siftPar &par);
+void DescribeLevels(sift_levels& levels, keypointslist& keys, siftPar &par, ac_patch_pool * pool, int * nkeys);
+
+void ScaleSpaceKeypoints(float *input, keypointslist& keypoints, int width, int height, siftPar &par, ac_patch_pool * pool, sift_levels * levels);
+
+void RootKeypoints(keypointslist& keypoints, int from, siftPar &par);
+
+template <class image_t>
+void FindMaxMin(  image_t* dogs,  image_t* blur, float octSize ,keypointslist& keys,siftPar &par, ac_patch_pool * pool, sift_levels * levels);
 
 bool LocalMax(float val, flimage& dog, int y0, int x0);
 
@@ -302,18 +493,40 @@ bool LocalMin(float val, flimage& dog, int y0, int x0);
 
 bool LocalMaxMin(float val, const flimage& dog, int y0, int x0);
 
-int NotOnEdge( flimage& dog, int r, int c, float octSize,siftPar &par);
+template <class image_t>
+void ExtremaRowMask(image_t* dogs, int s, int r, int c0, int c1, float thresh,
+                    float* colmax, float* colmin, unsigned long long* mask, float* rowbuf);
+
+template <class image_t>
+int NotOnEdge( image_t& dog, int r, int c, float octSize,siftPar &par);
+
+template <class image_t>
+float FitQuadratic(float offset[3],  image_t* dogs, int s, int r, int c);
 
-float FitQuadratic(float offset[3],  flimage* dogs, int s, int r, int c);
+template <class image_t>
+void FindCandidates(image_t* dogs, int s, int r0, int r1, float thresh, float octSize, siftPar* par, std::vector<int>* candidates);
 
-void InterpKeyPoint(flimage& blur,
-                    flimage* dogs, int s, int r, int c,
-                    const flimage& grad, const flimage& ori, flimage& map,
-                    float octSize, keypointslist& keys, int movesRemain, siftPar &par);
+template <class image_t>
+void InterpKeyPoint(image_t* dogs, int s, int r, int c, flimage& map,
+                    std::vector<sift_peak>& peaks, int movesRemain, siftPar &par);
 
-void AssignOriHist(flimage& blur,
-                   const flimage& grad, const flimage& ori, float octSize,
-                   float octScale, float octRow, float octCol, keypointslist& keys, siftPar &par);
+void DescribePeaks(const flimage* grad, const unsigned char* oribin, float octSize,
+                   const sift_peak* peaks, int npeaks, keypointslist* keys, siftPar* par, ac_patch_pool * pool, int * nkeys);
+
+void DescribeScale(const flimage& grad, const unsigned char* oribin, float octSize,
+                   const sift_peak* peaks, int npeaks, keypointslist& keys, siftPar &par, ac_patch_pool * pool, int * nkeys);
+
+template <class image_t>
+void UpdateKeypoints_AC(const image_t& blur, keypointslist& keys, int from, siftPar &par, ac_patch_pool * pool);
+
+float SupportRadius(float octScale, siftPar &par);
+
+template <class image_t>
+void ComputeGradientTiles(image_t& blur, flimage& grad, unsigned char* oribin,
+                          const sift_peak* peaks, int npeaks, siftPar &par);
+
+void AssignOriHist(const flimage& grad, const unsigned char* oribin, float octSize,
+                   float octScale, float octRow, float octCol, keypointslist& keys, siftPar &par, ac_patch_pool * pool);
 
 void SmoothHistogram(
         float* hist, int bins);
@@ -321,12 +534,13 @@ void SmoothHistogram(
 float InterpPeak(
         float a, float b, float c);
 
-void MakeKeypoint(flimage& blur,
-                  const flimage& grad, const flimage& ori, float octSize, float octScale,
-                  float octRow, float octCol, float angle, keypointslist& keys, siftPar &par);
+void MakeKeypoint(const flimage& grad, const unsigned char* oribin, float octSize, float octScale,
+                  float octRow, float octCol, float angle, keypointslist& keys, siftPar &par, ac_patch_pool * pool);
+
+void FoldHalfDescriptor(const keypoint_base<2*OriSize1,IndexSize1>& full, bool opposite, keypoint& half);
 
 template <unsigned int OriSize,unsigned int IndexSize>
-void MakeKeypointSample(keypoint_base<OriSize, IndexSize> &key, const flimage& grad, const flimage& ori,
+void MakeKeypointSample(keypoint_base<OriSize, IndexSize> &key, const flimage& grad, const unsigned char* oribin,
                         float scale, float row, float col, siftPar &par);
 
 void NormalizeVec(
@@ -334,20 +548,20 @@ void NormalizeVec(
 
 template <unsigned int OriSize,unsigned int IndexSize>
 void KeySampleVec(
-        keypoint_base<OriSize, IndexSize>& key, const flimage& grad, const flimage& ori,
+        keypoint_base<OriSize, IndexSize>& key, const flimage& grad, const unsigned char* oribin,
         float scale, float row, float col,siftPar &par);
 
 template <unsigned int OriSize,unsigned int IndexSize>
 void KeySample(
         float index[IndexSize][IndexSize][OriSize], keypoint_base<OriSize, IndexSize>& key,
-        const flimage& grad, const flimage& ori,
+        const flimage& grad, const unsigned char* oribin,
         float scale, float row, float col,siftPar &par);
 
 template <unsigned int OriSize,unsigned int IndexSize>
 void AddSample(
         float index[IndexSize][IndexSize][OriSize], keypoint_base<OriSize, IndexSize>& key,
-        const flimage& grad, const flimage& orim,
-        int r, int c, float rpos, float cpos, float rx, float cx,siftPar &par);
+        const flimage& grad, const unsigned char* oribin,
+        int r, int c, float weight, float rx, float cx,siftPar &par);
 
 template <unsigned int OriSize,unsigned int IndexSize>
 void PlaceInIndex(
@@ -356,9 +570,71 @@ void PlaceInIndex(
 
 
 
+/////////////////////////////////////////////////
+/// INTRA-IMAGE PARALLELISM:
+/////////////////////////////////////////////////
+
+/// The scale-space of one image is split in row bands (blurs, DOGs, extrema) and
+/// its keypoints in chunks (descriptors). They run as OpenMP tasks nested in the
+/// task of the simulation (see IMAS_detectAndCompute), so threads left idle by the
+/// other simulations help on this one without oversubscribing the machine.
+
+/* Minimum number of rows of a band */
+#define SIFT_BAND_ROWS 32
+
+/* Number of threads of the enclosing parallel region */
+int sift_threads()
+{
+#ifdef _OPENMP
+    if (omp_in_parallel())
+        return omp_get_num_threads();
+#endif
+    return 1;
+}
+
+/* Number of bands in which an image of this height is split */
+int sift_bands(int rows)
+{
+    return MAX(1, MIN(sift_threads(), rows / SIFT_BAND_ROWS));
+}
+
+/* Same as gaussian_convolution, with row bands for the horizontal pass and
+   column bands for the vertical pass. Can be called with u=v. */
+void banded_gaussian_convolution(float *u, float *v, int width, int height, float sigma)
+{
+    int ksize = (int)(2.0 * 4.0 * sigma + 1.0);
+    float * kernel = gauss(1,sigma,&ksize);
+    int boundary = 1;
+
+    int nbands = sift_bands(height);
+    for (int b = 0; b < nbands; b++) {
+        int r0 = b * height / nbands, r1 = (b+1) * height / nbands;
+#pragma omp task firstprivate(r0, r1, u, v, width, kernel, ksize, boundary)
+        {
+            copy(u + r0*width, v + r0*width, (r1-r0)*width);
+            horizontal_convolution(v + r0*width, v + r0*width, width, r1-r0, kernel, ksize, boundary);
+        }
+    }
+#pragma omp taskwait
+
+    nbands = sift_bands(width);
+    for (int b = 0; b < nbands; b++) {
+        int c0 = b * width / nbands, c1 = (b+1) * width / nbands;
+#pragma omp task firstprivate(c0, c1, v, width, height, kernel, ksize, boundary)
+        vertical_convolution(v, v, width, height, kernel, ksize, boundary, c0, c1);
+    }
+#pragma omp taskwait
+
+    delete[] kernel;
+}
+
+
+
 // Modified by Mariano Rodríguez to obtain Root-SIFT
 /* tobeprinted - just for avoiding calling MATLAB printing function inside a parallel region, which will cast errors */
-void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, int height, siftPar &par)
+/* Scale space of the image, octave by octave. Peaks are described on the fly,
+   or stored in levels if it is given. */
+void ScaleSpaceKeypoints(float *input, keypointslist& keypoints, int width, int height, siftPar &par, ac_patch_pool * pool, sift_levels * levels)
 {
 
     flimage image;
@@ -380,7 +656,8 @@ void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, i
     } else
     {
 
-        image.create(width,height,input);
+        image.borrow(width,height);
+        copy(input, image.getPlane(), width*height);
     }
 
     // tobeprinted << "Using initial Dog value: " << par.PeakThresh << "\n";
@@ -401,7 +678,7 @@ void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, i
 
         float sigma = (float) sqrt((double)(par.InitSigma * par.InitSigma - curSigma * curSigma));
 
-        gaussian_convolution( image.getPlane(), image.getPlane(), image.nwidth(), image.nheight(), sigma);
+        banded_gaussian_convolution( image.getPlane(), image.getPlane(), image.nwidth(), image.nheight(), sigma);
 
     }
 
@@ -417,27 +694,32 @@ void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, i
 
     while (image.nwidth() > minsize &&  image.nheight() > minsize && OctaveCounter < par.OctaveMax) {
 
-        OctaveKeypoints(image, octSize, keypoints,par);
+        OctaveKeypoints(image, octSize, keypoints,par,pool,levels);
 
         // image is blurred inside OctaveKeypoints and therefore can be sampled
-        flimage aux( (int)((float) image.nwidth() / 2.0f) , (int)((float) image.nheight() / 2.0f));
+        flimage aux;
+        aux.borrow( (int)((float) image.nwidth() / 2.0f) , (int)((float) image.nheight() / 2.0f));
 
 
         sample(image.getPlane(), aux.getPlane(), 2.0f, image.nwidth(), image.nheight());
 
-        image = aux;
+        image.swap(aux);
 
         octSize *= 2.0;
 
         OctaveCounter++;
 
     }
+}
 
-    /* Root-SIFT*/
-    if ((par.MODE_ROOT || desc_type==IMAS_ROOTSIFT)&&(keypoints.size()>0))
+
+/* Root-SIFT of keypoints[from...] */
+void RootKeypoints(keypointslist& keypoints, int from, siftPar &par)
+{
+    if ((par.MODE_ROOT || par.DescType==IMAS_ROOTSIFT)&&((int)keypoints.size()>from))
     {
         int VecLength = keypoints[0].veclength;
-        for (int i=0; i<(int)keypoints.size();i++)
+        for (int i=from; i<(int)keypoints.size();i++)
         {
             float total = 0;
             for (int j=0; j<VecLength;j++)
@@ -450,11 +732,93 @@ void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, i
             }
         }
     }
+}
+
+
+void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, int height, siftPar &par, ac_patch_pool * pool)
+{
+    /* Peaks are only described once all of them are known, if they are to be selected */
+    if (par.MaxKeypoints > 0)
+    {
+        sift_levels * levels = compute_sift_peaks(input, width, height, par);
+        DescribeLevels(*levels, keypoints, par, pool, NULL);
+        delete levels;
+    }
+    else
+        ScaleSpaceKeypoints(input, keypoints, width, height, par, pool, NULL);
+
+    /* Root-SIFT*/
+    RootKeypoints(keypoints, 0, par);
+
     tobeprinted << "sift:: "<< keypoints.size() <<" keypoints \n";
     tobeprinted <<"sift::  plus non correctly localized: "<< par.noncorrectlylocalized <<"\n";
 }
 
 
+sift_levels * compute_sift_peaks(float *input, int width, int height, siftPar &par)
+{
+    keypointslist none;
+    sift_levels * levels = new sift_levels;
+    ScaleSpaceKeypoints(input, none, width, height, par, NULL, levels);
+
+    tobeprinted << "sift:: "<< levels->peaks.size() <<" scale-space peaks, ";
+    if (par.MaxKeypoints > 0)
+        SelectPeaks(*levels, par);
+    tobeprinted << levels->peaks.size() <<" selected \n";
+    return levels;
+}
+
+
+void sift_peak_geometry(const sift_levels& levels, int p, float& x, float& y, float& scale, float& radius, siftPar &par)
+{
+    const sift_peak& peak = levels.peaks[p];
+    float octSize = levels.octSize[peak.level];
+    x = octSize * peak.octCol;
+    y = octSize * peak.octRow;
+    scale = octSize * peak.octScale;
+
+    /* as in KeySample */
+    float spacing = peak.octScale * par.MagFactor;
+    float sample_radius = 1.414 * spacing * (IndexSize1 + 1) / 2.0;
+    radius = (float) (int) (sample_radius + 0.5);
+}
+
+
+void describe_sift_peaks(sift_levels& levels, const std::vector<bool> * wanted, keypointslist& keypoints,
+                         std::vector<int>& first, siftPar &par, ac_patch_pool * pool)
+{
+    int npeaks = (int) levels.peaks.size();
+    std::vector<int> index;
+    for (int p = 0; p < npeaks; p++)
+        if (!wanted || (*wanted)[p]) index.push_back(p);
+
+    /* Only the wanted peaks are left in levels while they are described */
+    int ndescribed = (int) index.size();
+    std::vector<sift_peak> all;
+    if (ndescribed < npeaks)
+    {
+        std::vector<sift_peak> some(ndescribed);
+        for (int i = 0; i < ndescribed; i++) some[i] = levels.peaks[index[i]];
+        levels.peaks.swap(all);
+        levels.peaks.swap(some);
+    }
+
+    int from = (int) keypoints.size();
+    std::vector<int> nkeys(ndescribed + 1, 0);
+    DescribeLevels(levels, keypoints, par, pool, &nkeys[0]);
+    if (ndescribed < npeaks)
+        levels.peaks.swap(all);
+
+    std::vector<int> count(npeaks, 0);
+    for (int i = 0; i < ndescribed; i++) count[index[i]] = nkeys[i];
+    first.resize(npeaks + 1);
+    first[0] = from;
+    for (int p = 0; p < npeaks; p++) first[p+1] = first[p] + count[p];
+
+    RootKeypoints(keypoints, from, par);
+}
+
+
 /////////////////////////////////////////////////
 /// EXTREMA DETECTION IN ONE SCALE-SPACE OCTAVE:
 /////////////////////////////////////////////////
@@ -466,64 +830,162 @@ void compute_sift_keypoints(float *input, keypointslist& keypoints, int width, i
 
 /// It seems that blur[par.Scales+1] is compared in two succesive iterations
 ///
-void OctaveKeypoints(flimage & image, float octSize, keypointslist& keys,siftPar &par)
+void OctaveKeypoints(flimage & image, float octSize, keypointslist& keys,siftPar &par, ac_patch_pool * pool, sift_levels * levels)
 {
     // Guoshen Yu, 2010.09.21, Windows version
     // flimage blur[par.Scales+3], dogs[par.Scales+2];
     int size_blur = par.Scales+3;
     int size_dogs = par.Scales+2;
-    flimage *blur = new flimage[size_blur];
-    flimage *dogs = new flimage[size_dogs];
+    flimage *blur = NULL, *dogs = NULL;
+    hfimage *hblur = NULL, *hdogs = NULL;
 
     float sigmaRatio = (float) pow(2.0, 1.0 / (double) par.Scales);
 
 
-    /* Build array, blur, holding par.Scales+3 blurred versions of the image. */
-    blur[0] = flimage(image);	/* First level is input to this routine. */
-    float prevSigma = par.InitSigma;	/* Input image has par.InitSigma smoothing. */
+    /* Image buffers come from the pool of this thread (see flimage_pool) */
+    int width = image.nwidth(), height = image.nheight();
+    int nbands = sift_bands(height);
 
+    if (!par.HalfStorage)
+    {
+        blur = new flimage[size_blur];
+        dogs = new flimage[size_dogs];
 
-    /* Form each level by adding incremental blur from previous level.
-    Increase in blur is from prevSigma to prevSigma * sigmaRatio, so
-    increase^2 = (prevSigma * sigmaRatio)^2 - prevSigma^2
-    */
-    for (int i = 1; i < par.Scales + 3; i++) {
+        /* Build array, blur, holding par.Scales+3 blurred versions of the image. */
+        blur[0].borrow(width, height);	/* First level is input to this routine. */
+        copy(image.getPlane(), blur[0].getPlane(), width*height);
+        float prevSigma = par.InitSigma;	/* Input image has par.InitSigma smoothing. */
 
-        //if (DEBUG) printf("Convolving scale: %d \n", i);
 
-        blur[i] = flimage(blur[i-1]);
+        /* Form each level by adding incremental blur from previous level.
+        Increase in blur is from prevSigma to prevSigma * sigmaRatio, so
+        increase^2 = (prevSigma * sigmaRatio)^2 - prevSigma^2
+        */
+        for (int i = 1; i < par.Scales + 3; i++) {
 
-        float increase = prevSigma*(float)sqrt((double)(sigmaRatio*sigmaRatio-1.0));
+            //if (DEBUG) printf("Convolving scale: %d \n", i);
 
-        gaussian_convolution( blur[i].getPlane(), blur[i].getPlane(), blur[i].nwidth(), blur[i].nheight(), increase);
+            blur[i].borrow(width, height);
 
-        prevSigma *= sigmaRatio;
+            float increase = prevSigma*(float)sqrt((double)(sigmaRatio*sigmaRatio-1.0));
 
-    }
+            banded_gaussian_convolution( blur[i-1].getPlane(), blur[i].getPlane(), width, height, increase);
 
+            prevSigma *= sigmaRatio;
+
+        }
 
-    /* Compute an array, dogs, of difference-of-Gaussian images by
-    subtracting each image from its next blurred version. */
-    for (int i = 0; i < par.Scales + 2; i++) {
 
-        dogs[i] = flimage(blur[i]);
+        /* Compute an array, dogs, of difference-of-Gaussian images by
+        subtracting each image from its next blurred version. */
+        for (int i = 0; i < par.Scales + 2; i++)
+            dogs[i].borrow(width, height);
 
-        /// dogs[i] = dogs[i] - blur[i+1]
-        combine(dogs[i].getPlane(),1.0f, blur[i+1].getPlane(),-1.0f, dogs[i].getPlane(),  dogs[i].nwidth() * dogs[i].nheight());
+        for (int b = 0; b < nbands; b++) {
+            int offset = (b * height / nbands) * width, size = ((b+1) * height / nbands) * width - offset;
+#pragma omp task firstprivate(offset, size, blur, dogs, size_dogs)
+            /// dogs[i] = blur[i] - blur[i+1]
+            for (int i = 0; i < size_dogs; i++)
+                combine(blur[i].getPlane() + offset,1.0f, blur[i+1].getPlane() + offset,-1.0f, dogs[i].getPlane() + offset, size);
+        }
+#pragma omp taskwait
+
+
+        // Image with exact blur to be subsampled is blur[scales]
+        image = blur[par.Scales];
     }
+    else
+    {
+        /* Same levels, computed in float from the two last blurred images and
+        stored in half precision: all the dogs, and the blurred images at
+        which extrema are looked for, blur[1..par.Scales] */
+        hblur = new hfimage[size_blur];
+        hdogs = new hfimage[size_dogs];
+
+        flimage prev, next;
+        prev.borrow(width, height);
+        copy(image.getPlane(), prev.getPlane(), width*height);
+        float prevSigma = par.InitSigma;
+
+        for (int i = 1; i < par.Scales + 3; i++) {
+
+            next.borrow(width, height);
+
+            float increase = prevSigma*(float)sqrt((double)(sigmaRatio*sigmaRatio-1.0));
+
+            banded_gaussian_convolution( prev.getPlane(), next.getPlane(), width, height, increase);
+
+            prevSigma *= sigmaRatio;
 
+            hdogs[i-1].borrow(width, height);
+            bool keep = (i <= par.Scales);
+            if (keep) hblur[i].borrow(width, height);
 
-    // Image with exact blur to be subsampled is blur[scales]
-    image = blur[par.Scales];
+            float * pprev = prev.getPlane(), * pnext = next.getPlane();
+            hfimage * pdog = &hdogs[i-1], * pblur = &hblur[i];
+            for (int b = 0; b < nbands; b++) {
+                int r0 = b * height / nbands, r1 = (b+1) * height / nbands;
+#pragma omp task firstprivate(r0, r1, pprev, pnext, pdog, pblur, keep, width)
+                {
+                    /// dogs[i-1] = blur[i-1] - blur[i], one row at a time
+                    std::vector<float> row(width);
+                    for (int r = r0; r < r1; r++) {
+                        combine(pprev + r*width, 1.0f, pnext + r*width, -1.0f, &row[0], width);
+                        pdog->put(&row[0], r*width, width);
+                        if (keep) pblur->put(pnext + r*width, r*width, width);
+                    }
+                }
+            }
+#pragma omp taskwait
+
+            // Image with exact blur to be subsampled is blur[scales]
+            if (i == par.Scales) image = next;
+
+            prev.swap(next);
+        }
+    }
 
     /* Scale-space extrema detection in this octave	*/
     //if (DEBUG) printf("Looking for local maxima \n");
 
-    FindMaxMin(dogs, blur, octSize, keys,par);
+    if (hdogs)
+        FindMaxMin(hdogs, hblur, octSize, keys,par,pool,levels);
+    else
+        FindMaxMin(dogs, blur, octSize, keys,par,pool,levels);
+
+    /* Keep the blurred images at which peaks were found, they will be described later */
+    if (levels)
+    {
+        int first = (int) levels->blur.size();
+        std::vector<bool> used(par.Scales, false);
+        for (int i = (int) levels->peaks.size() - 1; i >= 0 && levels->peaks[i].level >= first; i--)
+            used[levels->peaks[i].level - first] = true;
+
+        for (int s = 1; s < par.Scales+1; s++)
+        {
+            flimage * kept = NULL;
+            hfimage * hkept = NULL;
+            if (used[s-1] && hblur)
+            {
+                hkept = new hfimage;
+                hkept->swap(hblur[s]);
+            }
+            else if (used[s-1])
+            {
+                kept = new flimage;
+                kept->swap(blur[s]);
+            }
+            levels->blur.push_back(kept);
+            levels->hblur.push_back(hkept);
+            levels->octSize.push_back(octSize);
+        }
+    }
 
     // Guoshen Yu, 2010.09.22, Windows version
     delete [] blur;
     delete [] dogs;
+    delete [] hblur;
+    delete [] hdogs;
 }
 
 
@@ -539,9 +1001,11 @@ void OctaveKeypoints(flimage & image, float octSize, keypointslist& keys,siftPar
 
 /// blur[par.Scales+1] is not used in order to look for extrema
 /// while these could be computed using avalaible blur and dogs
+/// If levels is given, peaks are stored there to be described later (see DescribeLevels).
+template <class image_t>
 void FindMaxMin(
-        flimage* dogs,  flimage* blur,
-        float octSize, keypointslist& keys,siftPar &par)
+        image_t* dogs,  image_t* blur,
+        float octSize, keypointslist& keys,siftPar &par, ac_patch_pool * pool, sift_levels * levels)
 {
 
     int width = dogs[0].nwidth(), height = dogs[0].nheight();
@@ -551,81 +1015,436 @@ void FindMaxMin(
     same position.  This may seem an inefficient data structure, but
     does not add significant overhead.
     */
-    flimage map(width,height,0.0f);
-    flimage grad(width,height,0.0f);
-    flimage ori(width,height,0.0f);
+    flimage map, grad;
+    std::vector<unsigned char> oribin;
+    map.borrow(width,height);
+    if (!levels)
+    {
+        grad.borrow(width,height);
+        oribin.resize(width*height);
+    }
+    for (int i = 0; i < width*height; i++) map.getPlane()[i] = 0.0f;
+
+    /* The float threshold of the vectorized extremum test is slightly
+    lowered so that its mask is a superset of the double test. */
+    float thresh = (float) (0.8 * par.PeakThresh);
+    if ((double) thresh >= 0.8 * par.PeakThresh) thresh *= 0.9999f;
+
+    /* Only find peaks at least par.BorderDist samples from image border, as
+    peaks centered close to the border will lack stability. */
+    assert(par.BorderDist >= 2);
+    int rmin = par.BorderDist, rmax = height - par.BorderDist;
+    int nbands = sift_bands(rmax - rmin);
+    std::vector< std::vector<int> > candidates(nbands);
+    std::vector<sift_peak> peaks;
+    siftPar * ppar = &par;
 
     /* Search through each scale, leaving 1 scale below and 1 above.
         There are par.Scales+2 dog images.
     */
     for (int s = 1; s < par.Scales+1; s++) {
 
-        //if (DEBUG) printf("************************scale: %d\n", s);
+        /* Candidates of each band */
+        for (int b = 0; b < nbands; b++) {
+            int r0 = rmin + b * (rmax - rmin) / nbands, r1 = rmin + (b+1) * (rmax - rmin) / nbands;
+            std::vector<int> * cand = &candidates[b];
+#pragma omp task firstprivate(dogs, s, r0, r1, thresh, octSize, ppar, cand)
+            FindCandidates(dogs, s, r0, r1, thresh, octSize, ppar, cand);
+        }
+#pragma omp taskwait
 
-        //getchar();
+        /* Candidates are localised in raster order, so that the map of
+        duplicates behaves as in a serial scan */
+        peaks.clear();
+        for (int b = 0; b < nbands; b++)
+            for (int i = 0; i < (int) candidates[b].size(); i++)
+                InterpKeyPoint(dogs, s, candidates[b][i] / width, candidates[b][i] % width,
+                               map, peaks, 5, par);
 
-        /* For each intermediate image, compute gradient and orientation
-        images to be used for keypoint description.  */
-        compute_gradient_orientation(blur[s].getPlane(), grad.getPlane(), ori.getPlane(), blur[s].nwidth(), blur[s].nheight());
+        if (levels)
+        {
+            /* blur[s] will be the level after the ones already kept */
+            for (int i = 0; i < (int) peaks.size(); i++)
+                peaks[i].level = (int) levels->blur.size() + s - 1;
+            levels->peaks.insert(levels->peaks.end(), peaks.begin(), peaks.end());
+        }
+        else if (!peaks.empty())
+        {
+            /* Gradient and orientation images to be used for keypoint
+            description, around the peaks only */
+            int from = (int) keys.size();
+            ComputeGradientTiles(blur[s], grad, &oribin[0], &peaks[0], (int) peaks.size(), par);
+            DescribeScale(grad, &oribin[0], octSize, &peaks[0], (int) peaks.size(), keys, par, pool, NULL);
+            UpdateKeypoints_AC(blur[s], keys, from, par, pool);
+        }
+    }
 
+}
 
-        /* Only find peaks at least par.BorderDist samples from image border, as
-        peaks centered close to the border will lack stability. */
-        assert(par.BorderDist >= 2);
-        float val;
-        int partialcounter = 0;
-        for (int r = par.BorderDist; r < height - par.BorderDist; r++)
-            for (int c = par.BorderDist; c < width - par.BorderDist; c++) {
 
-                /* Pixel value at (c,r) position. */
-                val = dogs[s](c,r);
+/* Room for the keypoints of n peaks: most peaks give a single orientation,
+   some a second one. */
+#define SIFT_KEYS_RESERVE(n) ((n) + (n)/4)
 
-                /* DOG magnitude must be above 0.8 * par.PeakThresh threshold
-                (precise threshold check will be done once peak
-                interpolation is performed).  Then check whether this
-                point is a peak in 3x3 region at each level, and is not
-                on an elongated edge.
-                */
+/* Orientations and descriptors of the peaks of one scale, by chunks of peaks.
+   Keypoints are appended in the order of the peaks. If nkeys is given, it
+   receives the number of keypoints of each peak. */
+void DescribeScale(const flimage& grad, const unsigned char* oribin, float octSize,
+                   const sift_peak* peaks, int npeaks, keypointslist& keys, siftPar &par, ac_patch_pool * pool, int * nkeys)
+{
+    siftPar * ppar = &par;
+    const flimage * pgrad = &grad;
+    int nchunks = MIN(npeaks, 4 * sift_threads());
+    std::vector<keypointslist> chunk_keys(nchunks);
+    for (int k = 0; k < nchunks; k++) {
+        int i0 = k * npeaks / nchunks, i1 = (k+1) * npeaks / nchunks;
+        const sift_peak * ppeaks = peaks + i0;
+        keypointslist * pkeys = &chunk_keys[k];
+        int * pnkeys = nkeys ? nkeys + i0 : NULL;
+#pragma omp task firstprivate(pgrad, oribin, octSize, ppeaks, i0, i1, pkeys, ppar, pool, pnkeys)
+        DescribePeaks(pgrad, oribin, octSize, ppeaks, i1 - i0, pkeys, ppar, pool, pnkeys);
+    }
+#pragma omp taskwait
+    size_t total = keys.size();
+    for (int k = 0; k < nchunks; k++)
+        total += chunk_keys[k].size();
+    if (total > keys.capacity())
+        keys.reserve(MAX(total, 2 * keys.capacity()));
+    for (int k = 0; k < nchunks; k++)
+        keys.insert(keys.end(), chunk_keys[k].begin(), chunk_keys[k].end());
+}
 
-                if (fabs(val) > 0.8 * par.PeakThresh)
-                {
 
-                    /*
-
-                    // If local maxima
-                    if (LocalMax(val, dogs[s-1], r, c,par) && LocalMax(val, dogs[s], r, c, par) && LocalMax(val, dogs[s+1], r, c,par) && NotOnEdge(dogs[s], r, c, octSize,par))
-                    {
-                        if (DEBUG) printf("Maximum Keypoint found (%d,%d,%d)  val: %f\n",s,r,c,val);
-                        InterpKeyPoint(
-                            dogs, s, r, c, grad, ori,
-                            map, octSize, keys, 5,par);
-
-                    } else  if (LocalMin(val, dogs[s-1], r, c,par) && LocalMin(val, dogs[s], r, c,par) && LocalMin(val, dogs[s+1], r, c,par) && NotOnEdge(dogs[s], r, c, octSize,par))
-                    {
-                        if (DEBUG) printf("Minimum Keypoint found (%d,%d,%d)  val: %f\n",s,r,c,val);
-                        InterpKeyPoint(
-                            dogs, s, r, c, grad, ori,
-                            map, octSize, keys, 5,par);
-                    }
-*/
-                    if (LocalMaxMin(val, dogs[s-1], r, c) && LocalMaxMin(val, dogs[s], r, c) && LocalMaxMin(val, dogs[s+1], r, c) && NotOnEdge(dogs[s], r, c, octSize,par))
-                    {
-                        partialcounter++;
-                        //if (DEBUG) printf("%d:  (%d,%d,%d)  val: %f\n",partialcounter, s,r,c,val);
+/* AC patches of keys[from] onwards, described at the level blur, by chunks of
+   keypoints. Nothing to do unless an AC descriptor samples its patches from
+   the blurred levels (see UpdateKeypoint_AC). */
+template <class image_t>
+void UpdateKeypoints_AC(const image_t& blur, keypointslist& keys, int from, siftPar &par, ac_patch_pool * pool)
+{
+#ifdef _ACD
+    if (ac_gradient_patches || par.half_sift_trick ||
+        !(par.DescType == IMAS_AC || par.DescType == IMAS_AC_Q || par.DescType == IMAS_AC_W))
+        return;
 
-                        InterpKeyPoint(blur[s],
-                                       dogs, s, r, c, grad, ori,
-                                       map, octSize, keys, 5,par);
+    siftPar * ppar = &par;
+    const image_t * pblur = &blur;
+    keypoint * pkeys = keys.empty() ? NULL : &keys[0];
+    int nkeys = (int) keys.size() - from;
+    int nchunks = MIN(nkeys, 4 * sift_threads());
+    for (int k = 0; k < nchunks; k++) {
+        int i0 = from + k * nkeys / nchunks, i1 = from + (k+1) * nkeys / nchunks;
+#pragma omp task firstprivate(pblur, pkeys, i0, i1, ppar, pool)
+        SampleKeypoints_AC(pblur, pkeys, i0, i1, ppar, pool);
+    }
+#pragma omp taskwait
+#else
+    (void) blur; (void) keys; (void) from; (void) par; (void) pool;
+#endif
+}
+
+
+/* Row r of a scale-space level, as floats. Half precision rows are decoded into buf. */
+inline const float* LevelRow(flimage& level, int r, float* buf)
+{
+    (void) buf;
+    return level.getPlane() + r*level.nwidth();
+}
+
+inline const float* LevelRow(hfimage& level, int r, float* buf)
+{
+    level.get(buf, r*level.nwidth(), level.nwidth());
+    return buf;
+}
+
+
+/// Gradients are only computed on the tiles of SIFT_GRAD_TILE x SIFT_GRAD_TILE pixels
+/// that intersect the support of some peak (orientation histogram, descriptor, AC patch).
+#define SIFT_GRAD_TILE 32
+
+/* Radius around a peak out of which grad and oribin are not read to describe it */
+float SupportRadius(float octScale, siftPar &par)
+{
+    /* AssignOriHist */
+    float radius = 3.0 * par.OriSigma * octScale;
+    /* KeySample */
+    radius = MAX(radius, 1.414 * octScale * par.MagFactor * (IndexSize1 + 1) / 2.0 + 0.5);
+#ifdef _ACD
+    /* sample_gradient_patch */
+    if (ac_gradient_patches && (par.DescType == IMAS_AC || par.DescType ==IMAS_AC_Q || par.DescType == IMAS_AC_W))
+    {
+        double step = (step_sigma>0) ? step_sigma*octScale : octScale*par.OriSigma;
+        radius = MAX(radius, 0.7072 * step * NewOriSize1);
+    }
+#endif
+    /* bilinear interpolation and rounding */
+    return radius + 2.0;
+}
 
-                        //getchar();
-                    }
 
+/* Float values of blur on the tiles marked in needed. A half precision
+   level is decoded into decoded on these tiles and their neighbours, which
+   the gradient stencil reaches. One task per row of tiles. */
+float* TileSource(flimage& blur, flimage& decoded, const unsigned char* needed, int ntx, int nty)
+{
+    (void) decoded; (void) needed; (void) ntx; (void) nty;
+    return blur.getPlane();
+}
 
+float* TileSource(hfimage& blur, flimage& decoded, const unsigned char* needed, int ntx, int nty)
+{
+    int width = blur.nwidth(), height = blur.nheight();
+    decoded.borrow(width, height);
+
+    std::vector<unsigned char> around(ntx*nty, 0);
+    for (int ty = 0; ty < nty; ty++)
+        for (int tx = 0; tx < ntx; tx++)
+            if (needed[ty*ntx + tx])
+                for (int y = MAX(0, ty-1); y <= MIN(nty-1, ty+1); y++)
+                    for (int x = MAX(0, tx-1); x <= MIN(ntx-1, tx+1); x++)
+                        around[y*ntx + x] = 1;
+
+    float * pdecoded = decoded.getPlane();
+    hfimage * pblur = &blur;
+    unsigned char * paround = &around[0];
+    for (int ty = 0; ty < nty; ty++)
+    {
+        if (std::find(paround + ty*ntx, paround + (ty+1)*ntx, 1) == paround + (ty+1)*ntx) continue;
+#pragma omp task firstprivate(ty, pblur, pdecoded, paround, width, height, ntx)
+        for (int y = ty * SIFT_GRAD_TILE; y < MIN(height, (ty + 1) * SIFT_GRAD_TILE); y++)
+            for (int tx = 0; tx < ntx; tx++)
+                if (paround[ty*ntx + tx])
+                {
+                    int x0 = tx * SIFT_GRAD_TILE, x1 = MIN(width, x0 + SIFT_GRAD_TILE);
+                    pblur->get(pdecoded + y*width + x0, y*width + x0, x1 - x0);
                 }
+    }
+#pragma omp taskwait
+    return pdecoded;
+}
+
+
+/* Gradient and pre-binned orientation (SIFT_ORI_BINS) of blur on the tiles
+   needed by the peaks, each tile being computed once. One task per row of tiles. */
+template <class image_t>
+void ComputeGradientTiles(image_t& blur, flimage& grad, unsigned char* oribin,
+                          const sift_peak* peaks, int npeaks, siftPar &par)
+{
+    int width = blur.nwidth(), height = blur.nheight();
+    int ntx = (width + SIFT_GRAD_TILE - 1) / SIFT_GRAD_TILE, nty = (height + SIFT_GRAD_TILE - 1) / SIFT_GRAD_TILE;
+    std::vector<unsigned char> needed(ntx*nty, 0);
+
+    for (int i = 0; i < npeaks; i++)
+    {
+        float radius = SupportRadius(peaks[i].octScale, par);
+        int tx0 = MAX(0, (int) (peaks[i].octCol - radius)) / SIFT_GRAD_TILE,
+            tx1 = MIN(width - 1, (int) (peaks[i].octCol + radius + 1)) / SIFT_GRAD_TILE,
+            ty0 = MAX(0, (int) (peaks[i].octRow - radius)) / SIFT_GRAD_TILE,
+            ty1 = MIN(height - 1, (int) (peaks[i].octRow + radius + 1)) / SIFT_GRAD_TILE;
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++)
+                needed[ty*ntx + tx] = 1;
+    }
 
+    flimage decoded;
+    unsigned char * pneeded = &needed[0];
+    float * pblur = TileSource(blur, decoded, pneeded, ntx, nty), * pgrad = grad.getPlane();
+    for (int ty = 0; ty < nty; ty++)
+    {
+        if (std::find(pneeded + ty*ntx, pneeded + (ty+1)*ntx, 1) == pneeded + (ty+1)*ntx) continue;
+#pragma omp task firstprivate(ty, pblur, pgrad, oribin, pneeded, width, height, ntx)
+        {
+            int y0 = ty * SIFT_GRAD_TILE, y1 = MIN(height, y0 + SIFT_GRAD_TILE);
+            /* runs of consecutive needed tiles */
+            for (int tx = 0; tx < ntx; tx++)
+                if (pneeded[ty*ntx + tx])
+                {
+                    int tx1 = tx;
+                    while (tx1 + 1 < ntx && pneeded[ty*ntx + tx1 + 1]) tx1++;
+                    compute_gradient_orientation(pblur, pgrad, NULL, width, height,
+                                                 tx * SIFT_GRAD_TILE, y0, MIN(width, (tx1 + 1) * SIFT_GRAD_TILE), y1,
+                                                 oribin, SIFT_ORI_BINS);
+                    tx = tx1;
+                }
+        }
+    }
+#pragma omp taskwait
+}
+
+
+/* Keeps par.MaxKeypoints peaks out of levels.peaks, either the strongest ones or
+   the ones given by adaptive non-maximal suppression (par.ANMS). Their order is kept. */
+void SelectPeaks(sift_levels& levels, siftPar &par)
+{
+    int npeaks = (int) levels.peaks.size();
+    if (npeaks <= par.MaxKeypoints) return;
+
+    std::vector<float> x(npeaks), y(npeaks), response(npeaks);
+    for (int i = 0; i < npeaks; i++)
+    {
+        const sift_peak& peak = levels.peaks[i];
+        x[i] = levels.octSize[peak.level] * peak.octCol;
+        y[i] = levels.octSize[peak.level] * peak.octRow;
+        response[i] = peak.response;
+    }
+
+    std::vector<int> selected(par.MaxKeypoints);
+    if (par.ANMS)
+        select_anms(&x[0], &y[0], &response[0], npeaks, par.MaxKeypoints, &selected[0]);
+    else
+        select_strongest(&response[0], npeaks, par.MaxKeypoints, &selected[0]);
+
+    std::vector<sift_peak> kept(par.MaxKeypoints);
+    for (int i = 0; i < par.MaxKeypoints; i++)
+        kept[i] = levels.peaks[selected[i]];
+    levels.peaks.swap(kept);
+}
+
+
+/* Orientations and descriptors of the peaks in levels, one level at a time */
+void DescribeLevels(sift_levels& levels, keypointslist& keys, siftPar &par, ac_patch_pool * pool, int * nkeys)
+{
+    flimage grad;
+    std::vector<unsigned char> oribin;
+    int i0 = 0, npeaks = (int) levels.peaks.size();
+    keys.reserve(keys.size() + SIFT_KEYS_RESERVE(npeaks));
+    while (i0 < npeaks)
+    {
+        int level = levels.peaks[i0].level, i1 = i0;
+        while (i1 < npeaks && levels.peaks[i1].level == level) i1++;
+
+        int from = (int) keys.size();
+        if (levels.blur[level])
+        {
+            flimage& blur = *levels.blur[level];
+            grad.borrow(blur.nwidth(), blur.nheight());
+            oribin.resize(blur.nwidth() * blur.nheight());
+            ComputeGradientTiles(blur, grad, &oribin[0], &levels.peaks[i0], i1 - i0, par);
+            DescribeScale(grad, &oribin[0], levels.octSize[level], &levels.peaks[i0], i1 - i0, keys, par, pool, nkeys ? nkeys + i0 : NULL);
+            UpdateKeypoints_AC(blur, keys, from, par, pool);
+        }
+        else
+        {
+            hfimage& blur = *levels.hblur[level];
+            grad.borrow(blur.nwidth(), blur.nheight());
+            oribin.resize(blur.nwidth() * blur.nheight());
+            ComputeGradientTiles(blur, grad, &oribin[0], &levels.peaks[i0], i1 - i0, par);
+            DescribeScale(grad, &oribin[0], levels.octSize[level], &levels.peaks[i0], i1 - i0, keys, par, pool, nkeys ? nkeys + i0 : NULL);
+            UpdateKeypoints_AC(blur, keys, from, par, pool);
+        }
+
+        i0 = i1;
+    }
+}
+
+
+/* Rows r0 <= r < r1 of dogs[s]: positions r*width+c of the extrema that pass
+   the DOG magnitude threshold and are not on an elongated edge */
+template <class image_t>
+void FindCandidates(image_t* dogs, int s, int r0, int r1, float thresh, float octSize, siftPar* par, std::vector<int>* candidates)
+{
+    int width = dogs[s].nwidth();
+    int c0 = par->BorderDist, c1 = width - par->BorderDist;
+    int nwords = (c1 - c0 + 63) / 64;
+    std::vector<float> colmax(width), colmin(width), rowbuf(9*width);
+    std::vector<unsigned long long> mask(MAX(nwords,1));
+
+    candidates->clear();
+    for (int r = r0; r < r1; r++) {
+
+        /* Candidates of the whole row: DOG magnitude above 0.8 * par.PeakThresh
+        and peak in the 3x3x3 neighbourhood. The precise threshold check will be
+        done once peak interpolation is performed. */
+        ExtremaRowMask(dogs, s, r, c0, c1, thresh, &colmax[0], &colmin[0], &mask[0], &rowbuf[0]);
+
+        for (int w = 0; w < nwords; w++)
+            for (unsigned long long bits = mask[w]; bits; bits &= bits - 1) {
+                int c = c0 + 64*w + __builtin_ctzll(bits);
+
+                /* Then check the point is not on an elongated edge */
+                if (fabs(dogs[s](c,r)) > 0.8 * par->PeakThresh && NotOnEdge(dogs[s], r, c, octSize,*par))
+                    candidates->push_back(r*width + c);
             }
     }
+}
+
+
+/* Bitmask of the columns c0 <= c < c1 of row r of dogs[s] whose value is a
+   local maximum (positive value) or minimum (negative value) of the 3x3x3
+   neighbourhood and whose magnitude is above thresh. Bit i of the mask stands
+   for column c0+i. Equivalent to LocalMaxMin on dogs[s-1], dogs[s], dogs[s+1]
+   but done a whole row at a time: the 9 rows are first reduced column-wise
+   into colmax/colmin (width floats each), then across 3 columns.
+   Half precision rows are decoded into rowbuf (9 rows of width floats).
+*/
+template <class image_t>
+void ExtremaRowMask(image_t* dogs, int s, int r, int c0, int c1, float thresh,
+                    float* colmax, float* colmin, unsigned long long* mask, float* rowbuf)
+{
+    const float* rows[9];
+    for (int k = 0; k < 3; k++) {
+        int width = dogs[s-1+k].nwidth();
+        for (int j = 0; j < 3; j++)
+            rows[3*k+j] = LevelRow(dogs[s-1+k], r-1+j, rowbuf + (3*k+j)*width);
+    }
+    const float* center = rows[4];
+
+    if (c1 <= c0) return;
+    memset(mask, 0, ((c1 - c0 + 63)/64) * sizeof(unsigned long long));
+
+    /* Column-wise max/min over the 9 rows */
+    int c = c0 - 1;
+#ifdef __SSE2__
+    for (; c + 4 <= c1 + 1; c += 4) {
+        __m128 mx = _mm_loadu_ps(rows[0] + c), mn = mx;
+        for (int k = 1; k < 9; k++) {
+            __m128 v = _mm_loadu_ps(rows[k] + c);
+            mx = _mm_max_ps(mx, v);
+            mn = _mm_min_ps(mn, v);
+        }
+        _mm_storeu_ps(colmax + c, mx);
+        _mm_storeu_ps(colmin + c, mn);
+    }
+#endif
+    for (; c < c1 + 1; c++) {
+        float mx = rows[0][c], mn = mx;
+        for (int k = 1; k < 9; k++) {
+            mx = MAX(mx, rows[k][c]);
+            mn = MIN(mn, rows[k][c]);
+        }
+        colmax[c] = mx;
+        colmin[c] = mn;
+    }
 
+    /* Across 3 columns; the center belongs to the neighbourhood, so it is
+    a peak iff it equals the neighbourhood max (min) */
+    c = c0;
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps(), signmask = _mm_set1_ps(-0.0f);
+    const __m128 vthresh = _mm_set1_ps(thresh);
+    for (; c + 4 <= c1; c += 4) {
+        __m128 v = _mm_loadu_ps(center + c);
+        __m128 mx = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(colmax + c - 1), _mm_loadu_ps(colmax + c)), _mm_loadu_ps(colmax + c + 1));
+        __m128 mn = _mm_min_ps(_mm_min_ps(_mm_loadu_ps(colmin + c - 1), _mm_loadu_ps(colmin + c)), _mm_loadu_ps(colmin + c + 1));
+        __m128 ismax = _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmpge_ps(v, mx));
+        __m128 ismin = _mm_and_ps(_mm_cmplt_ps(v, zero), _mm_cmple_ps(v, mn));
+        __m128 big = _mm_cmpgt_ps(_mm_andnot_ps(signmask, v), vthresh);
+        unsigned long long bits = _mm_movemask_ps(_mm_and_ps(big, _mm_or_ps(ismax, ismin)));
+        if (bits) {
+            int i = c - c0;
+            mask[i >> 6] |= bits << (i & 63);
+            if ((i & 63) > 60) mask[(i >> 6) + 1] |= bits >> (64 - (i & 63));
+        }
+    }
+#endif
+    for (; c < c1; c++) {
+        float v = center[c];
+        float mx = MAX(MAX(colmax[c-1], colmax[c]), colmax[c+1]);
+        float mn = MIN(MIN(colmin[c-1], colmin[c]), colmin[c+1]);
+        if (fabs(v) > thresh && ((v > 0.0f && v >= mx) || (v < 0.0f && v <= mn))) {
+            int i = c - c0;
+            mask[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
 }
 
 
@@ -686,7 +1505,8 @@ bool LocalMaxMin(float val, const flimage& dog, int y0, int x0)
    Edge threshold is higher on the first scale where SNR is small in
    order to reduce the number of unstable keypoints.
 */
-int NotOnEdge(flimage& dog, int r, int c, float octSize,siftPar &par)
+template <class image_t>
+int NotOnEdge(image_t& dog, int r, int c, float octSize,siftPar &par)
 {
     /* Compute 2x2 Hessian values from pixel differences. */
     float	H00 = dog(c,r-1) - 2.0 * dog(c,r) + dog(c,r+1), /* AMIR: div by ? */
@@ -725,10 +1545,9 @@ int NotOnEdge(flimage& dog, int r, int c, float octSize,siftPar &par)
    s is scale (index of DOGs image), and (r,c) is (row, col) location.
    Add to the list of keys with any new keys added.
 */
-void InterpKeyPoint( flimage& blur,
-                     flimage* dogs, int s, int r, int c,
-                     const flimage& grad, const flimage& ori, flimage& map,
-                     float octSize, keypointslist& keys, int movesRemain,siftPar &par)
+template <class image_t>
+void InterpKeyPoint( image_t* dogs, int s, int r, int c, flimage& map,
+                     std::vector<sift_peak>& peaks, int movesRemain, siftPar &par)
 {
 
     /* Fit quadratic to determine offset and peak value. */
@@ -756,9 +1575,8 @@ void InterpKeyPoint( flimage& blur,
         newc--;
 
     if (movesRemain > 0  &&  (newr != r || newc != c)) {
-        InterpKeyPoint(blur,
-                       dogs, s, newr, newc, grad, ori, map,
-                       octSize, keys,movesRemain - 1,par);
+        InterpKeyPoint(dogs, s, newr, newc, map,
+                       peaks, movesRemain - 1, par);
         return;
     }
 
@@ -787,15 +1605,30 @@ void InterpKeyPoint( flimage& blur,
     // float octScale = par.InitSigma * pow(2.0, (s + offset[0]) / (float) par.Scales);
     float octScale = par.InitSigma * pow(2.0, (s + offset[0]) / (double) par.Scales);
 
-    /// always use histogram of orientations
-    //if (UseHistogramOri)
-    AssignOriHist(blur,
-                  grad, ori, octSize, octScale,
-                  r + offset[1], c + offset[2], keys, par);
-    //else
-    //	AssignOriAvg(
-    //		grad, ori, octSize, octScale,
-    //		r + offset[1], c + offset[2], keys);
+    /// orientations and descriptors are computed later by DescribePeaks
+    sift_peak peak;
+    peak.response = fabs(peakval);
+    peak.level = -1;
+    peak.octScale = octScale;
+    peak.octRow = r + offset[1];
+    peak.octCol = c + offset[2];
+    peaks.push_back(peak);
+}
+
+
+/* Orientations and descriptors of a list of peaks */
+void DescribePeaks(const flimage* grad, const unsigned char* oribin, float octSize,
+                   const sift_peak* peaks, int npeaks, keypointslist* keys, siftPar* par, ac_patch_pool * pool, int * nkeys)
+{
+    keys->reserve(keys->size() + SIFT_KEYS_RESERVE(npeaks));
+    for (int i = 0; i < npeaks; i++)
+    {
+        int before = (int) keys->size();
+        /// always use histogram of orientations
+        AssignOriHist(*grad, oribin, octSize, peaks[i].octScale,
+                      peaks[i].octRow, peaks[i].octCol, *keys, *par, pool);
+        if (nkeys) nkeys[i] = (int) keys->size() - before;
+    }
 }
 
 
@@ -807,15 +1640,11 @@ void InterpKeyPoint( flimage& blur,
    in "offset", which gives offset from position (s,r,c).  The
    returned value is the interpolated DOG magnitude at this peak.
 */
-float FitQuadratic(float offset[3], flimage* dogs, int s, int r, int c)
+template <class image_t>
+float FitQuadratic(float offset[3], image_t* dogs, int s, int r, int c)
 {
     float g[3];
-    flimage *dog0, *dog1, *dog2;
-    int i;
-
-    //s = 1; r = 128; c = 128;
-
-    float ** H =  allocate_float_matrix(3, 3);
+    image_t *dog0, *dog1, *dog2;
 
     /* Select the dog images at peak scale, dog1, as well as the scale
        below, dog0, and scale above, dog2. */
@@ -828,52 +1657,39 @@ float FitQuadratic(float offset[3], flimage* dogs, int s, int r, int c)
     g[1] = ((*dog1)(c,r+1) - (*dog1)(c,r-1)) / 2.0;
     g[2] = ((*dog1)(c+1,r) - (*dog1)(c-1,r)) / 2.0;
 
-    /* Fill in the values of the Hessian from pixel differences. */
-    H[0][0] = (*dog0)(c,r)   - 2.0 * (*dog1)(c,r) + (*dog2)(c,r);
-    H[1][1] = (*dog1)(c,r-1) - 2.0 * (*dog1)(c,r) + (*dog1)(c,r+1);
-    H[2][2] = (*dog1)(c-1,r) - 2.0 * (*dog1)(c,r) + (*dog1)(c+1,r);
-    H[0][1] = H[1][0] = ( ((*dog2)(c,r+1) - (*dog2)(c,r-1)) -
-                          ((*dog0)(c,r+1) - (*dog0)(c,r-1)) ) / 4.0;
-    H[0][2] = H[2][0] = ( ((*dog2)(c+1,r) - (*dog2)(c-1,r)) -
-                          ((*dog0)(c+1,r) - (*dog0)(c-1,r)) ) / 4.0;
-    H[1][2] = H[2][1] = ( ((*dog1)(c+1,r+1) - (*dog1)(c-1,r+1)) -
-                          ((*dog1)(c+1,r-1) - (*dog1)(c-1,r-1)) ) / 4.0;
-
-    /* Solve the 3x3 linear sytem, Hx = -g. Result, x, gives peak offset.
-       Note that SolveLinearSystem destroys contents of H. */
-    offset[0] = - g[0];
-    offset[1] = - g[1];
-    offset[2] = - g[2];
-
-    // 	for(i=0; i < 3; i++){
-    //
-    // 		for(j=0; j < 3; j++) printf("%f  ", H[i][j]);
-    // 		printf("\n");
-    // 	}
-
-    // 	printf("\n");
-    //
-    // 	for(i=0; i < 3; i++) printf("%f  ", offset[i]);
-    // 	printf("\n");
-
-    float solution[3];
-    lusolve(H, solution, offset,3);
-
-    // 	printf("\n");
-    // 	for(i=0; i < 3; i++) printf("%f  ", solution[i]);
-    // 	printf("\n");
-
-
-    desallocate_float_matrix(H,3,3);
-    delete[] H; /*memcheck*/
+    /* Fill in the values of the (symmetric) Hessian from pixel differences. */
+    double h00 = (*dog0)(c,r)   - 2.0 * (*dog1)(c,r) + (*dog2)(c,r);
+    double h11 = (*dog1)(c,r-1) - 2.0 * (*dog1)(c,r) + (*dog1)(c,r+1);
+    double h22 = (*dog1)(c-1,r) - 2.0 * (*dog1)(c,r) + (*dog1)(c+1,r);
+    double h01 = ( ((*dog2)(c,r+1) - (*dog2)(c,r-1)) -
+                   ((*dog0)(c,r+1) - (*dog0)(c,r-1)) ) / 4.0;
+    double h02 = ( ((*dog2)(c+1,r) - (*dog2)(c-1,r)) -
+                   ((*dog0)(c+1,r) - (*dog0)(c-1,r)) ) / 4.0;
+    double h12 = ( ((*dog1)(c+1,r+1) - (*dog1)(c-1,r+1)) -
+                   ((*dog1)(c+1,r-1) - (*dog1)(c-1,r-1)) ) / 4.0;
+
+    /* Solve the 3x3 linear sytem, Hx = -g, in closed form with the adjugate of H.
+       Result, x, gives peak offset. If H is singular the quadratic has no
+       unique extremum and the peak is left at (s,r,c). */
+    double a00 = h11*h22 - h12*h12, a01 = h02*h12 - h01*h22, a02 = h01*h12 - h02*h11;
+    double a11 = h00*h22 - h02*h02, a12 = h01*h02 - h00*h12, a22 = h00*h11 - h01*h01;
+    double det = h00*a00 + h01*a01 + h02*a02;
+
+    if (det != 0.0)
+    {
+        double idet = -1.0 / det;
+        offset[0] = (float) ( (a00*g[0] + a01*g[1] + a02*g[2]) * idet );
+        offset[1] = (float) ( (a01*g[0] + a11*g[1] + a12*g[2]) * idet );
+        offset[2] = (float) ( (a02*g[0] + a12*g[1] + a22*g[2]) * idet );
+    }
+    else
+        offset[0] = offset[1] = offset[2] = 0.0f;
 
     /* Also return value of DOG at peak location using initial value plus
        0.5 times linear interpolation with gradient to peak position
        (this is correct for a quadratic approximation).
     */
-    for(i=0; i < 3; i++) offset[i] = solution[i];
-
-    return ((*dog1)(c,r) + 0.5 * (solution[0]*g[0]+solution[1]*g[1]+solution[2]*g[2]));
+    return ((*dog1)(c,r) + 0.5 * (offset[0]*g[0]+offset[1]*g[1]+offset[2]*g[2]));
 }
 
 
@@ -887,9 +1703,8 @@ float FitQuadratic(float offset[3], flimage* dogs, int s, int r, int c)
    region.  The histogram is smoothed and the largest peak selected.
    The results are in the range of -PI to PI.
 */
-void AssignOriHist(flimage& blur,
-                   const flimage& grad, const flimage& ori, float octSize,
-                   float octScale, float octRow, float octCol, keypointslist& keys, siftPar &par)
+void AssignOriHist(const flimage& grad, const unsigned char* oribin, float octSize,
+                   float octScale, float octRow, float octCol, keypointslist& keys, siftPar &par, ac_patch_pool * pool)
 {
     int	bin, prev, next;
 
@@ -929,13 +1744,10 @@ void AssignOriHist(flimage& blur,
 
             if (gval > 0.0  &&  distsq < radius2 + 0.5) {
 
-                weight = exp(- distsq / sigma2);
+                weight = slut(distsq / sigma2, sift_exp_lut);
 
-                /* Ori is in range of -PI to PI. */
-                angle = ori(c,r);
-                bin = (int) (par.OriBins * (angle + PI + 0.001) / (2.0 * PI));
-                assert(bin >= 0 && bin <= par.OriBins);
-                bin = MIN(bin, par.OriBins - 1);
+                /* Ori is in range of -PI to PI, pre-binned into sub-bins of the histogram. */
+                bin = oribin[r*cols+c] * par.OriBins / SIFT_ORI_BINS;
                 hist[bin] += weight * gval;
 
             }
@@ -971,9 +1783,8 @@ void AssignOriHist(flimage& blur,
             //if (DEBUG) printf("angle selected: %f \t location: (%f,%f)\n", angle, octRow, octCol);
             ;
             /* Create a keypoint with this orientation. */
-            MakeKeypoint(blur,
-                         grad, ori, octSize, octScale,
-                         octRow, octCol, angle, keys,par);
+            MakeKeypoint(grad, oribin, octSize, octScale,
+                         octRow, octCol, angle, keys,par,pool);
         }
 
     }
@@ -1014,80 +1825,77 @@ float InterpPeak(float a, float b, float c)
     return 0.5 * (a - c) / (a - 2.0 * b + c);
 }
 
+/* HALF-SIFT: folds the two opposite orientation bins (k and k+OriSize1) of each spatial
+   cell of a descriptor sampled with 2*OriSize1 bins. If opposite is true, the cells are taken
+   in point-reflected order, which gives the descriptor of the opposite orientation.
+ */
+void FoldHalfDescriptor(const keypoint_base<2*OriSize1,IndexSize1>& full, bool opposite, keypoint& half)
+{
+    int ind1 = 0, ind2 = 0;
+    for (unsigned int i = 0; i < IndexSize1; i++)
+        for (unsigned int j = 0; j < IndexSize1; j++)
+        {
+            unsigned int si = opposite ? IndexSize1-1-i : i,
+                    sj = opposite ? IndexSize1-1-j : j;
+            ind1 = i*IndexSize1*OriSize1 + j*OriSize1;
+            ind2 = si*IndexSize1*2*OriSize1 + sj*2*OriSize1;
+            for (unsigned int k = 0; k < OriSize1; k++)
+                half.vec[ind1+k] = (full.vec[ind2+k] + full.vec[ind2+k+OriSize1])/2;
+        }
+}
+
 /* Joan Pau: Add a new keypoint to a vector of keypoints
    Create a new keypoint and return list of keypoints with new one added.
 
    Modified by Mariano Rodríguez to obtain HALF-SIFT
  */
-void MakeKeypoint(flimage& blur,
-                  const flimage& grad, const flimage& ori, float octSize, float octScale,
-                  float octRow, float octCol, float angle, keypointslist& keys,siftPar &par)
+void MakeKeypoint(const flimage& grad, const unsigned char* oribin, float octSize, float octScale,
+                  float octRow, float octCol, float angle, keypointslist& keys,siftPar &par, ac_patch_pool * pool)
 {
-    if (par.half_sift_trick || desc_type==IMAS_HALFROOTSIFT || desc_type ==IMAS_HALFSIFT)
+#ifndef _ACD
+    (void) pool;
+#endif
+    if (par.half_sift_trick || par.DescType==IMAS_HALFROOTSIFT || par.DescType ==IMAS_HALFSIFT)
     {
+        /*
+         * The <angle> and oposite <angle> hypotheses are accumulated from the same gradient samples:
+         * the descriptor at <angle> +- PI is the point reflection of the one at <angle>
+         * (spatial cells (i,j) -> (IndexSize1-1-i, IndexSize1-1-j) and orientation bins shifted by PI),
+         * so only the first one is sampled.
+        */
+        keypoint_base<2*OriSize1,IndexSize1> newkeypoint_double;
+        newkeypoint_double.x = octSize * octCol;	/*x coordinate */
+        newkeypoint_double.y = octSize * octRow;	/*y coordinate */
+        newkeypoint_double.scale = octSize * octScale;	/* scale */
+        newkeypoint_double.angle = angle;//fmod(angle,M_PI/2);		/* orientation */
+        MakeKeypointSample(newkeypoint_double,grad,oribin,octScale,octRow,octCol,par);
+
+        float opposite_angle = (angle<0) ? angle + PI : angle - PI;
+
+        keypoint newkeypoint;
+        newkeypoint.x = octSize * octCol;	/*x coordinate */
+        newkeypoint.y = octSize * octRow;	/*y coordinate */
+        newkeypoint.scale = octSize * octScale;	/* scale */
+        newkeypoint.radius = newkeypoint_double.radius;
+
         if (true) // Fast but looses some matches
         {
             /*
-             * two temporal keypoints are created in the <angle> and oposite <angle> directions.
-             * Then the energy of the first <IndexSize1> histograms is used to determine which direction
-             * should be taken into account to create a unique KEYPOINT.
+             * The energy of the first <IndexSize1> histograms is used to determine which direction
+             * should be taken into account to create a unique KEYPOINT. For the opposite direction
+             * these are the last <IndexSize1> histograms of the sampled descriptor.
             */
-            keypoint_base<2*OriSize1,IndexSize1> newkeypoint_double;
-            newkeypoint_double.x = octSize * octCol;	/*x coordinate */
-            newkeypoint_double.y = octSize * octRow;	/*y coordinate */
-            newkeypoint_double.scale = octSize * octScale;	/* scale */
-            newkeypoint_double.angle = angle;//fmod(angle,M_PI/2);		/* orientation */
-            MakeKeypointSample(newkeypoint_double,grad,ori,octScale,octRow,octCol,par);
-
-            keypoint_base<2*OriSize1,IndexSize1> newkeypoint_double2;
-            newkeypoint_double2.x = octSize * octCol;	/*x coordinate */
-            newkeypoint_double2.y = octSize * octRow;	/*y coordinate */
-            newkeypoint_double2.scale = octSize * octScale;	/* scale */
-            if (angle<0)
-                newkeypoint_double2.angle = angle + PI; /* orientation */
-            else
-                newkeypoint_double2.angle = angle - PI;
-            MakeKeypointSample(newkeypoint_double2,grad,ori,octScale,octRow,octCol,par);
-
+            const unsigned int RowLength = 2*OriSize1*IndexSize1;
             float energy=0.0f, energy2 = 0.0f;
-            for (unsigned int k = 0; k < 2*OriSize1*IndexSize1; k++)
+            for (unsigned int k = 0; k < RowLength; k++)
             {
                 energy += newkeypoint_double.vec[k]*newkeypoint_double.vec[k];
-                energy2 += newkeypoint_double2.vec[k]*newkeypoint_double2.vec[k];
+                energy2 += newkeypoint_double.vec[(IndexSize1-1)*RowLength+k]*newkeypoint_double.vec[(IndexSize1-1)*RowLength+k];
             }
 
-            keypoint newkeypoint;
-            newkeypoint.x = octSize * octCol;	/*x coordinate */
-            newkeypoint.y = octSize * octRow;	/*y coordinate */
-            newkeypoint.scale = octSize * octScale;	/* scale */
-            if (energy>energy2)
-            {
-                newkeypoint.radius = newkeypoint_double.radius;
-                newkeypoint.angle = newkeypoint_double.angle;
-                int ind1 = 0, ind2 = 0;
-                for (unsigned int i = 0; i < IndexSize1; i++)
-                    for (unsigned int j = 0; j < IndexSize1; j++)
-                    {
-                        ind1 = i*IndexSize1*OriSize1 + j*OriSize1;
-                        ind2 = i*IndexSize1*2*OriSize1 + j*2*OriSize1;
-                        for (unsigned int k = 0; k < OriSize1; k++)
-                            newkeypoint.vec[ind1+k] = (newkeypoint_double.vec[ind2+k] + newkeypoint_double.vec[ind2+k+OriSize1])/2;
-                    }
-            }
-            else
-            {
-                newkeypoint.radius = newkeypoint_double2.radius;
-                newkeypoint.angle = newkeypoint_double2.angle;
-                int ind1 = 0, ind2 = 0;
-                for (unsigned int i = 0; i < IndexSize1; i++)
-                    for (unsigned int j = 0; j < IndexSize1; j++)
-                    {
-                        ind1 = i*IndexSize1*OriSize1 + j*OriSize1;
-                        ind2 = i*IndexSize1*2*OriSize1 + j*2*OriSize1;
-                        for (unsigned int k = 0; k < OriSize1; k++)
-                            newkeypoint.vec[ind1+k] = (newkeypoint_double2.vec[ind2+k] + newkeypoint_double2.vec[ind2+k+OriSize1])/2;
-                    }
-            }
+            bool opposite = !(energy>energy2);
+            newkeypoint.angle = opposite ? opposite_angle : angle;
+            FoldHalfDescriptor(newkeypoint_double, opposite, newkeypoint);
 
             if (newkeypoint.radius>0.0f)
                 keys.push_back(newkeypoint);
@@ -1097,59 +1905,12 @@ void MakeKeypoint(flimage& blur,
             /*
              * Creates two keypoints in the <angle> and oposite <angle> directions.
             */
-            keypoint_base<2*OriSize1,IndexSize1> newkeypoint_double;
-            newkeypoint_double.x = octSize * octCol;	/*x coordinate */
-            newkeypoint_double.y = octSize * octRow;	/*y coordinate */
-            newkeypoint_double.scale = octSize * octScale;	/* scale */
-            newkeypoint_double.angle = angle;//fmod(angle,M_PI/2);		/* orientation */
-            MakeKeypointSample(newkeypoint_double,grad,ori,octScale,octRow,octCol,par);
-
-            keypoint newkeypoint;
-            newkeypoint.x = octSize * octCol;	/*x coordinate */
-            newkeypoint.y = octSize * octRow;	/*y coordinate */
-            newkeypoint.scale = octSize * octScale;	/* scale */
             newkeypoint.angle = angle;//fmod(angle,M_PI/2);		/* fmod(angle,M_PI) */
-            newkeypoint.radius = newkeypoint_double.radius;
-
-            int ind1 = 0, ind2 = 0;
-            for (unsigned int i = 0; i < IndexSize1; i++)
-                for (unsigned int j = 0; j < IndexSize1; j++)
-                {
-                    ind1 = i*IndexSize1*OriSize1 + j*OriSize1;
-                    ind2 = i*IndexSize1*2*OriSize1 + j*2*OriSize1;
-                    for (unsigned int k = 0; k < OriSize1; k++)
-                        newkeypoint.vec[ind1+k] = (newkeypoint_double.vec[ind2+k] + newkeypoint_double.vec[ind2+k+OriSize1])/2;
-                }
+            FoldHalfDescriptor(newkeypoint_double, false, newkeypoint);
             keys.push_back(newkeypoint);
 
-
-            newkeypoint_double.x = octSize * octCol;	/*x coordinate */
-            newkeypoint_double.y = octSize * octRow;	/*y coordinate */
-            newkeypoint_double.scale = octSize * octScale;	/* scale */
-            if (angle<0)
-                newkeypoint_double.angle = angle + PI; /* orientation */
-            else
-                newkeypoint_double.angle = angle - PI;
-            MakeKeypointSample(newkeypoint_double,grad,ori,octScale,octRow,octCol,par);
-
-            //keypoint newkeypoint2;
-            newkeypoint.x = octSize * octCol;	/*x coordinate */
-            newkeypoint.y = octSize * octRow;	/*y coordinate */
-            newkeypoint.scale = octSize * octScale;	/* scale */
-            newkeypoint.radius = newkeypoint_double.radius;
-            if (angle<0)
-                newkeypoint.angle = angle + PI;//fmod(angle,M_PI/2);		/* fmod(angle,M_PI) */
-            else
-                newkeypoint.angle = angle - PI;//fmod(angle,M_PI/2);		/* fmod(angle,M_PI) */
-
-            for (unsigned int i = 0; i < IndexSize1; i++)
-                for (unsigned int j = 0; j < IndexSize1; j++)
-                {
-                    ind1 = i*IndexSize1*OriSize1 + j*OriSize1;
-                    ind2 = i*IndexSize1*2*OriSize1 + j*2*OriSize1;
-                    for (unsigned int k = 0; k < OriSize1; k++)
-                        newkeypoint.vec[ind1+k] = (newkeypoint_double.vec[ind2+k] + newkeypoint_double.vec[ind2+k+OriSize1])/2;
-                }
+            newkeypoint.angle = opposite_angle;//fmod(angle,M_PI/2);		/* fmod(angle,M_PI) */
+            FoldHalfDescriptor(newkeypoint_double, true, newkeypoint);
             keys.push_back(newkeypoint);
         }
     }
@@ -1160,10 +1921,10 @@ void MakeKeypoint(flimage& blur,
         newkeypoint.y = octSize * octRow;	/*y coordinate */
         newkeypoint.scale = octSize * octScale;	/* scale */
         newkeypoint.angle = angle;		/* orientation */
-        MakeKeypointSample(newkeypoint,grad,ori,octScale,octRow,octCol,par);
+        MakeKeypointSample(newkeypoint,grad,oribin,octScale,octRow,octCol,par);
 #ifdef _ACD
-        if (desc_type == IMAS_AC || desc_type ==IMAS_AC_Q || desc_type == IMAS_AC_W)
-            UpdateKeypoint_AC(blur,newkeypoint,octScale,octRow,octCol,par);
+        if (par.DescType == IMAS_AC || par.DescType ==IMAS_AC_Q || par.DescType == IMAS_AC_W)
+            UpdateKeypoint_AC(grad,oribin,newkeypoint,octScale,octRow,octCol,par,pool);
 #endif
         if (newkeypoint.radius>0.0f)
             keys.push_back(newkeypoint);
@@ -1179,12 +1940,12 @@ void MakeKeypoint(flimage& blur,
 */
 template <unsigned int OriSize,unsigned int IndexSize>
 void MakeKeypointSample(
-        keypoint_base<OriSize,IndexSize>& key, const flimage& grad, const flimage& ori,
+        keypoint_base<OriSize,IndexSize>& key, const flimage& grad, const unsigned char* oribin,
         float scale, float row, float col,siftPar &par)
 {
     const int VecLength = IndexSize * IndexSize * OriSize;
     /* Produce sample vector. */
-    KeySampleVec(key, grad, ori, scale, row, col,par);
+    KeySampleVec(key, grad, oribin, scale, row, col,par);
 
 
     /* Normalize vector.  This should provide illumination invariance
@@ -1244,7 +2005,7 @@ void NormalizeVec(float* vec, int VecLength)
 */
 template <unsigned int OriSize,unsigned int IndexSize>
 void KeySampleVec(
-        keypoint_base<OriSize,IndexSize>& key, const flimage& grad, const flimage& ori,
+        keypoint_base<OriSize,IndexSize>& key, const flimage& grad, const unsigned char* oribin,
         float scale, float row, float col,siftPar &par)
 {
 
@@ -1257,7 +2018,7 @@ void KeySampleVec(
                 index[i][j][k] = 0.0;
 
 
-    KeySample(index, key, grad, ori, scale, row, col, par);
+    KeySample(index, key, grad, oribin, scale, row, col, par);
 
 
     /* Unwrap the 3D index values into 1D vec. */
@@ -1270,7 +2031,7 @@ void KeySampleVec(
 
 
 
-/* Add features to vec obtained from sampling the grad and ori images
+/* Add features to vec obtained from sampling the grad and oribin images
    for a particular scale.  Location of key is (scale,row,col) with respect
    to images at this scale.  We examine each pixel within a circular
    region containing the keypoint, and distribute the gradient for that
@@ -1279,7 +2040,7 @@ void KeySampleVec(
 template <unsigned int OriSize,unsigned int IndexSize>
 void KeySample(
         float index[IndexSize][IndexSize][OriSize], keypoint_base<OriSize,IndexSize>& key,
-        const flimage& grad, const flimage& ori, float scale, float row, float col,siftPar &par)
+        const flimage& grad, const unsigned char* oribin, float scale, float row, float col,siftPar &par)
 {
     float rpos, cpos, rx, cx;
 
@@ -1302,9 +2063,18 @@ void KeySample(
     //key.radius = (int) (par.OriSigma * scale * par.MagFactor);
     key.radius = (float) iradius; // Mariano Rodríguez
 
+    /* Gaussian weight of a sample, as function of radial distance
+       from center.  Sigma is relative to half-width of index. */
+    float	sigma  = par.IndexSigma * 0.5 * IndexSize,
+            inv2sigma2 = 1.0 / (2.0 * sigma * sigma);
+
     /* Examine all points from the gradient image that could lie within the
     index square. */
     for (int i = -iradius; i <= iradius; i++) {
+
+        /* Row contribution to the rotated offset */
+        float rrow = cosine * i - (row - irow), crow = sine * i - (col - icol);
+
         for (int j = -iradius; j <= iradius; j++) {
 
             /* Rotate sample offset to make it relative to key orientation.
@@ -1314,8 +2084,8 @@ void KeySample(
             */
 
             /* Guoshen Yu, inverse the rotation */
-            rpos = ((cosine * i - sine * j) - (row - irow)) / spacing;
-            cpos = ((sine * i + cosine * j) - (col - icol)) / spacing;
+            rpos = (rrow - sine * j) / spacing;
+            cpos = (crow + cosine * j) / spacing;
 
             /*
              rpos = ((cosine * i + sine * j) - (row - irow)) / spacing;
@@ -1335,14 +2105,15 @@ void KeySample(
 
                 if (r >= 0  &&  r < grad.nheight()  &&  c >= 0  &&  c < grad.nwidth())
                 {
-                    AddSample(index, key, grad, ori, r, c, rpos, cpos, rx, cx,par);
+                    float weight = slut((rpos * rpos + cpos * cpos) * inv2sigma2, sift_exp_lut);
+                    AddSample(index, key, grad, oribin, r, c, weight, rx, cx,par);
 
                     // Computing structure tensor // Mariano Rodríguez
                     float mag = grad(c,r);
-                    float theta = ori(c,r);
-                    float dx = mag*cos(theta), dy = mag*sin(theta);
-                    ts_xx += pow(dx,2);
-                    ts_yy += pow(dy,2);
+                    int b = oribin[r*grad.nwidth()+c];
+                    float dx = mag * sift_bin_cos[b], dy = mag * sift_bin_sin[b];
+                    ts_xx += dx*dx;
+                    ts_yy += dy*dy;
                     ts_xy += dx*dy;
                 }
 
@@ -1368,25 +2139,22 @@ void KeySample(
 }
 
 
-/* Given a sample from the image gradient, place it in the index array.
+/* Given a sample from the image gradient and its Gaussian weight (see KeySample),
+   place it in the index array.
 */
 template <unsigned int OriSize,unsigned int IndexSize>
 void AddSample(
         float index[IndexSize][IndexSize][OriSize], keypoint_base<OriSize,IndexSize>& key,
-        const flimage& grad, const flimage& orim,
-        int r, int c, float rpos, float cpos, float rx, float cx,siftPar &par)
+        const flimage& grad, const unsigned char* oribin,
+        int r, int c, float weight, float rx, float cx,siftPar &par)
 {
 
-    /* Compute Gaussian weight for sample, as function of radial distance
-       from center.  Sigma is relative to half-width of index. */
-    float	sigma  = par.IndexSigma * 0.5 * IndexSize,
-            weight = exp(- (rpos * rpos + cpos * cpos) / (2.0 * sigma * sigma)),
-            mag    = weight *  grad(c,r);
+    float	mag    = weight *  grad(c,r);
     //		mag    = weight *  grad((int)c,(int)r); // Guoshen Yu, explicitely cast to int to avoid warning
 
 
     /* Subtract keypoint orientation to give ori relative to keypoint. */
-    float	ori = orim(c,r) -  key.angle;
+    float	ori = sift_bin_angle[oribin[r*grad.nwidth()+c]] -  key.angle;
     //	float	ori = orim((int)c,(int)r) -  key.angle; // Guoshen Yu, explicitely cast to int to avoid warning
 
 
@@ -96,11 +96,31 @@ struct keypoint_base {
     static const unsigned int veclength = IndexSize * IndexSize * OriSize;
 };
 
+/* Storage shared by the AC patches of the keypoints found in one image (one simulation).
+   Patches are carved out of large blocks which are all released with the pool. */
+#define AC_POOL_BLOCK (1<<20)
+class ac_patch_pool
+{
+public:
+    ac_patch_pool();
+    ~ac_patch_pool();
+    void * allocate(size_t bytes);
+private:
+    std::vector<char*> blocks;
+    char * current;
+    size_t used;
+    ac_patch_pool(const ac_patch_pool&);
+    ac_patch_pool& operator=(const ac_patch_pool&);
+};
+
+
 struct keypoint:keypoint_base<OriSize1,IndexSize1>
 {
 #ifdef _ACD
     double* gradangle;
     double* gradmod;
+    /* AC-Q bitplanes: defined mask followed by the bits of the orientation bin */
+    unsigned long long* acq_bits;
 #endif
 };
 
@@ -113,6 +133,14 @@ extern int NewOriSize1;
 extern double sigma_default;
 extern double step_sigma;
 extern double quant_prec;
+
+/* Layout of the AC-Q bitplanes (64 patch pixels per word) */
+extern int acq_bins;
+extern int acq_planes;
+extern int acq_words;
+
+void set_quantised_layout(int X, int Y);
+void pack_quantised_orientations(keypoint & key, int X, int Y, ac_patch_pool * pool);
 #endif
 
 
@@ -273,6 +301,24 @@ bool MODE_ROOT; /*true*/
 bool half_sift_trick; /*=false*/
 bool L2norm; /* =true... false = L2 Norm   */
 
+/* Maximum number of scale-space peaks kept in the image, selected by their DOG
+   response before any orientation or descriptor is computed (a peak may still
+   give several keypoints, one per dominant orientation). 0 means no limit. */
+int MaxKeypoints; /*0*/
+
+/* If TRUE, the MaxKeypoints peaks are selected by adaptive non-maximal
+   suppression instead of by response alone, for an even spatial coverage. */
+bool ANMS; /*false*/
+
+/* If TRUE, the blurred and DOG images of each octave are stored in half
+   precision (16 bits) instead of float. Levels are still computed in float
+   and read back as floats, but the scale space takes half the memory. */
+bool HalfStorage; /*false*/
+
+/* IMAS index of the descriptor to compute (IMAS_SIFT, IMAS_ROOTSIFT, IMAS_AC...),
+   which selects the variants above that are not flags of their own. */
+int DescType; /*IMAS_SIFT*/
+
 };
 
 //////////////////////////////////////////////////////////
@@ -285,7 +331,45 @@ void default_sift_parameters(siftPar &par);
 
 std::vector<int> random_inds(int amount);
 
-void compute_sift_keypoints(float *input,  keypointslist& keypoints,int width, int height, siftPar &par);
+void compute_sift_keypoints(float *input,  keypointslist& keypoints,int width, int height, siftPar &par, ac_patch_pool * pool = NULL);
+
+
+/* A scale-space peak localised by InterpKeyPoint, waiting for its orientations and descriptors */
+struct sift_peak
+{
+    float octScale, octRow, octCol;
+    float response;     /* |DOG| at the peak */
+    int level;          /* index in sift_levels::blur */
+};
+
+/* With a keypoint budget, or with compute_sift_peaks(), peaks of all octaves
+   are found first and only the selected ones are described afterwards. This
+   keeps the blurred images at which peaks were found. */
+struct sift_levels
+{
+    std::vector<flimage*> blur;
+    std::vector<hfimage*> hblur;    /* instead of blur with par.HalfStorage */
+    std::vector<float> octSize;
+    std::vector<sift_peak> peaks;
+    ~sift_levels()
+    {
+        for (int i = 0; i < (int) blur.size(); i++) delete blur[i];
+        for (int i = 0; i < (int) hblur.size(); i++) delete hblur[i];
+    }
+};
+
+/* Detection alone: the peaks compute_sift_keypoints() would describe (selected
+   if par.MaxKeypoints > 0) and the levels they lie on. Owned by the caller. */
+sift_levels * compute_sift_peaks(float *input, int width, int height, siftPar &par);
+
+/* Position, scale and radius of the keypoints of peak p, as given by MakeKeypoint */
+void sift_peak_geometry(const sift_levels& levels, int p, float& x, float& y, float& scale, float& radius, siftPar &par);
+
+/* Keypoints of the peaks of levels marked in wanted (all of them if NULL), in
+   the order of the peaks: first[p] to first[p+1] are those of peak p. */
+void describe_sift_peaks(sift_levels& levels, const std::vector<bool> * wanted, keypointslist& keypoints,
+                         std::vector<int>& first, siftPar &par, ac_patch_pool * pool = NULL);
+
 #endif // _LIBSIFT_H_
 
 
@@ -10,14 +10,27 @@
 
 
 
+// Gaussian weights (sigma 3.3) of the 20x20 samples of the descriptor window,
+// indexed by (5i+k,5j+l) for the sample (k,l) of the cell (i,j).
+static struct descriptorWeights {
+	REGULAR_IMAGE w[5*DESCRIPTOR_SIZE_1D][5*DESCRIPTOR_SIZE_1D];
+	descriptorWeights()
+	{
+		for(int u=0;u<5*DESCRIPTOR_SIZE_1D;u++)
+			for(int v=0;v<5*DESCRIPTOR_SIZE_1D;v++)
+				w[u][v]=gaussian(u-10+0.5,v-10+0.5,3.3);
+	}
+} gaussDescriptor;
+
+
 // For a given list of keypoints, return the associated list of descriptors.
 // Handle the integral image suppression.
 listDescriptor* getDescriptor(imageIntegral* imgInt,listKeyPoints* lPC)
 {
-	listDescriptor* lD=new listDescriptor();
+	listDescriptor* lD=new listDescriptor(lPC->size());
     // Compute descriptor from each keypoints
 	for(int i=0;i<(int)lPC->size();i++)
-		lD->push_back(makeDescriptor(imgInt, (*lPC)[i]));
+		makeDescriptor(imgInt, (*lPC)[i], &(*lD)[i]);
 	delete imgInt;/*MemCheck*/
 	return lD;
 }
@@ -25,26 +38,23 @@ listDescriptor* getDescriptor(imageIntegral* imgInt,listKeyPoints* lPC)
 
 
 // Create a descriptor in a squared domain of size 20*scale
-descriptor* makeDescriptor(imageIntegral* imgInt,keyPoint* pC)
+void makeDescriptor(imageIntegral* imgInt,keyPoint* pC,descriptor* desc)
 {
 	REGULAR_IMAGE scale=pC->scale;
-	descriptor* desc=new descriptor();
 	// Divide in a 4x4 zone the space around the interest point
 
 	// First compute the orientation.
 	REGULAR_IMAGE cosP=cos(pC->orientation);
 	REGULAR_IMAGE sinP=sin(pC->orientation);
 	REGULAR_IMAGE norm=0,u,v,gauss,responseU,responseV,responseX,responseY;
+	REGULAR_IMAGE sums[DESCRIPTOR_LENGTH];
 	
 	// Divide in 16 sectors the space around the interest point.
 	for(int i=0;i<DESCRIPTOR_SIZE_1D;i++)
 	{
 	   for(int j=0;j<DESCRIPTOR_SIZE_1D;j++)
 		{
-			(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDx=0;
-			(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDx=0;
-			(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDy=0;
-			(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDy=0;
+			REGULAR_IMAGE sumDx=0,sumDy=0,sumAbsDx=0,sumAbsDy=0;
 			// Then each 4x4 is subsampled into a 5x5 zone
 			for(int k=0;k<5;k++)
 			{
@@ -59,7 +69,7 @@ descriptor* makeDescriptor(imageIntegral* imgInt,keyPoint* pC)
 					responseY=haarY(imgInt,u,v,fround(scale));
 					
 					// Gaussian weight
-					gauss=gaussian(((i-2)*5+k+0.5),((j-2)*5+l+0.5),3.3);
+					gauss=gaussDescriptor.w[5*i+k][5*j+l];
 					
 				    // Rotation of the axis
 					//responseU = gauss*( -responseX*sinP + responseY*cosP);
@@ -68,31 +78,31 @@ descriptor* makeDescriptor(imageIntegral* imgInt,keyPoint* pC)
 					responseV = gauss*(-responseX*sinP + responseY*cosP);
                     
 				    // The descriptors.
-				    (desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDx+=responseU;
-				    (desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDx+=absval(responseU);
-				    (desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDy+=responseV;
-					(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDy+=absval(responseV);
+				    sumDx+=responseU;
+				    sumAbsDx+=absval(responseU);
+				    sumDy+=responseV;
+					sumAbsDy+=absval(responseV);
 					
 				}
 			}
+			REGULAR_IMAGE* cell=sums+4*(DESCRIPTOR_SIZE_1D*i+j);
+			cell[0]=sumDx;
+			cell[1]=sumDy;
+			cell[2]=sumAbsDx;
+			cell[3]=sumAbsDy;
 			// Compute the norm of the vector
-			norm+=(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDx*(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDx+(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDy*(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumAbsDy+((desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDx*(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDx+(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDy*(desc->list[DESCRIPTOR_SIZE_1D*i+j]).sumDy);
+			norm+=sumAbsDx*sumAbsDx+sumAbsDy*sumAbsDy+(sumDx*sumDx+sumDy*sumDy);
 
 		}
 	}
 	// Normalization of the descriptors in order to improve invariance to contrast change
     // and whitening the descriptors.
 	norm=sqrtf(norm);
-	if(norm!=0)
-	for(int i=0;i<DESCRIPTOR_SIZE_1D*DESCRIPTOR_SIZE_1D;i++)
-	{
-		(desc->list[i]).sumDx/=norm;
-		(desc->list[i]).sumAbsDx/=norm;
-		(desc->list[i]).sumDy/=norm;
-		(desc->list[i]).sumAbsDy/=norm;	
-	}
-	desc->kP=new keyPoint(*pC);
-	return desc;
+	if(norm==0)
+		norm=1;
+	for(int i=0;i<DESCRIPTOR_LENGTH;i++)
+		desc->vec[i]=(float) (sums[i]/norm);
+	desc->kP=*pC;
 }
 
 
@@ -18,53 +18,31 @@
 
 
 
-// Class of the descriptor for the vector of SURF's detected keypoint.
-class vectorDescriptor{
-	public :
-	REGULAR_IMAGE sumDx;
-	REGULAR_IMAGE sumDy;
-	REGULAR_IMAGE sumAbsDx;
-	REGULAR_IMAGE sumAbsDy;
-	// Initialization
-	vectorDescriptor(REGULAR_IMAGE sumDx_,REGULAR_IMAGE sumDy_,REGULAR_IMAGE sumAbsDx_,REGULAR_IMAGE sumAbsDy_):sumDx(sumDx_),sumDy(sumDy_),sumAbsDx(sumAbsDx_),sumAbsDy(sumAbsDy_){}
-	vectorDescriptor():sumDx(0),sumDy(0),sumAbsDx(0),sumAbsDy(0){}
-};
-
-
+// Length of the descriptor: sum dx, sum dy, sum |dx|, sum |dy| for each of the
+// DESCRIPTOR_SIZE_1D x DESCRIPTOR_SIZE_1D cells.
+#define DESCRIPTOR_LENGTH (4*DESCRIPTOR_SIZE_1D*DESCRIPTOR_SIZE_1D)
 
-// Descriptor of a keypoint, with its vector descriptor and several other additional informations.
+// Descriptor of a keypoint, with its vector descriptor and the keypoint itself.
 class descriptor{
 public:
     // The array is ordered as sum dx, sum dy, sum |dx|, sum |dy| for each cell in the array
     // of size 20s.
-    vectorDescriptor* list;
-    
-	keyPoint *kP;// Keypoint pointer.
-
-    descriptor(){list=new vectorDescriptor[16];kP = new keyPoint();}
-
-	~descriptor(){/* MemCheck*/delete kP;delete[] list;}
+    float vec[DESCRIPTOR_LENGTH];
 
-	// Copy constructor
-    descriptor(const descriptor & des){
-        list=new vectorDescriptor[DESCRIPTOR_SIZE_1D*DESCRIPTOR_SIZE_1D];
-        for(int i=0;i<DESCRIPTOR_SIZE_1D*DESCRIPTOR_SIZE_1D;i++)
-            list[i]=(des.list)[i];
-        kP=new keyPoint(*des.kP);}
-	
+	keyPoint kP;// Keypoint.
 };
 
-// List of descriptor
-typedef  std::vector<descriptor*> listDescriptor;
+// List of descriptors, stored contiguously
+typedef  std::vector<descriptor> listDescriptor;
 
-// This function creates the descriptors from list of key points and
+// This function computes the descriptor of a keypoint in desc and
 // uses the integrale image
-descriptor* makeDescriptor(imageIntegral* imgInt,keyPoint* pC);
+void makeDescriptor(imageIntegral* imgInt,keyPoint* pC,descriptor* desc);
 
 // This function creates the list of descriptors
 listDescriptor* getDescriptor(imageIntegral* imgInt,listKeyPoints* lPC);
 
-// This function creates the list of keypoints
-listDescriptor* getKeyPoints(image *img,listKeyPoints* lKP,float threshold);
+// This function creates the list of keypoints, at most maxKeypoints of them if maxKeypoints>0
+listDescriptor* getKeyPoints(image *img,listKeyPoints* lKP,float threshold,int maxKeypoints=0,bool anms=false);
 
 #endif
@@ -10,7 +10,8 @@
 using namespace std;
 
 // Should be execute as surf file1.png descriptors.txt
-listDescriptor* extract_surf(float* img_double, int width, int height)
+// If maxKeypoints>0, at most maxKeypoints keypoints are described (see getKeyPoints).
+listDescriptor* extract_surf(float* img_double, int width, int height, int maxKeypoints, bool anms)
 {
 
 
@@ -28,7 +29,7 @@ listDescriptor* extract_surf(float* img_double, int width, int height)
     listDescriptor* listDesc;
     
 	// Keypoints detection and description
-    listDesc=getKeyPoints(img,l,threshold);
+    listDesc=getKeyPoints(img,l,threshold,maxKeypoints,anms);
 		
 	// Free memory
     /*MemCheck*/
@@ -15,4 +15,4 @@
 #include <stdlib.h>
 #endif
 
-listDescriptor* extract_surf(float* img_double, int width, int height);
+listDescriptor* extract_surf(float* img_double, int width, int height, int maxKeypoints=0, bool anms=false);
@@ -150,11 +150,11 @@ void image::getSampledImage(int& x,int& y,int sample)
 void imageIntegral::computeIntegralImage(image* image)
 {
 	// Initialization
-    img[0]=(*image)(0,0);
+    img[0]=(INTEGRAL_IMAGE)(*image)(0,0);
 
     // First row
     for(int i=1;i<image->getWidth();i++)
-		img[i]=img[i-1]+(*image)(i,0);
+		img[i]=img[i-1]+(INTEGRAL_IMAGE)(*image)(i,0);
 
     // Recursion
 	for(int j=1;j<image->getHeight();j++)
@@ -162,7 +162,7 @@ void imageIntegral::computeIntegralImage(image* image)
 		INTEGRAL_IMAGE h=0;
 		for(int i=0;i<image->getWidth();i++)
 		{
-			h+=(*image)(i,j);
+			h+=(INTEGRAL_IMAGE)(*image)(i,j);
 			img[i+width*j]=img[i+width*(j-1)]+h;
 		}
 	}
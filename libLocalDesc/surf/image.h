@@ -62,6 +62,7 @@ public:
     void computeIntegralImage(image* img);
 	inline INTEGRAL_IMAGE& operator()(int x, int y) {return img[width*(y+padding)+(x+padding)];} // setter
     inline INTEGRAL_IMAGE  operator()(int x, int y) const {return img[width*(y+padding)+(x+padding)];} // accessor
+    inline const INTEGRAL_IMAGE* row(int y) const {return img+width*(y+padding)+padding;} // pointer to (0,y)
 
 
 private:
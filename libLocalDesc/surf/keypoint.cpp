@@ -7,116 +7,249 @@
  */
 
 #include "keypoint.h"
+#include "libSimuTilts/library.h"
 #include <iostream>
 #include <fstream>
 
-// Compute the list of descriptors and keypoints, for a given threshold
-listDescriptor* getKeyPoints(image *img,listKeyPoints* lKP,float threshold)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A detected and refined maximum of the Hessian, whose orientation is computed
+// once the keypoints to keep are known
+struct detection {
+	REGULAR_IMAGE x,y,scale;
+	bool signLaplacian;
+	float response;
+};
+
+// A box filter given as in squareConvolutionXY, by its offsets to the four
+// corners read in the integral image: rows (ya,yb) and columns (xa,xb).
+struct boxFilter {
+	int ya,yb,xa,xb;
+	boxFilter(int a,int b,int c,int d):ya(-b),yb(-b-d),xa(-a),xb(-a-c){}
+};
+
+// Sum of the box at column x, between the rows ra=row(y+ya) and rb=row(y+yb).
+// Wrapped around sums are exact once converted to int (see INTEGRAL_IMAGE).
+inline int boxSum(const INTEGRAL_IMAGE* ra,const INTEGRAL_IMAGE* rb,const boxFilter& f,int x)
 {
+	return (int) (rb[x+f.xb]+ra[x+f.xa]-ra[x+f.xb]-rb[x+f.xa]);
+}
 
-	// Compute the integral image
-    imageIntegral* imgInt=new imageIntegral(img);
-
-    // Array of each Hessians and of each sign of the Laplacian
-    image*  hessian[INTERVAL];
-    image* signLaplacian[INTERVAL];
+#ifdef __SSE2__
+// Four consecutive samples with step s
+inline __m128i load4(const INTEGRAL_IMAGE* p,int s)
+{
+	if(s==1)
+		return _mm_loadu_si128((const __m128i*) p);
+	return _mm_set_epi32((int) p[3*s],(int) p[2*s],(int) p[s],(int) p[0]);
+}
 
-	// Auxiliary variables
-	double Dxx,Dxy,Dyy;
-	int intervalCounter,octaveCounter,x,y,w,h,xcoo,ycoo,lp1,l3,mlp1p2,lp1d2,l2p1,pow2,sample,l;
-    double nxy,nxx;
+// boxSum at the columns x, x+s, x+2s and x+3s
+inline __m128i boxSum4(const INTEGRAL_IMAGE* ra,const INTEGRAL_IMAGE* rb,const boxFilter& f,int x,int s)
+{
+	__m128i sum=_mm_add_epi32(load4(rb+x+f.xb,s),load4(ra+x+f.xa,s));
+	return _mm_sub_epi32(sum,_mm_add_epi32(load4(ra+x+f.xb,s),load4(rb+x+f.xa,s)));
+}
+#endif
 
-    // For loop on octave
-    for( octaveCounter=0;octaveCounter<OCTAVE;octaveCounter++)
+// Compute the Hessian responses of an interval at a given octave on the sampled grid of size (w,h).
+// Box sums are integers: the filters are only normalized, in float, when the response is formed.
+void computeHessian(const imageIntegral* imgInt,int octave,int interval,int w,int h,hessianImage* hessian)
+{
+	int pow2=1<<(octave+1);
+	int sample=1<<octave; // SAMPLE_IMAGE^octave
+	int l=pow2*(interval+1)+1; // the "L" in the article.
+
+	// These variables are precomputed to allow fast computations.
+	// They correspond exactly to the Gamma of the formula given in the article for
+	// the second order filters.
+	int lp1=-l+1;
+	int l3=3*l;
+	int lp1d2=(-l+1)/2;
+	int mlp1p2=(-l+1)/2-l;
+	int l2p1=2*l-1;
+
+	float inxx=1.0f/(float) sqrt((double) 6*l*(2*l-1));// frobenius norm of the xx and yy filters
+	float inxy=1.0f/(float) sqrt((double) 4*l*l);// frobenius of the xy filter.
+
+	const boxFilter xx1(lp1,mlp1p2,l2p1,l3), xx2(lp1,lp1d2,l2p1,l);
+	const boxFilter yy1(mlp1p2,lp1,l3,l2p1), yy2(lp1d2,lp1,l,l2p1);
+	const boxFilter xy1(1,1,l,l), xy2(0,0,-l,-l), xy3(1,0,l,-l), xy4(0,1,-l,l);
+
+	hessian->create(w,h);
+
+	// These are the time consuming loops that compute the Hessian at each points.
+	for(int y=0;y<h;y++)
 	{
-        pow2=pow(2,octaveCounter+1);
-
-        sample=pow(SAMPLE_IMAGE,octaveCounter);// Sampling step
-
-        img->getSampledImage(w,h,sample);// Build a sampled images filled in with 0
-
-        // Memory initialization
-        for(int i=0;i<INTERVAL;i++)
-        {
-            hessian[i]=new image(w,h);
-            signLaplacian[i]=new image(w,h);
-        }
-
-        // For loop on intervals
-        for( intervalCounter=0;intervalCounter<INTERVAL;intervalCounter++)
+		int ycoo=y*sample;
+		float* response=&hessian->response[y*w];
+		unsigned int* sign=&hessian->sign[y*hessian->words];
+
+		int x=0;
+#ifdef __SSE2__
+		const __m128 vnxx=_mm_set1_ps(inxx), vnxy=_mm_set1_ps(inxy), vw=_mm_set1_ps(0.8317f);
+		const __m128i zero=_mm_setzero_si128();
+		for(;x+4<=w;x+=4)
 		{
-            l=pow2*(intervalCounter+1)+1; // the "L" in the article.
-
-            // These variables are precomputed to allow fast computations.
-            // They correspond exactly to the Gamma of the formula given in the article for
-            // the second order filters.
-            lp1=-l+1;
-            l3=3*l;
-            lp1d2=(-l+1)/2;
-            mlp1p2=(-l+1)/2-l;
-            l2p1=2*l-1;
+			int xcoo=x*sample;
+			__m128i b, dxx, dyy, dxy;
+
+			// Second order filters
+			b=boxSum4(imgInt->row(ycoo+xx2.ya),imgInt->row(ycoo+xx2.yb),xx2,xcoo,sample);
+			dxx=_mm_sub_epi32(boxSum4(imgInt->row(ycoo+xx1.ya),imgInt->row(ycoo+xx1.yb),xx1,xcoo,sample),
+				_mm_add_epi32(_mm_add_epi32(b,b),b));
+			b=boxSum4(imgInt->row(ycoo+yy2.ya),imgInt->row(ycoo+yy2.yb),yy2,xcoo,sample);
+			dyy=_mm_sub_epi32(boxSum4(imgInt->row(ycoo+yy1.ya),imgInt->row(ycoo+yy1.yb),yy1,xcoo,sample),
+				_mm_add_epi32(_mm_add_epi32(b,b),b));
+			dxy=_mm_add_epi32(
+				_mm_add_epi32(boxSum4(imgInt->row(ycoo+xy1.ya),imgInt->row(ycoo+xy1.yb),xy1,xcoo,sample),
+					boxSum4(imgInt->row(ycoo+xy2.ya),imgInt->row(ycoo+xy2.yb),xy2,xcoo,sample)),
+				_mm_add_epi32(boxSum4(imgInt->row(ycoo+xy3.ya),imgInt->row(ycoo+xy3.yb),xy3,xcoo,sample),
+					boxSum4(imgInt->row(ycoo+xy4.ya),imgInt->row(ycoo+xy4.yb),xy4,xcoo,sample)));
+
+			// Computation of the Hessian and Laplacian
+			__m128 fxx=_mm_mul_ps(_mm_cvtepi32_ps(dxx),vnxx);
+			__m128 fyy=_mm_mul_ps(_mm_cvtepi32_ps(dyy),vnxx);
+			__m128 fxy=_mm_mul_ps(_mm_cvtepi32_ps(dxy),vnxy);
+			_mm_storeu_ps(response+x,_mm_sub_ps(_mm_mul_ps(fxx,fyy),_mm_mul_ps(vw,_mm_mul_ps(fxy,fxy))));
+			int positive=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_add_epi32(dxx,dyy),zero)));
+			sign[x>>5]|=((unsigned int) positive)<<(x&31);
+		}
+#endif
+		for(;x<w;x++)
+		{
+			int xcoo=x*sample;
+
+			// Second order filters
+			int dxx=boxSum(imgInt->row(ycoo+xx1.ya),imgInt->row(ycoo+xx1.yb),xx1,xcoo)
+				-3*boxSum(imgInt->row(ycoo+xx2.ya),imgInt->row(ycoo+xx2.yb),xx2,xcoo);
+			int dyy=boxSum(imgInt->row(ycoo+yy1.ya),imgInt->row(ycoo+yy1.yb),yy1,xcoo)
+				-3*boxSum(imgInt->row(ycoo+yy2.ya),imgInt->row(ycoo+yy2.yb),yy2,xcoo);
+			int dxy=boxSum(imgInt->row(ycoo+xy1.ya),imgInt->row(ycoo+xy1.yb),xy1,xcoo)
+				+boxSum(imgInt->row(ycoo+xy2.ya),imgInt->row(ycoo+xy2.yb),xy2,xcoo)
+				+boxSum(imgInt->row(ycoo+xy3.ya),imgInt->row(ycoo+xy3.yb),xy3,xcoo)
+				+boxSum(imgInt->row(ycoo+xy4.ya),imgInt->row(ycoo+xy4.yb),xy4,xcoo);
+
+			// Computation of the Hessian and Laplacian
+			float fxx=(float) dxx*inxx, fyy=(float) dyy*inxx, fxy=(float) dxy*inxy;
+			response[x]=fxx*fyy-0.8317f*(fxy*fxy);
+			if(dxx+dyy>0)
+				sign[x>>5]|=1u<<(x&31);
+		}
+	}
+}
 
-            nxx=sqrt(6*l*(2*l-1));// frobenius norm of the xx and yy filters
-            nxy=sqrt(4*l*l);// frobenius of the xy filter.
 
+// Detect the keypoints of an octave from its Hessian responses
+static void detectOctave(const hessianImage* hessian,int octave,float threshold,std::vector<detection>* detections)
+{
+	int pow2=1<<(octave+1);
+	int sample=1<<octave;
+	int w=hessian[0].getWidth(), h=hessian[0].getHeight();
+	REGULAR_IMAGE x_,y_,s_;
 
-            // These are the time consuming loops that compute the Hessian at each points.
-            for( y=0;y<h;y++)
-			{
-				for( x=0;x<w;x++)
+	for(int intervalCounter=1;intervalCounter<INTERVAL-1;intervalCounter++)
+	{
+		// border points are removed
+		for(int y=1;y<h-1;y++)
+			for(int x=1 ; x<w-1 ; x++)
+				if(isMaximum(hessian, x, y, intervalCounter,threshold))
 				{
-                    // Sampling
-                    xcoo=x*sample;
-                    ycoo=y*sample;
-
-                    // Second order filters
-                    Dxx=squareConvolutionXY(imgInt,lp1,mlp1p2,l2p1,l3,xcoo,ycoo)-3*squareConvolutionXY(imgInt,lp1,lp1d2,l2p1,l,xcoo,ycoo);
-                    Dxx/=nxx;
-
-					Dyy=squareConvolutionXY(imgInt,mlp1p2,lp1,l3,l2p1,xcoo,ycoo)-3*squareConvolutionXY(imgInt,lp1d2,lp1,l,l2p1,xcoo,ycoo);
-                    Dyy/=nxx;
-					Dxy=squareConvolutionXY(imgInt,1,1,l,l,xcoo,ycoo)+squareConvolutionXY(imgInt,0,0,-l,-l,xcoo,ycoo)
-						+squareConvolutionXY(imgInt,1,0,l,-l,xcoo,ycoo)+squareConvolutionXY(imgInt,0,1,-l,l,xcoo,ycoo);
-
-                    Dxy/=nxy;
-
-                    // Computation of the Hessian and Laplacian
-                    (*hessian[intervalCounter])(x,y)= (Dxx*Dyy-0.8317*(Dxy*Dxy));
-                    (*signLaplacian[intervalCounter])(x,y)=Dxx+Dyy>0;
+					x_=x*sample;
+					y_=y*sample;
+					s_=0.4*(pow2*(intervalCounter+1)+2); // box size or scale
+					// Affine refinement is performed for a given octave and sampling
+					if( interpolationScaleSpace(hessian, x, y, intervalCounter, x_, y_, s_, sample,pow2) )
+					{
+						detection d;
+						d.x=x_; d.y=y_; d.scale=s_;
+						d.signLaplacian=hessian[intervalCounter].signLaplacian(x,y);
+						d.response=hessian[intervalCounter](x,y);
+						detections->push_back(d);
+					}
 				}
-			}
+	}
+}
 
 
+// Compute the list of descriptors and keypoints, for a given threshold.
+// If maxKeypoints>0, only the maxKeypoints detections with the largest Hessian
+// (or the ones chosen by adaptive non-maximal suppression if anms) are described.
+listDescriptor* getKeyPoints(image *img,listKeyPoints* lKP,float threshold,int maxKeypoints,bool anms)
+{
 
-		}
+	// Compute the integral image
+    imageIntegral* imgInt=new imageIntegral(img);
 
-        REGULAR_IMAGE x_,y_,s_;
+    // Hessians and signs of the Laplacian of every interval of every octave
+    std::vector<hessianImage> hessians(OCTAVE*INTERVAL);
+    hessianImage* hessian=&hessians[0];
 
-		// Detect keypoints
-        for(intervalCounter=1;intervalCounter<INTERVAL-1;intervalCounter++)
-		{
-			l=(pow2*(intervalCounter+1)+1);
-                // border points are removed
-				for(int y=1;y<h-1;y++)
-					for(int x=1 ; x<w-1 ; x++)
-                        if(isMaximum(hessian, x, y, intervalCounter,threshold))
-                        {
-                            x_=x*sample;
-                            y_=y*sample;
-                            s_=0.4*(pow2*(intervalCounter+1)+2); // box size or scale
-                            // Affine refinement is performed for a given octave and sampling
-                            if( interpolationScaleSpace(hessian, x, y, intervalCounter, x_, y_, s_, sample,pow2) )
-                                addKeyPoint(imgInt, x_, y_, (*(signLaplacian[intervalCounter]))(x,y),s_, lKP);
-                        }
-		}
-
-        /* MemCheck*/
-        for(int j=0;j<INTERVAL;j++)
+    // One task per interval and octave
+    for(int octaveCounter=0;octaveCounter<OCTAVE;octaveCounter++)
+    {
+        int w,h;
+        img->getSampledImage(w,h,1<<octaveCounter);// Sampled size
+        for(int intervalCounter=0;intervalCounter<INTERVAL;intervalCounter++)
         {
-            delete hessian[j];
-            delete signLaplacian[j];
+#ifdef _OPENMP
+#pragma omp task firstprivate(imgInt, hessian, octaveCounter, intervalCounter, w, h)
+#endif
+            computeHessian(imgInt,octaveCounter,intervalCounter,w,h,hessian+octaveCounter*INTERVAL+intervalCounter);
         }
-
+    }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+
+    // Detect keypoints, one task per octave. Detections are then gathered in octave order.
+    std::vector< std::vector<detection> > found(OCTAVE);
+    std::vector<detection>* foundOctave=&found[0];
+    for(int octaveCounter=0;octaveCounter<OCTAVE;octaveCounter++)
+    {
+#ifdef _OPENMP
+#pragma omp task firstprivate(hessian, foundOctave, octaveCounter, threshold)
+#endif
+        detectOctave(hessian+octaveCounter*INTERVAL,octaveCounter,threshold,foundOctave+octaveCounter);
+    }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+
+    std::vector<detection> detections;
+    for(int octaveCounter=0;octaveCounter<OCTAVE;octaveCounter++)
+        detections.insert(detections.end(),found[octaveCounter].begin(),found[octaveCounter].end());
+    std::vector<hessianImage>().swap(hessians);
+
+    // Keypoint budget
+    int n=(int)detections.size();
+    std::vector<int> selected;
+    if(maxKeypoints>0 && n>maxKeypoints)
+    {
+        std::vector<float> xs(n),ys(n),responses(n);
+        for(int i=0;i<n;i++)
+        {
+            xs[i]=detections[i].x;
+            ys[i]=detections[i].y;
+            responses[i]=detections[i].response;
+        }
+        selected.resize(maxKeypoints);
+        if(anms)
+            select_anms(&xs[0],&ys[0],&responses[0],n,maxKeypoints,&selected[0]);
+        else
+            select_strongest(&responses[0],n,maxKeypoints,&selected[0]);
+    }
+    else
+        for(int i=0;i<n;i++)
+            selected.push_back(i);
+
+    // Orientations
+    for(int i=0;i<(int)selected.size();i++)
+    {
+        const detection& d=detections[selected[i]];
+        addKeyPoint(imgInt, d.x, d.y, d.signLaplacian, d.scale, lKP);
     }
 
     // Compute the descriptors
@@ -132,6 +265,17 @@ void addKeyPoint(imageIntegral* img,REGULAR_IMAGE i,REGULAR_IMAGE j,bool signL,R
 }
 
 
+// Gaussian weights (sigma 2) of the samples of the orientation window, indexed by (i+6,j+6)
+static struct orientationWeights {
+	REGULAR_IMAGE w[13][13];
+	orientationWeights()
+	{
+		for(int i=-6;i<=6;i++)
+			for(int j=-6;j<=6;j++)
+				w[i+6][j+6]=gaussian(i,j,2);
+	}
+} gaussOrientation;
+
 // Compute the orientation to assign to a keypoint
 float getOrientation(imageIntegral* imgInt,int x,int y,int sectors,REGULAR_IMAGE scale)
 {
@@ -139,7 +283,7 @@ float getOrientation(imageIntegral* imgInt,int x,int y,int sectors,REGULAR_IMAGE
 	REGULAR_IMAGE haarResponseY[sectors];
 	REGULAR_IMAGE haarResponseSectorX[sectors];
 	REGULAR_IMAGE haarResponseSectorY[sectors];
-    INTEGRAL_IMAGE answerX,answerY;
+    int answerX,answerY;
     REGULAR_IMAGE gauss;
 
     int theta;
@@ -163,7 +307,7 @@ float getOrientation(imageIntegral* imgInt,int x,int y,int sectors,REGULAR_IMAGE
 				theta=((theta>=0)?(theta):(theta+sectors));
 
 				// Gaussian weight
-                gauss=gaussian(i,j,2);
+                gauss=gaussOrientation.w[i+6][j+6];
 
                 // Cumulative answers
 				haarResponseSectorX[theta]+=answerX*gauss;
@@ -212,27 +356,27 @@ float getOrientation(imageIntegral* imgInt,int x,int y,int sectors,REGULAR_IMAGE
 
 
 // Scale space interpolation as described in Lowe
-bool interpolationScaleSpace(image** img,int x, int y, int i, REGULAR_IMAGE &x_, REGULAR_IMAGE &y_, REGULAR_IMAGE &s_, int sample, int octaveValue)
+bool interpolationScaleSpace(const hessianImage* img,int x, int y, int i, REGULAR_IMAGE &x_, REGULAR_IMAGE &y_, REGULAR_IMAGE &s_, int sample, int octaveValue)
 {
 	//If we are outside the image...
-	if(x<=0 || y<=0 || x>=img[i]->getWidth()-2 || y>=img[i]->getHeight()-2)
+	if(x<=0 || y<=0 || x>=img[i].getWidth()-2 || y>=img[i].getHeight()-2)
 		return false;
 	REGULAR_IMAGE mx,my,mi,dx,dy,di,dxx,dyy,dii,dxy,dxi,dyi;
 
     //Nabla X
-	dx=((*(img[i]))(x+1,y)-(*(img[i]))(x-1,y))/2;
-	dy=((*(img[i]))(x,y+1)-(*(img[i]))(x,y-1))/2;
-	di=((*(img[i]))(x,y)-(*(img[i]))(x,y))/2;
+	dx=(img[i](x+1,y)-img[i](x-1,y))/2;
+	dy=(img[i](x,y+1)-img[i](x,y-1))/2;
+	di=(img[i](x,y)-img[i](x,y))/2;
 
     //Hessian X
-	REGULAR_IMAGE a=(*(img[i]))(x,y);
-	dxx=(*(img[i]))(x+1,y)+(*(img[i]))(x-1,y)-2*a;
-	dyy=(*(img[i]))(x,y+1)+(*(img[i]))(x,y+1)-2*a;
-	dii=((*(img[i-1]))(x,y)+(*(img[i+1]))(x,y)-2*a);
-
-	dxy=((*(img[i]))(x+1,y+1)-(*(img[i]))(x+1,y-1)-(*(img[i]))(x-1,y+1)+(*(img[i]))(x-1,y-1))/4;
-	dxi=((*(img[i+1]))(x+1,y)-(*(img[i+1]))(x-1,y)-(*(img[i-1]))(x+1,y)+(*(img[i-1]))(x-1,y))/4;
-	dyi=((*(img[i+1]))(x,y+1)-(*(img[i+1]))(x,y-1)-(*(img[i-1]))(x,y+1)+(*(img[i-1]))(x,y-1))/4;
+	REGULAR_IMAGE a=img[i](x,y);
+	dxx=img[i](x+1,y)+img[i](x-1,y)-2*a;
+	dyy=img[i](x,y+1)+img[i](x,y+1)-2*a;
+	dii=(img[i-1](x,y)+img[i+1](x,y)-2*a);
+
+	dxy=(img[i](x+1,y+1)-img[i](x+1,y-1)-img[i](x-1,y+1)+img[i](x-1,y-1))/4;
+	dxi=(img[i+1](x+1,y)-img[i+1](x-1,y)-img[i-1](x+1,y)+img[i-1](x-1,y))/4;
+	dyi=(img[i+1](x,y+1)-img[i+1](x,y-1)-img[i-1](x,y+1)+img[i-1](x,y-1))/4;
 
     // Det
 	REGULAR_IMAGE det=dxx*dyy*dii-dxx*dyi*dyi-dyy*dxi*dxi+2*dxi*dyi*dxy-dii*dxy*dxy;
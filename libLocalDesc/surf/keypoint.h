@@ -44,25 +44,50 @@ void addKeyPoint(imageIntegral* img,REGULAR_IMAGE i,REGULAR_IMAGE j,bool signLap
 // Compute the orientation of a keypoint
 float getOrientation(imageIntegral* imgInt,int x,int y,int numberSector,REGULAR_IMAGE scale);
 
+// Hessian responses of one interval, in single precision, along with the sign of
+// the Laplacian packed one bit per pixel. Each row of the bitmap starts on a new word.
+class hessianImage {
+public:
+    hessianImage():width(0),height(0),words(0){}
+    void create(int w,int h)
+    {
+        width=w; height=h; words=(w+31)/32;
+        response.assign(w*h,0.0f);
+        sign.assign(words*h,0u);
+    }
+
+    inline int getWidth() const {return width;}
+    inline int getHeight() const {return height;}
+    inline float operator()(int x, int y) const {return response[y*width+x];}
+    inline bool signLaplacian(int x, int y) const {return (sign[y*words+(x>>5)]>>(x&31))&1u;}
+
+    int width,height,words;
+    std::vector<float> response;
+    std::vector<unsigned int> sign;
+};
+
+// Compute the Hessian responses of an interval at a given octave on the sampled grid of size (w,h).
+void computeHessian(const imageIntegral* imgInt,int octave,int interval,int w,int h,hessianImage* hessian);
+
 // Reject or interpolate the coordinate of a keypoint. This is necessary since there
 // was a subsampling of the image.
-bool interpolationScaleSpace(image** img,int x, int y, int i, REGULAR_IMAGE &x_, REGULAR_IMAGE &y_, REGULAR_IMAGE &s_, int sample, int octaveValue);
+bool interpolationScaleSpace(const hessianImage* img,int x, int y, int i, REGULAR_IMAGE &x_, REGULAR_IMAGE &y_, REGULAR_IMAGE &s_, int sample, int octaveValue);
 
 
 // Check if a point is a local maximum or not, and more than a given threshold.
-inline bool isMaximum(image** imageStamp,int x,int y,int scale, float threshold)
+inline bool isMaximum(const hessianImage* imageStamp,int x,int y,int scale, float threshold)
 {
-	REGULAR_IMAGE tmp=(*(imageStamp[scale]))(x,y);
+	float tmp=imageStamp[scale](x,y);
 	
 	if(tmp>threshold)
 	{
         for(int j=-1+y;j<2+y;j++)
             for(int i=-1+x;i<2+x;i++) {
-                if((*(imageStamp[scale-1]))(i,j)>=tmp)
+                if(imageStamp[scale-1](i,j)>=tmp)
                     return false;
-                if((*(imageStamp[scale+1]))(i,j)>=tmp)
+                if(imageStamp[scale+1](i,j)>=tmp)
                     return false;
-                if((x!=i || y!=j) && (*(imageStamp[scale]))(i,j)>=tmp)
+                if((x!=i || y!=j) && imageStamp[scale](i,j)>=tmp)
                     return false;
             }
 		return true;
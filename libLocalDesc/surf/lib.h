@@ -20,8 +20,9 @@ inline double gaussian(double x, double y, double sig);
 #define M_PI   3.14159265358979323846
 #endif /* !M_PI */
 
-// Type of the integral image
-typedef long int INTEGRAL_IMAGE;
+// Type of the integral image. Sums wrap around modulo 2^32, so that box sums
+// (differences of four entries) remain exact whatever the size of the image.
+typedef unsigned int INTEGRAL_IMAGE;
 
 // Type for a normal image
 typedef double REGULAR_IMAGE;
@@ -8,12 +8,21 @@
 
 #include "lib_match_surf.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 float surf_ratio=0.6;
 
 
 std::vector<MatchSurf> matchDescriptor(listDescriptor * l1, listDescriptor * l2)
 {
     std::vector<MatchSurf> matches;
+    // Indices of the descriptors of l2 by sign of the Laplacian: only
+    // descriptors with the same sign are compared
+    std::vector<int> bySign[2];
+    for(int j=0;j<(int)l2->size();j++)
+        bySign[(*l2)[j].kP.signLaplacian?1:0].push_back(j);
     
     // Matching is not symmetric.
     for(int i=0;i<(int)l1->size();i++)
@@ -22,33 +31,32 @@ std::vector<MatchSurf> matchDescriptor(listDescriptor * l1, listDescriptor * l2)
         float d1=3;
         float d2=3;
         
-        for(int j=0;j<(int)l2->size();j++)
+        const std::vector<int>& candidates=bySign[(*l1)[i].kP.signLaplacian?1:0];
+        for(int k=0;k<(int)candidates.size();k++)
         {
-			float d=euclideanDistance((*l1)[i],(*l2)[j]);
+            int j=candidates[k];
+			float d=euclideanDistance(&(*l1)[i],&(*l2)[j]);
 			// We select the two closes descriptors
-			if((((*l1)[i])->kP)->signLaplacian==(((*l2)[j])->kP)->signLaplacian)
+			d2=((d2>d)?d:d2);
+			if( d1>d)
 			{
-				d2=((d2>d)?d:d2);
-				if( d1>d)
-				{
-					position=j;
-					d2=d1;
-					d1=d;
-				}
+				position=j;
+				d2=d1;
+				d1=d;
 			}
 		}
 		// Try to match it
         if(position>=0  && surf_ratio*d2>d1)
 		{
             MatchSurf match;
-			match.x1=((*l1)[i]->kP)->x;
-            match.y1=((*l1)[i]->kP)->y;
-            match.scale1=((*l1)[i]->kP)->scale;
-            match.angle1=((*l1)[i]->kP)->orientation;
-			match.x2=((*l2)[position]->kP)->x;
-			match.y2=((*l2)[position]->kP)->y;
-            match.scale2=((*l2)[position]->kP)->scale;
-            match.angle2=((*l2)[position]->kP)->orientation;
+			match.x1=(*l1)[i].kP.x;
+            match.y1=(*l1)[i].kP.y;
+            match.scale1=(*l1)[i].kP.scale;
+            match.angle1=(*l1)[i].kP.orientation;
+			match.x2=(*l2)[position].kP.x;
+			match.y2=(*l2)[position].kP.y;
+            match.scale2=(*l2)[position].kP.scale;
+            match.angle2=(*l2)[position].kP.orientation;
 			matches.push_back(match);
 		}
 	}
@@ -58,16 +66,26 @@ std::vector<MatchSurf> matchDescriptor(listDescriptor * l1, listDescriptor * l2)
 
 
 // Square of euclidean distance between two descriptors
-float euclideanDistance(descriptor* a,descriptor* b)
+float euclideanDistance(const descriptor* a,const descriptor* b)
 {
+	const float* va=a->vec;
+	const float* vb=b->vec;
+	int i=0;
 	float sum=0;
-	for(int i=0;i<16;i++)
+#ifdef __SSE2__
+	__m128 acc0=_mm_setzero_ps(), acc1=_mm_setzero_ps();
+	for(;i+8<=DESCRIPTOR_LENGTH;i+=8)
 	{
-		sum+=((a->list)[i].sumDx-(b->list)[i].sumDx)*((a->list)[i].sumDx-(b->list)[i].sumDx)
-		+((a->list)[i].sumDy-(b->list)[i].sumDy)*((a->list)[i].sumDy-(b->list)[i].sumDy)
-		+((a->list)[i].sumAbsDy-(b->list)[i].sumAbsDy)*((a->list)[i].sumAbsDy-(b->list)[i].sumAbsDy)
-		+((a->list)[i].sumAbsDx-(b->list)[i].sumAbsDx)*((a->list)[i].sumAbsDx-(b->list)[i].sumAbsDx);
+		__m128 d0=_mm_sub_ps(_mm_loadu_ps(va+i),_mm_loadu_ps(vb+i));
+		__m128 d1=_mm_sub_ps(_mm_loadu_ps(va+i+4),_mm_loadu_ps(vb+i+4));
+		acc0=_mm_add_ps(acc0,_mm_mul_ps(d0,d0));
+		acc1=_mm_add_ps(acc1,_mm_mul_ps(d1,d1));
 	}
+	float lanes[4];
+	_mm_storeu_ps(lanes,_mm_add_ps(acc0,acc1));
+	sum=(lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+#endif
+	for(;i<DESCRIPTOR_LENGTH;i++)
+		sum+=(va[i]-vb[i])*(va[i]-vb[i]);
 	return sum;
 }
-
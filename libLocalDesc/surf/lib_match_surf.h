@@ -25,7 +25,7 @@ struct MatchSurf {
 std::vector<MatchSurf>  matchDescriptor(listDescriptor * l1, listDescriptor * l2);
 
 // Return the euclidean distance between 2 descriptors
-float euclideanDistance(descriptor *a,descriptor* b);
+float euclideanDistance(const descriptor *a,const descriptor* b);
 
 // Ratio between two matches
 //extern float surf_ratio;
@@ -64,13 +64,15 @@ std::pair<double,double> display_stats(const std::vector<Match>& match,
 /// \param[in] nbIter Maximal number of iterations for RANSAC algorithm.
 /// \param[out] F Fundamental matrix between left and right image.
 /// \param[out] vec_inliers Index of inliers in \a vec_matchings.
+/// \param[in] seed Seed of the random samples.
 /// \return The status of the estimation. If no meaningful (NFA<1) model is
 /// found, the \a F field is not filled and \a vec_inliers is empty.
 bool orsa_fundamental(const std::vector<Match>& vec_matchings,
                       int w1,int h1, int w2,int h2,
                       double precision, int nbIter,
                       matrix<double>& F,
-                      std::vector<int>& vec_inliers, double& nfa, bool verb)
+                      std::vector<int>& vec_inliers, double& nfa, bool verb,
+                      unsigned int seed)
 {
   const int n = static_cast<int>( vec_matchings.size() );
   if(n < 7)
@@ -89,6 +91,7 @@ bool orsa_fundamental(const std::vector<Match>& vec_matchings,
 
   FundamentalModel model(xA, w1, h1, xB, w2, h2);
   //model.setConvergenceCheck(true);
+  model.setSeed(seed);
 nfa = model.orsa(vec_inliers, nbIter, &precision, &F, verb);
   if(nfa>0.0)
     return false;
@@ -33,7 +33,8 @@ bool orsa_fundamental(const std::vector<Match>& vec_matchings,
                       int w1,int h1, int w2,int h2,
                       double precision, int nbIter,
                       libNumerics::matrix<double>& F,
-                      std::vector<int>& vec_inliers, double& nfa,bool verb);
+                      std::vector<int>& vec_inliers, double& nfa,bool verb,
+                      unsigned int seed=0);
 }
 
 #endif
@@ -74,7 +74,8 @@ static void display_stats(const std::vector<Match>& vec_matchings,
 
 /// ORSA homography estimation
 bool ORSA_homography(const std::vector<Match>& vec_matchings, int w1,int h1, int w2,int h2,
-          double precision, int nbIter, libNumerics::matrix<double>& H, std::vector<int>& vec_inliers,double& nfa, bool verb)
+          double precision, int nbIter, libNumerics::matrix<double>& H, std::vector<int>& vec_inliers,double& nfa, bool verb,
+          unsigned int seed)
 {
   const int n = static_cast<int>( vec_matchings.size() );
   if(n < 5)
@@ -95,6 +96,7 @@ bool ORSA_homography(const std::vector<Match>& vec_matchings, int w1,int h1, int
 
   orsa::HomographyModel model(xA, w1, h1, xB, w2, h2, true);
   //model.setConvergenceCheck(true);
+  model.setSeed(seed);
   nfa = model.orsa(vec_inliers, nbIter, &precision, &H, verb);
   if(nfa>0.0)
     return false;
@@ -30,7 +30,8 @@
 namespace orsa {
 /// ORSA homography estimation
 bool ORSA_homography(const std::vector<Match>& vec_matchings, int w1,int h1, int w2,int h2,
-          double precision, int nbIter, libNumerics::matrix<double>& H, std::vector<int>& vec_inliers, double& nfa,bool verb);
+          double precision, int nbIter, libNumerics::matrix<double>& H, std::vector<int>& vec_inliers, double& nfa,bool verb,
+          unsigned int seed=0);
 }
 
 #endif
@@ -36,7 +36,7 @@ namespace orsa {
 OrsaModel::OrsaModel(const Mat &x1, int w1, int h1,
                      const Mat &x2, int w2, int h2)
 : x1_(x1.nrow(), x1.ncol()), x2_(x2.nrow(), x2.ncol()),
-  N1_(3,3), N2_(3,3), bConvergence(false) {
+  N1_(3,3), N2_(3,3), bConvergence(false), seed_(0) {
   assert(2 == x1_.nrow());
   assert(x1_.nrow() == x2_.nrow());
   assert(x1_.ncol() == x2_.ncol());
@@ -119,11 +119,38 @@ double OrsaModel::denormalizeError(double squareError, int side) const {
   return sqrt(squareError)/(side==0? N1_(0,0): N2_(0,0));
 }
 
+/// Number of hypotheses evaluated in parallel before their results are merged.
+/// Results do not depend on the number of threads.
+static const int ORSA_BATCH = 64;
+
+/// Scrambles the bits of \a x (integer hash).
+static unsigned int hash32(unsigned int x)
+{
+  x ^= x >> 16; x *= 0x7feb352dU;
+  x ^= x >> 15; x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+/// Random stream of one hypothesis (xorshift32). It only depends on the seed
+/// and on the hypothesis number, not on the thread drawing from it.
+class SampleRng {
+ public:
+  SampleRng(unsigned int seed, unsigned int hypothesis)
+  : s_(hash32(seed*0x9e3779b9U ^ hash32(hypothesis+1))) { if(!s_) s_=1; }
+  unsigned int next() {
+    s_ ^= s_ << 13; s_ ^= s_ >> 17; s_ ^= s_ << 5;
+    return s_;
+  }
+ private:
+  unsigned int s_;
+};
+
 /// Get a (sorted) random sample of size X in [0:n-1]
-static void random_sample(std::vector<int> &k, int X, int n)
+static void random_sample(std::vector<int> &k, int X, int n, SampleRng& rng)
 {
   for(int i=0; i<X; i++) {
-    int r = (rand()>>3)%(n-i), j;
+    int r = (rng.next()>>3)%(n-i), j;
     for(j=0; j<i && r>=k[j]; j++)
       r++;
     int j0 = j;
@@ -137,15 +164,33 @@ static void random_sample(std::vector<int> &k, int X, int n)
 /// \param sizeSample The size of the sample.
 /// \param vec_index  The possible data indices.
 /// \param sample The random sample of sizeSample indices (output).
+/// \param rng The random stream of the hypothesis.
 static void UniformSample(int sizeSample,
                           const std::vector<int> &vec_index,
-                          std::vector<int> *sample) {
+                          std::vector<int> *sample,
+                          SampleRng& rng) {
   sample->resize(sizeSample);
-  random_sample(*sample, sizeSample, static_cast<int>(vec_index.size()));
+  random_sample(*sample, sizeSample, static_cast<int>(vec_index.size()), rng);
   for(int i = 0; i < sizeSample; ++i)
     (*sample)[i] = vec_index[ (*sample)[i] ];
 }
 
+/// Model of a hypothesis that may improve on the best one so far.
+struct Candidate {
+  Candidate(): nfa(0), side(0), errorMax(0), model(3,3) {}
+  double nfa;
+  int side;
+  double errorMax;
+  std::vector<int> inliers;
+  OrsaModel::Model model;
+};
+
+/// Sample of a hypothesis and its candidate models.
+struct Hypothesis {
+  std::vector<int> sample;
+  std::vector<Candidate> candidates;
+};
+
 /// Generic implementation of 'ORSA':
 /// A Probabilistic Criterion to Detect Rigid Point Matches
 ///    Between Two Images and Estimate the Fundamental Matrix.
@@ -192,9 +237,6 @@ double OrsaModel::orsa(std::vector<int> & vec_inliers,
         if (*precision!=0)
             std::cout<<"Imposed precision <= "<<*precision<<std::endl;//<<"  (i.e. MaxThreshold <= "<< maxThreshold<<" )"<<std::endl;
 
-  std::vector<ErrorIndex> vec_residuals(nData); // [residual,index]
-  std::vector<int> vec_sample(sizeSample); // Sample indices
-
   // Possible sampling indices (could change in the optimization phase)
   std::vector<int> vec_index(nData);
   for (int i = 0; i < nData; ++i)
@@ -215,68 +257,113 @@ double OrsaModel::orsa(std::vector<int> & vec_inliers,
   double errorMax = 0;
   int side=0;
 
-  // Main estimation loop.
-  for (size_t iter=0; iter < nIter; iter++) {
-    UniformSample(sizeSample, vec_index, &vec_sample); // Get random sample
-
-    std::vector<Model> vec_models; // Up to max_models solutions
-    Fit(vec_sample, &vec_models);
-
-    // Evaluate models
-    bool better=false;
-    for (size_t k = 0; k < vec_models.size(); ++k)
+  // Main estimation loop. Hypotheses are evaluated in parallel by batches of
+  // ORSA_BATCH, all of them sampling among the indices set before the batch.
+  // Their results are then merged in order, as a sequential loop would do.
+  // When a merged hypothesis changes the sampling indices, the rest of the
+  // batch is discarded and the next batch starts right after it. As random
+  // streams are keyed by hypothesis, the result is that of the sequential loop.
+  std::vector<Hypothesis> batch(ORSA_BATCH);
+  size_t iter=0;
+  while (iter < nIter) {
+    const int nBatch = static_cast<int>( std::min(nIter-iter, (size_t)ORSA_BATCH) );
+    const double bound = minNFA; // a candidate must beat it
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
     {
-      // Residuals computation and ordering
-      for (int i = 0; i < nData; ++i)
-      {
-        int s;
-        double error = Error(vec_models[k], i, &s);
-        vec_residuals[i] = ErrorIndex(error, i, s);
-      }
-      std::sort(vec_residuals.begin(), vec_residuals.end());
-
-      // Most meaningful discrimination inliers/outliers
-      ErrorIndex best = bestNFA(vec_residuals, loge0, maxThreshold,
-                                vec_logc_n, vec_logc_k);
-      if(best.error < minNFA) // A better model was found
-      {
-        better = true;
-        minNFA = best.error;
-        side = best.side;
-        vec_inliers.resize(best.index);
-        for (int i=0; i<best.index; ++i)
-          vec_inliers[i] = vec_residuals[i].index;
-        errorMax = vec_residuals[best.index-1].error; // Error threshold
-        if(best.error<0 && model) *model = vec_models[k];
-        if(bVerbose)
+      std::vector<ErrorIndex> vec_residuals(nData); // [residual,index]
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int b=0; b < nBatch; b++) {
+        Hypothesis& h = batch[b];
+        h.candidates.clear();
+        SampleRng rng(seed_, static_cast<unsigned int>(iter+b));
+        UniformSample(sizeSample, vec_index, &h.sample, rng); // Get random sample
+
+        std::vector<Model> vec_models; // Up to max_models solutions
+        Fit(h.sample, &vec_models);
+
+        // Evaluate models
+        for (size_t k = 0; k < vec_models.size(); ++k)
         {
-          std::cout << "  nfa=" << minNFA
-                    << " inliers=" << vec_inliers.size()
-                    << " precision=" << denormalizeError(errorMax, side)
-                   // << " im" << side+1
-                    << " (iter=" << iter;
-          if(best.error<0) {
-            std::cout << ",sample=" << vec_sample.front();
-            std::vector<int>::const_iterator it=vec_sample.begin();
-            for(++it; it != vec_sample.end(); ++it)
-              std::cout << ',' << *it;
+          // Residuals computation and ordering
+          for (int i = 0; i < nData; ++i)
+          {
+            int s;
+            double error = Error(vec_models[k], i, &s);
+            vec_residuals[i] = ErrorIndex(error, i, s);
+          }
+          std::sort(vec_residuals.begin(), vec_residuals.end());
+
+          // Most meaningful discrimination inliers/outliers
+          ErrorIndex best = bestNFA(vec_residuals, loge0, maxThreshold,
+                                    vec_logc_n, vec_logc_k);
+          if(best.error < bound)
+          {
+            h.candidates.push_back(Candidate());
+            Candidate& c = h.candidates.back();
+            c.nfa = best.error;
+            c.side = best.side;
+            c.inliers.resize(best.index);
+            for (int i=0; i<best.index; ++i)
+              c.inliers[i] = vec_residuals[i].index;
+            c.errorMax = vec_residuals[best.index-1].error; // Error threshold
+            c.model = vec_models[k];
           }
-          std::cout << ")" <<std::endl;
         }
       }
     }
-    // ORSA optimization: draw samples among best set of inliers so far
-    if((better && minNFA<0) || (iter+1==nIter && nIterReserve)) {
-        if(vec_inliers.empty()) { // No model found at all so far
-            nIter++; // Continue to look for any model, even not meaningful
-            nIterReserve--;
-        } else {
-            vec_index = vec_inliers;
-            if(nIterReserve) {
-                nIter = iter+1+nIterReserve;
-                nIterReserve=0;
+
+    for (int b=0; b < nBatch && iter < nIter; b++) {
+      const Hypothesis& h = batch[b];
+      bool better=false, resampled=false;
+      for (size_t k = 0; k < h.candidates.size(); ++k)
+      {
+        const Candidate& c = h.candidates[k];
+        if(c.nfa < minNFA) // A better model was found
+        {
+          better = true;
+          minNFA = c.nfa;
+          side = c.side;
+          vec_inliers = c.inliers;
+          errorMax = c.errorMax;
+          if(c.nfa<0 && model) *model = c.model;
+          if(bVerbose)
+          {
+            std::cout << "  nfa=" << minNFA
+                      << " inliers=" << vec_inliers.size()
+                      << " precision=" << denormalizeError(errorMax, side)
+                     // << " im" << side+1
+                      << " (iter=" << iter;
+            if(c.nfa<0) {
+              std::cout << ",sample=" << h.sample.front();
+              std::vector<int>::const_iterator it=h.sample.begin();
+              for(++it; it != h.sample.end(); ++it)
+                std::cout << ',' << *it;
             }
+            std::cout << ")" <<std::endl;
+          }
         }
+      }
+      // ORSA optimization: draw samples among best set of inliers so far
+      if((better && minNFA<0) || (iter+1==nIter && nIterReserve)) {
+          if(vec_inliers.empty()) { // No model found at all so far
+              nIter++; // Continue to look for any model, even not meaningful
+              nIterReserve--;
+          } else {
+              vec_index = vec_inliers;
+              resampled = true;
+              if(nIterReserve) {
+                  nIter = iter+1+nIterReserve;
+                  nIterReserve=0;
+              }
+          }
+      }
+      ++iter;
+      if(resampled) // next hypotheses were drawn from the former indices
+        break;
     }
   }
 
@@ -375,4 +462,10 @@ bool OrsaModel::getRefineUntilConvergence() const
   return bConvergence;
 }
 
+/// Seed of the random samples.
+void OrsaModel::setSeed(unsigned int seed)
+{
+  seed_ = seed;
+}
+
 } // namespace orsa
@@ -103,6 +103,10 @@ class OrsaModel {
   /// Return if convergence check is on or off.
   bool getRefineUntilConvergence() const;
 
+  /// Seed of the random samples. For a given seed, results do not depend on
+  /// the number of threads.
+  void setSeed(unsigned int seed);
+
 protected:
   Mat x1_; ///< Points in image 1
   Mat x2_; ///< Points in image 2
@@ -110,6 +114,7 @@ protected:
   Mat N2_; ///< Normalization for x2_ 
   double logalpha0_[2]; ///< Log probability of error<=1, set by subclass
   bool bConvergence;
+  unsigned int seed_; ///< Seed of the random samples
 
 private:
   /// Distance and associated index
@@ -360,12 +360,19 @@ void horizontal_convolution(float *u, float *v, int width, int height, float *ke
 
 
 void vertical_convolution(float *u, float *v, int width, int height, float *kernel,int ksize, int boundary)
+{
+    vertical_convolution(u, v, width, height, kernel, ksize, boundary, 0, width);
+}
+
+
+
+void vertical_convolution(float *u, float *v, int width, int height, float *kernel,int ksize, int boundary, int c0, int c1)
 {
     int halfsize = ksize / 2;
     int buffersize = height + ksize;
     float *buffer = new float[buffersize];
 
-    for (int c = 0; c < width; c++) {
+    for (int c = c0; c < c1; c++) {
 
 	if (boundary == 1)
 		for (int i = 0; i < halfsize; i++)
@@ -22,6 +22,8 @@ void separable_convolution(float *u, float *v, int width, int height, float *xke
 void buffer_convolution(float *buffer,float *kernel,int size,int ksize);
 void horizontal_convolution(float *u, float *v, int width, int height, float *kernel, int ksize, int boundary);
 void vertical_convolution(float *u, float *v, int width, int height, float *kernel,int ksize, int boundary);
+/// Only columns c0 <= c < c1 are convolved, so that disjoint column bands can be processed concurrently
+void vertical_convolution(float *u, float *v, int width, int height, float *kernel,int ksize, int boundary, int c0, int c1);
 
 void fast_separable_convolution(float *u, float *v, int width, int height,float * xkernel, int xsize,float *ykernel,int ysize,int boundary);
 
@@ -3,28 +3,129 @@
 // adequate credits and/or get the adequate authorizations.
 
 #include "flimage.h"
+#include <algorithm>
+#include <string.h>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+
+//////////////////////////////////////////////// Class flimage_pool
+
+static flimage_pool* thread_pool = 0;
+#ifdef _OPENMP
+#pragma omp threadprivate(thread_pool)
+#endif
+
+/// 2^25 floats (128 MB) per thread: the scale space of one simulated view of a
+/// few megapixels image.
+long long flimage_pool::max_cached = 1LL << 25;
+
+flimage_pool::flimage_pool() : cached(0)
+{
+}
+
+flimage_pool::~flimage_pool()
+{
+	for (int i = 0; i < (int) buffers.size(); i++) delete[] buffers[i];
+}
+
+flimage_pool& flimage_pool::local()
+{
+	if (!thread_pool) thread_pool = new flimage_pool();
+	return *thread_pool;
+}
+
+void flimage_pool::trim()
+{
+	delete thread_pool;
+	thread_pool = 0;
+}
+
+/// Threads of later parallel regions of the same size are the same, as are
+/// their pools. Images borrowed by a thread may be released by another one,
+/// so pools of all threads are trimmed.
+void flimage_pool::trim_all()
+{
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	trim();
+}
+
+/// Best fitting free buffer. If none is large enough, the largest free buffer
+/// is replaced by a new one of the requested size.
+float* flimage_pool::acquire(int size, int& capacity)
+{
+	int best = -1, largest = -1;
+	for (int i = 0; i < (int) buffers.size(); i++)
+	{
+		if (capacities[i] >= size && (best < 0 || capacities[i] < capacities[best])) best = i;
+		if (largest < 0 || capacities[i] > capacities[largest]) largest = i;
+	}
+
+	float* p;
+	if (best >= 0)
+	{
+		p = buffers[best];
+		capacity = capacities[best];
+		cached -= capacity;
+		buffers.erase(buffers.begin() + best);
+		capacities.erase(capacities.begin() + best);
+		return p;
+	}
+
+	if (largest >= 0)
+	{
+		delete[] buffers[largest];
+		cached -= capacities[largest];
+		buffers.erase(buffers.begin() + largest);
+		capacities.erase(capacities.begin() + largest);
+	}
+	capacity = size;
+	return new float[size];
+}
+
+void flimage_pool::release(float* p, int capacity)
+{
+	buffers.push_back(p);
+	capacities.push_back(capacity);
+	cached += capacity;
+
+	while (cached > max_cached)
+	{
+		int smallest = 0;
+		for (int i = 1; i < (int) buffers.size(); i++)
+			if (capacities[i] < capacities[smallest]) smallest = i;
+		delete[] buffers[smallest];
+		cached -= capacities[smallest];
+		buffers.erase(buffers.begin() + smallest);
+		capacities.erase(capacities.begin() + smallest);
+	}
+}
 
 
 
 //////////////////////////////////////////////// Class flimage
 //// Construction
-flimage::flimage() : width(0), height(0), p(0) 
+flimage::flimage() : width(0), height(0), p(0), capacity(0) 
 {
 }	 
 
-flimage::flimage(int w, int h) : width(w), height(h), p(new float[w*h]) 
+flimage::flimage(int w, int h) : width(w), height(h), p(new float[w*h]), capacity(0) 
 {
 	for (int j=width*height-1; j>=0 ; j--) p[j] = 0.0;
 }	
 
 
-flimage::flimage(int w, int h, float v) : width(w), height(h), p(new float[w*h]) 
+flimage::flimage(int w, int h, float v) : width(w), height(h), p(new float[w*h]), capacity(0) 
 {
 	for (int j=width*height-1; j>=0 ; j--) p[j] = v;
 }
 
 
-flimage::flimage(int w, int h, float* v) : width(w), height(h), p(new float[w*h]) 
+flimage::flimage(int w, int h, float* v) : width(w), height(h), p(new float[w*h]), capacity(0) 
 {
 	for (int j=width*height-1; j>=0 ; j--) p[j] = v[j];
 }
@@ -46,7 +147,7 @@ void flimage::create(int w, int h, float* v)
 }
 
 
-flimage::flimage(const flimage& im) : width(im.width), height(im.height), p(new float[im.width*im.height]) 
+flimage::flimage(const flimage& im) : width(im.width), height(im.height), p(new float[im.width*im.height]), capacity(0) 
 {
 	for (int j=width*height-1; j>=0 ; j--) p[j] = im.p[j];
 }
@@ -59,8 +160,12 @@ flimage&  flimage::operator= (const flimage& im)
 	
 	if (width != im.width || height != im.height)
 	{  			
-	  	erase();
-		width = im.width; height=im.height; p = new float[width*height];
+		if (capacity) borrow(im.width, im.height);
+		else
+		{
+		  	erase();
+			width = im.width; height=im.height; p = new float[width*height];
+		}
 	}
 	
 	for (int j=width*height-1; j>=0 ; j--) p[j] = im.p[j];
@@ -68,12 +173,33 @@ flimage&  flimage::operator= (const flimage& im)
 }
 
 
+void flimage::borrow(int w, int h)
+{
+	erase();
+	width = w; height = h;
+	p = flimage_pool::local().acquire(w*h, capacity);
+}
+
+void flimage::swap(flimage& im)
+{
+	std::swap(width, im.width);
+	std::swap(height, im.height);
+	std::swap(p, im.p);
+	std::swap(capacity, im.capacity);
+}
+
+
 //// Destruction
 void flimage::erase() 
 {
 	width = height = 0; 
-	if (p) delete[] p; 
+	if (p)
+	{
+		if (capacity) flimage_pool::local().release(p, capacity);
+		else delete[] p;
+	}
 	p=0;
+	capacity=0;
 } 
 
 flimage::~flimage()
@@ -84,3 +210,84 @@ flimage::~flimage()
 
 
 
+
+
+
+//////////////////////////////////////////////// Half precision
+
+unsigned short float_to_half(float f)
+{
+	unsigned int x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned short sign = (unsigned short) ((x >> 16) & 0x8000);
+	x &= 0x7fffffff;
+
+	if (x >= 0x477ff000)		// rounds to 65536 or more: inf (and nan)
+		return sign | ((x > 0x7f800000) ? 0x7e00 : 0x7c00);
+
+	if (x < 0x38800000)		// below 2^-14: subnormal or zero
+	{
+		if (x < 0x33000000) return sign;	// below 2^-25
+		unsigned int e = x >> 23, m = (x & 0x7fffff) | 0x800000, shift = 126 - e;
+		return sign | (unsigned short) ((m + (1u << (shift - 1)) - 1 + ((m >> shift) & 1)) >> shift);
+	}
+
+	x -= 0x38000000;		// rebias the exponent from 127 to 15
+	return sign | (unsigned short) ((x + 0x0fff + ((x >> 13) & 1)) >> 13);
+}
+
+void floats_to_halfs(const float* in, unsigned short* out, int n)
+{
+	int i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= n; i += 8)
+		_mm_storeu_si128((__m128i*) (out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+	for (; i < n; i++) out[i] = float_to_half(in[i]);
+}
+
+void halfs_to_floats(const unsigned short* in, float* out, int n)
+{
+	int i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (in + i))));
+#endif
+	for (; i < n; i++) out[i] = half_to_float(in[i]);
+}
+
+
+
+//////////////////////////////////////////////// Class hfimage
+
+hfimage::hfimage() : width(0), height(0), p(0), capacity(0)
+{
+}
+
+hfimage::~hfimage()
+{
+	erase();
+}
+
+void hfimage::borrow(int w, int h)
+{
+	erase();
+	width = w; height = h;
+	p = (unsigned short*) flimage_pool::local().acquire((w*h + 1) / 2, capacity);
+}
+
+void hfimage::swap(hfimage& im)
+{
+	std::swap(width, im.width);
+	std::swap(height, im.height);
+	std::swap(p, im.p);
+	std::swap(capacity, im.capacity);
+}
+
+void hfimage::erase()
+{
+	width = height = 0;
+	if (p) flimage_pool::local().release((float*) p, capacity);
+	p = 0;
+	capacity = 0;
+}
@@ -8,6 +8,38 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+
+
+/* Pool of image buffers owned by the calling thread.
+   Buffers given back by pooled images are handed out again to later images
+   of at most the same size, so that repeated image processing (e.g. SIFT on
+   every simulated view) stops allocating once the largest size has been seen.
+   Free buffers of a thread hold at most max_cached floats, the smallest ones
+   being freed first, and trim() frees them all. */
+class flimage_pool {
+
+private:
+
+	std::vector<float*> buffers;	// free buffers
+	std::vector<int> capacities;	// and their sizes
+	long long cached;		// sum of capacities
+
+	flimage_pool();
+	~flimage_pool();
+
+public:
+
+	static long long max_cached;	// bound of the free buffers of each thread, in floats
+
+	static flimage_pool& local();	// pool of the calling thread
+	static void trim();		// frees the pool of the calling thread
+	static void trim_all();		// frees the pools of the threads of a parallel region
+
+	float* acquire(int size, int& capacity);
+	void release(float* p, int capacity);
+};
+
 
 class flimage {
 	
@@ -15,6 +47,7 @@ private:
 	
 	int	width, height;	// image size
 	float*	p;		// array of color levels: level of pixel (x,y) is p[y*width+x]
+	int	capacity;	// size of p when it comes from flimage_pool, 0 otherwise
 	
 public:
 	
@@ -31,6 +64,11 @@ public:
 	void create(int w, int h);
 	void create(int w, int h, float *v);
 	
+	/// Takes an uninitialised w x h buffer from the pool of the calling thread.
+	/// It goes back to the pool on erase(). Assignments keep the image pooled.
+	void borrow(int w, int h);
+	void swap(flimage& im);
+	
 	//// Destruction
 	void erase();
 	~flimage();
@@ -49,5 +87,64 @@ public:
 };
 
 
+/* IEEE 754 half precision (binary16) <-> float, rounding to nearest even. */
+inline float half_to_float(unsigned short h)
+{
+	unsigned int sign = (unsigned int) (h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+	union { unsigned int u; float f; } v;
+	if (exp == 0)			// zero or subnormal
+	{
+		v.f = (float) mant * (1.0f / 16777216.0f);
+		v.u |= sign;
+	}
+	else if (exp == 31) v.u = sign | 0x7f800000 | (mant << 13);	// inf or nan
+	else v.u = sign | ((exp + 112) << 23) | (mant << 13);
+	return v.f;
+}
+
+unsigned short float_to_half(float f);
+
+void floats_to_halfs(const float* in, unsigned short* out, int n);
+void halfs_to_floats(const unsigned short* in, float* out, int n);
+
+
+/* Image whose values are stored with 16 bits (half precision) and read as floats.
+   It halves the memory (and memory traffic) of images that are only kept to be
+   read later, e.g. the scale space of SIFT. Buffers come from flimage_pool. */
+class hfimage {
+
+private:
+
+	int	width, height;
+	unsigned short*	p;	// level of pixel (x,y) is half_to_float(p[y*width+x])
+	int	capacity;	// in floats, as given by flimage_pool
+
+	hfimage(const hfimage& im);
+	hfimage& operator= (const hfimage& im);
+
+public:
+
+	hfimage();
+	~hfimage();
+
+	/// Takes an uninitialised w x h buffer from the pool of the calling thread.
+	void borrow(int w, int h);
+	void swap(hfimage& im);
+	void erase();
+
+	int nwidth() const {return width;}
+	int nheight() const {return height;}
+
+	unsigned short* getPlane() {return p;}
+
+	float operator()(int x, int y) const {return half_to_float(p[ y*width + x ]);}
+
+	/// Rounds the n floats of v into the values starting at pixel offset
+	void put(const float* v, int offset, int n) {floats_to_halfs(v, p + offset, n);}
+	/// Reads n values starting at pixel offset into v
+	void get(float* v, int offset, int n) const {halfs_to_floats(p + offset, v, n);}
+};
+
+
 #endif
 
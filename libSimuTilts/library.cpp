@@ -5,6 +5,14 @@
 
 #include "library.h"
 
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 
 void wxwarning(const char * message, const char *function,const char *file)
@@ -53,6 +61,107 @@ float slut(float dif,float *lut)
 
 
 
+/* Orders indices by decreasing response, ties by index */
+struct decreasing_response
+{
+    const float *response;
+    decreasing_response(const float *r): response(r) {}
+    bool operator()(int i, int j) const
+    { return response[i] > response[j] || (response[i] == response[j] && i < j); }
+};
+
+
+void select_strongest(const float *response, int size, int n, int *selected)
+{
+    n = MIN(n, size);
+    std::vector<int> order(size);
+    for (int i = 0; i < size; i++) order[i] = i;
+    std::partial_sort(order.begin(), order.begin() + n, order.end(), decreasing_response(response));
+    std::sort(order.begin(), order.begin() + n);
+    for (int i = 0; i < n; i++) selected[i] = order[i];
+}
+
+
+/* Brown, Szeliski and Winder (2005). The suppression radius of a point is its distance
+   to the closest point whose response is clearly larger (by a factor 1/0.9); the n points
+   with the largest radii are kept, which spreads them evenly over the image.
+   Points are visited by decreasing response, so the clearly stronger points of each one
+   are a prefix of that order. They are put in a grid of about one point per cell, and
+   the closest one is searched ring by ring around the cell of the point, stopping as soon
+   as no further ring can hold a closer one. */
+void select_anms(const float *x, const float *y, const float *response, int size, int n, int *selected)
+{
+    const float robust = 0.9f;
+    n = MIN(n, size);
+    if (n <= 0) return;
+
+    std::vector<int> order(size);
+    for (int i = 0; i < size; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), decreasing_response(response));
+
+    float x0 = x[0], x1 = x[0], y0 = y[0], y1 = y[0];
+    for (int i = 1; i < size; i++)
+    {
+        x0 = MIN(x0, x[i]); x1 = MAX(x1, x[i]);
+        y0 = MIN(y0, y[i]); y1 = MAX(y1, y[i]);
+    }
+    float cell = MAX(1.0f, sqrtf(MAX(1.0f, (x1 - x0) * (y1 - y0)) / (float) size));
+    int gw = (int) ((x1 - x0) / cell) + 1, gh = (int) ((y1 - y0) / cell) + 1;
+
+    /* points of each cell as linked lists */
+    std::vector<int> head(gw * gh, -1), next(size, -1), cx(size), cy(size);
+    for (int i = 0; i < size; i++)
+    {
+        cx[i] = MIN(gw - 1, (int) ((x[i] - x0) / cell));
+        cy[i] = MIN(gh - 1, (int) ((y[i] - y0) / cell));
+    }
+
+    /* squared radii, in decreasing response order */
+    std::vector<float> radius2(size);
+    int inserted = 0;
+    for (int a = 0; a < size; a++)
+    {
+        int i = order[a];
+        for (; inserted < a && robust * response[order[inserted]] > response[i]; inserted++)
+        {
+            int j = order[inserted], c = cy[j] * gw + cx[j];
+            next[j] = head[c];
+            head[c] = j;
+        }
+
+        float r2 = FLT_MAX;
+        for (int k = 0; inserted > 0 && k < MAX(gw, gh); k++)
+        {
+            /* points of ring k are at least k-1 cells away */
+            float dmin = (float) (k - 1) * cell;
+            if (k > 1 && dmin * dmin >= r2) break;
+            for (int gy = MAX(0, cy[i] - k); gy <= MIN(gh - 1, cy[i] + k); gy++)
+            {
+                int border = (gy == cy[i] - k || gy == cy[i] + k);
+                int step = (border || k == 0) ? 1 : 2 * k;
+                for (int gx = cx[i] - k; gx <= cx[i] + k; gx += step)
+                {
+                    if (gx < 0 || gx >= gw) continue;
+                    for (int j = head[gy * gw + gx]; j >= 0; j = next[j])
+                    {
+                        float dx = x[i] - x[j], dy = y[i] - y[j];
+                        r2 = MIN(r2, dx*dx + dy*dy);
+                    }
+                }
+            }
+        }
+        radius2[a] = r2;
+    }
+
+    /* the n largest radii, ties by response */
+    std::vector<int> rank(size);
+    for (int a = 0; a < size; a++) rank[a] = a;
+    std::partial_sort(rank.begin(), rank.begin() + n, rank.end(), decreasing_response(&radius2[0]));
+    for (int a = 0; a < n; a++) selected[a] = order[rank[a]];
+    std::sort(selected, selected + n);
+}
+
+
 float max(float *u,int *pos, int size)
 {  
 	float max=u[0];
@@ -383,36 +492,139 @@ float * histo(float* input, float *iminim, float *imaxim, int *n, float *s, int
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////   Used and checked image functions
 
-void compute_gradient_orientation(float* igray,float *grad, float *ori, int width, int height)
+/* Coefficients of atan(z) ~ z*P(z^2) on [0,1], |error| ~ 1.2e-5 rad
+   (Abramowitz & Stegun 4.4.49) */
+#define ATAN_C1  0.9998660f
+#define ATAN_C3 -0.3302995f
+#define ATAN_C5  0.1801410f
+#define ATAN_C7 -0.0851330f
+#define ATAN_C9  0.0208351f
+
+float fast_atan2(float y, float x)
 {
+    float ax = fabsf(x), ay = fabsf(y);
+    float mn = MIN(ax,ay), mx = MAX(ax,ay);
+    float z = mn / (mx + 1e-30f), z2 = z*z;
+    float a = z*(ATAN_C1 + z2*(ATAN_C3 + z2*(ATAN_C5 + z2*(ATAN_C7 + z2*ATAN_C9))));
+    if (ay > ax) a = (float)(0.5*PI) - a;
+    if (x < 0.0f) a = (float)PI - a;
+    if (y < 0.0f) a = -a;
+    return a;
+}
+
 
+/* Orientation bin as computed by the SIFT orientation histogram, with scale = nbins / (2*PI) */
+static inline unsigned char orientation_bin(float angle, float scale, int nbins)
+{
+    int bin = (int) ((angle + (float) (PI + 0.001)) * scale);
+    return (unsigned char) MIN(MAX(bin,0), nbins - 1);
+}
+
+
+/* Gradient at (r,c) with the one-sided differences used on the image border */
+static void border_gradient_orientation(float* igray,float *grad, float *ori, int cols, int rows, int r, int c, unsigned char *oribin, int nbins)
+{
     float xgrad, ygrad;
-    int rows, cols, r, c;
+    if (c == 0)
+      xgrad = 2.0 * (igray[r*cols+c+1] - igray[r*cols+c]);
+    else if (c == cols-1)
+      xgrad = 2.0 * (igray[r*cols+c] - igray[r*cols+c-1]);
+    else
+      xgrad = igray[r*cols+c+1] - igray[r*cols+c-1];
+    if (r == 0)
+      ygrad = 2.0 * (igray[r*cols+c] - igray[(r+1)*cols+c]);
+    else if (r == rows-1)
+      ygrad = 2.0 * (igray[(r-1)*cols+c] - igray[r*cols+c]);
+    else
+      ygrad = igray[(r-1)*cols+c] - igray[(r+1)*cols+c];
+
+    if (grad) grad[r*cols+c] = sqrtf(xgrad * xgrad + ygrad * ygrad);
+    float angle = fast_atan2(-ygrad, xgrad);
+    if (ori) ori[r*cols+c] = angle;
+    if (oribin) oribin[r*cols+c] = orientation_bin(angle, (float) (nbins / (2.0 * PI)), nbins);
+}
 
-    rows = height;
-    cols = width;
-    
 
-    for (r = 0; r < rows; r++)
-      for (c = 0; c < cols; c++) {
-        if (c == 0)
-          xgrad = 2.0 * (igray[r*cols+c+1] - igray[r*cols+c]);
-        else if (c == cols-1)
-          xgrad = 2.0 * (igray[r*cols+c] - igray[r*cols+c-1]);
-        else
-          xgrad = igray[r*cols+c+1] - igray[r*cols+c-1];
-        if (r == 0)
-          ygrad = 2.0 * (igray[r*cols+c] - igray[(r+1)*cols+c]);
-        else if (r == rows-1)
-          ygrad = 2.0 * (igray[(r-1)*cols+c] - igray[r*cols+c]);
-        else
-          ygrad = igray[(r-1)*cols+c] - igray[(r+1)*cols+c];
-        
-
-        if (grad) grad[r*cols+c] = (float)sqrt((double)(xgrad * xgrad + ygrad * ygrad));
-        if (ori) ori[r*cols+c] = (float)atan2 (-(double)ygrad,(double)xgrad);
-      
-      }
+#ifdef __SSE2__
+/* fast_atan2 on 4 floats */
+static inline __m128 fast_atan2_ps(__m128 y, __m128 x)
+{
+    const __m128 signmask = _mm_set1_ps(-0.0f);
+    __m128 ax = _mm_andnot_ps(signmask, x), ay = _mm_andnot_ps(signmask, y);
+    __m128 mn = _mm_min_ps(ax, ay), mx = _mm_max_ps(ax, ay);
+    __m128 z = _mm_div_ps(mn, _mm_add_ps(mx, _mm_set1_ps(1e-30f)));
+    __m128 z2 = _mm_mul_ps(z, z);
+    __m128 a = _mm_add_ps(_mm_set1_ps(ATAN_C7), _mm_mul_ps(z2, _mm_set1_ps(ATAN_C9)));
+    a = _mm_add_ps(_mm_set1_ps(ATAN_C5), _mm_mul_ps(z2, a));
+    a = _mm_add_ps(_mm_set1_ps(ATAN_C3), _mm_mul_ps(z2, a));
+    a = _mm_add_ps(_mm_set1_ps(ATAN_C1), _mm_mul_ps(z2, a));
+    a = _mm_mul_ps(z, a);
+
+    /* a = pi/2 - a where |y| > |x| */
+    __m128 m = _mm_cmpgt_ps(ay, ax);
+    a = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps((float)(0.5*PI)), a)), _mm_andnot_ps(m, a));
+    /* a = pi - a where x < 0 */
+    m = _mm_cmplt_ps(x, _mm_setzero_ps());
+    a = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps((float)PI), a)), _mm_andnot_ps(m, a));
+    /* a = -a where y < 0 */
+    m = _mm_cmplt_ps(y, _mm_setzero_ps());
+    return _mm_xor_ps(a, _mm_and_ps(m, signmask));
+}
+#endif
+
+
+void compute_gradient_orientation(float* igray,float *grad, float *ori, int width, int height, int x0, int y0, int x1, int y1, unsigned char *oribin, int nbins)
+{
+    int rows = height, cols = width;
+
+    /* Borders: one-sided differences */
+    for (int c = x0; c < x1; c++) {
+        if (y0 == 0) border_gradient_orientation(igray, grad, ori, cols, rows, 0, c, oribin, nbins);
+        if (y1 == rows && rows > 1) border_gradient_orientation(igray, grad, ori, cols, rows, rows-1, c, oribin, nbins);
+    }
+    for (int r = MAX(y0,1); r < MIN(y1,rows-1); r++) {
+        if (x0 == 0) border_gradient_orientation(igray, grad, ori, cols, rows, r, 0, oribin, nbins);
+        if (x1 == cols && cols > 1) border_gradient_orientation(igray, grad, ori, cols, rows, r, cols-1, oribin, nbins);
+    }
+
+    /* Interior: central differences, no branches */
+    float scale = (float) (nbins / (2.0 * PI));
+    int cmin = MAX(x0,1), cmax = MIN(x1,cols-1);
+    for (int r = MAX(y0,1); r < MIN(y1,rows-1); r++) {
+        const float *up = igray + (r-1)*cols, *mid = igray + r*cols, *down = igray + (r+1)*cols;
+        float *g = grad ? grad + r*cols : 0, *o = ori ? ori + r*cols : 0;
+        unsigned char *b = oribin ? oribin + r*cols : 0;
+        int c = cmin;
+#ifdef __SSE2__
+        const __m128 offset = _mm_set1_ps((float) (PI + 0.001)), vscale = _mm_set1_ps(scale);
+        const __m128i lastbin = _mm_set1_epi16((short) (nbins - 1));
+        for (; c + 4 <= cmax; c += 4) {
+            __m128 xgrad = _mm_sub_ps(_mm_loadu_ps(mid + c + 1), _mm_loadu_ps(mid + c - 1));
+            __m128 ygrad = _mm_sub_ps(_mm_loadu_ps(up + c), _mm_loadu_ps(down + c));
+            if (g) _mm_storeu_ps(g + c, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(xgrad, xgrad), _mm_mul_ps(ygrad, ygrad))));
+            if (!o && !b) continue;
+            __m128 angle = fast_atan2_ps(_mm_sub_ps(_mm_setzero_ps(), ygrad), xgrad);
+            if (o) _mm_storeu_ps(o + c, angle);
+            if (b) {
+                /* as orientation_bin, clamped in 16 bits and packed into 4 bytes */
+                __m128i bin = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(angle, offset), vscale));
+                bin = _mm_packs_epi32(bin, bin);
+                bin = _mm_max_epi16(_mm_min_epi16(bin, lastbin), _mm_setzero_si128());
+                int packed = _mm_cvtsi128_si32(_mm_packus_epi16(bin, bin));
+                memcpy(b + c, &packed, 4);
+            }
+        }
+#endif
+        for (; c < cmax; c++) {
+            float xgrad = mid[c+1] - mid[c-1];
+            float ygrad = up[c] - down[c];
+            if (g) g[c] = sqrtf(xgrad * xgrad + ygrad * ygrad);
+            if (!o && !b) continue;
+            float angle = fast_atan2(-ygrad, xgrad);
+            if (o) o[c] = angle;
+            if (b) b[c] = orientation_bin(angle, scale, nbins);
+        }
+    }
 }
 
 
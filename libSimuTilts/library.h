@@ -52,6 +52,10 @@ double fsqr(double a);
 void  fill_exp_lut(float *lut,int size); /* Fills exp(x) for x great or equal than zero*/
 float slut(float dif,float *lut); /* We look for f(dif) in the lut*/
 
+/* Keypoint selection. Both fill selected with the indices of n out of size points, in increasing order. */
+void select_strongest(const float *response, int size, int n, int *selected); /* The n largest responses */
+void select_anms(const float *x, const float *y, const float *response, int size, int n, int *selected); /* Adaptive non-maximal suppression */
+
 
 
 
@@ -106,7 +110,15 @@ float * histo ( float* input, float *iminim, float *imaxim, int *n, float *s, in
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////   Used and checked image functions
 
-void compute_gradient_orientation(float* igray,float *grad, float *ori, int width, int height);
+/// atan2 approximation, |error| ~ 1.2e-5 rad (well below the width of a 36-bin orientation bin)
+float fast_atan2(float y, float x);
+
+/// Gradient modulus and orientation on the rectangle x0 <= x < x1, y0 <= y < y1 (SSE on the interior when available).
+/// Pixels outside are left untouched. Any output may be NULL.
+/// If oribin is given, it receives the orientation quantised into nbins <= 256 bins of [-PI, PI], bin b holding
+/// the angles with b <= nbins * (angle + PI + 0.001) / (2 PI) < b+1, as in the SIFT orientation histogram.
+void compute_gradient_orientation(float* igray,float *grad, float *ori, int width, int height, int x0, int y0, int x1, int y1,
+                                  unsigned char *oribin = 0, int nbins = 36);
 
 // void extract ( float *igray,float *ogray, int ax, int ay,int cwidth, int cweight,int width, int height );
 
@@ -23,6 +23,28 @@
 #endif
 
 float framewidth = 100;
+std::string prior_file;
+float prior_radius = 50.0f;
+float coarse_area = 0.0f;
+bool coarse_crop = false;
+#ifdef _LDAHASH
+std::string pca_file, pca_train_file;
+int pca_dim = 64;
+#endif
+
+/**
+ * @brief Reads a homography from image1 to image2 written as 9 numbers, row after row.
+ * @return false if the file can not be read
+ */
+bool read_prior(const std::string& filename, TypeMap& H)
+{
+    std::ifstream file(filename.c_str());
+    for (int i=0; i<3; i++)
+        for (int j=0; j<3; j++)
+            if (!(file >> H(i,j)))
+                return false;
+    return true;
+}
 
 void invert_contrast(std::vector<float>& image,int w, int h)
 {    for (int i=0;i<h;i++)
@@ -424,10 +446,142 @@ void areazoom_image(vector<float>& ipixels, size_t& w1, size_t& h1, float areaS)
     h1 = hS1;
 }
 
+
+/**
+ * @brief Translation by (ox,oy) in homogeneous coordinates.
+ */
+TypeMap translation(double ox, double oy)
+{
+    TypeMap T = TypeMap::eye(3);
+    T(0,2) = ox;
+    T(1,2) = oy;
+    return T;
+}
+
+/**
+ * @brief Bounding box of the part of a target image covered by a source image mapped through a homography, enlarged by <margin>.
+ * @param H Homography from the source image to the target one
+ * @param (ws,hs) Size of the source image
+ * @param (wt,ht) Size of the target image
+ * @param box Returns (x0,y0,x1,y1) in the target image
+ * @return false if the homography sends part of the source image to infinity, or if nothing is covered
+ */
+bool covered_box(const TypeMap& H, int ws, int hs, int wt, int ht, float margin, int box[4])
+{
+    double xmin = wt, ymin = ht, xmax = 0, ymax = 0;
+    double cx[4] = {0, (double)ws, 0, (double)ws}, cy[4] = {0, 0, (double)hs, (double)hs};
+    for (int c=0; c<4; c++)
+    {
+        double z = H(2,0)*cx[c] + H(2,1)*cy[c] + H(2,2);
+        if (z<=0)
+            return false;
+        double x = (H(0,0)*cx[c] + H(0,1)*cy[c] + H(0,2))/z, y = (H(1,0)*cx[c] + H(1,1)*cy[c] + H(1,2))/z;
+        xmin = std::min(xmin,x); xmax = std::max(xmax,x);
+        ymin = std::min(ymin,y); ymax = std::max(ymax,y);
+    }
+    box[0] = std::max(0, (int) floor(xmin-margin));
+    box[1] = std::max(0, (int) floor(ymin-margin));
+    box[2] = std::min(wt, (int) ceil(xmax+margin));
+    box[3] = std::min(ht, (int) ceil(ymax+margin));
+    return (box[2]>box[0]) && (box[3]>box[1]);
+}
+
+/**
+ * @brief Copies the part (x0,y0,x1,y1) of an image.
+ */
+void crop_image(const vector<float>& ipixels, int w, const int box[4], vector<float>& cropped)
+{
+    int wc = box[2]-box[0], hc = box[3]-box[1];
+    cropped.resize(wc*hc);
+    for (int j=0; j<hc; j++)
+        for (int i=0; i<wc; i++)
+            cropped[j*wc+i] = ipixels[(j+box[1])*w+i+box[0]];
+}
+
+/**
+ * @brief Coarse-to-fine IMAS. Matches are first found on versions of the images resized to an area of about <coarse_area>.
+ * The homography or fundamental matrix identified there by the filter then guides the matching of hyper-descriptors
+ * at full resolution, within <radius> pixels of predicted positions or epipolar lines (see the guided version of IMAS_Impl()).
+ * If <crop> is set and the model is a homography, only the parts of the images predicted to overlap are described at full resolution.
+ * Plain IMAS is run at full resolution if no model is identified at low resolution.
+ * Parameters are the same as for IMAS_Impl().
+ */
+void coarse_to_fine_IMAS(vector<float>& ipixels1, int w1, int h1, vector<float>& ipixels2, int w2, int h2, vector<float>& data, matchingslist& matchings, imasCoverings& ic, int applyfilter, float coarse_area, float radius, bool crop)
+{
+    bool epipolar = (applyfilter==ORSA_FUNDAMENTAL || applyfilter==USAC_FUNDAMENTAL);
+
+    // Low resolution
+    vector<float> coarse1(ipixels1), coarse2(ipixels2), coarse_data;
+    size_t cw1 = w1, ch1 = h1, cw2 = w2, ch2 = h2;
+    if (w1*h1>coarse_area)
+        areazoom_image(coarse1, cw1, ch1, coarse_area);
+    if (w2*h2>coarse_area)
+        areazoom_image(coarse2, cw2, ch2, coarse_area);
+    my_Printf("Coarse level: %dx%d and %dx%d images\n\n", (int)cw1, (int)ch1, (int)cw2, (int)ch2);
+    matchingslist coarse_matchings;
+    IdentifiedMaps.clear();
+    IMAS_Impl(coarse1, (int)cw1, (int)ch1, coarse2, (int)cw2, (int)ch2, coarse_data, coarse_matchings, ic, applyfilter);
+
+    my_Printf("Fine level: %dx%d and %dx%d images\n\n", w1, h1, w2, h2);
+    if (IdentifiedMaps.empty())
+    {
+        my_Printf("No model has been identified at the coarse level, full resolution matching is not guided.\n\n");
+        IMAS_Impl(ipixels1, w1, h1, ipixels2, w2, h2, data, matchings, ic, applyfilter);
+        return;
+    }
+
+    // Model at full resolution, S_i being the zoom from image i to its coarse version
+    TypeMap S1 = TypeMap::eye(3), S2 = TypeMap::eye(3);
+    S1(0,0) = (double)cw1/w1; S1(1,1) = (double)ch1/h1;
+    S2(0,0) = (double)cw2/w2; S2(1,1) = (double)ch2/h2;
+    TypeMap prior = epipolar ? S1*IdentifiedMaps[0]*S2 : S2.inv()*IdentifiedMaps[0]*S1;
+
+    // Filters only set IdentifiedMaps on success: the coarse model must not outlive a failure at full resolution
+    IdentifiedMaps.clear();
+
+    int box1[4] = {0, 0, w1, h1}, box2[4] = {0, 0, w2, h2};
+    if ( crop && !epipolar && !( covered_box(prior.inv(), w2, h2, w1, h1, radius, box1) && covered_box(prior, w1, h1, w2, h2, radius, box2) ) )
+    {
+        box1[0] = box1[1] = box2[0] = box2[1] = 0;
+        box1[2] = w1; box1[3] = h1; box2[2] = w2; box2[3] = h2;
+    }
+    if ( box1[0]==0 && box1[1]==0 && box1[2]==w1 && box1[3]==h1 && box2[0]==0 && box2[1]==0 && box2[2]==w2 && box2[3]==h2 )
+    {
+        IMAS_Impl(ipixels1, w1, h1, ipixels2, w2, h2, data, matchings, ic, applyfilter, prior, radius);
+        return;
+    }
+
+    // Only the predicted overlap is described
+    my_Printf("Predicted overlap: [%d,%d]x[%d,%d] in image 1 and [%d,%d]x[%d,%d] in image 2\n\n", box1[0], box1[2], box1[1], box1[3], box2[0], box2[2], box2[1], box2[3]);
+    vector<float> crop1, crop2;
+    crop_image(ipixels1, w1, box1, crop1);
+    crop_image(ipixels2, w2, box2, crop2);
+    TypeMap crop_prior = translation(-box2[0], -box2[1])*prior*translation(box1[0], box1[1]);
+    IMAS_Impl(crop1, box1[2]-box1[0], box1[3]-box1[1], crop2, box2[2]-box2[0], box2[3]-box2[1], data, matchings, ic, applyfilter, crop_prior, radius);
+
+    // back to the coordinates of the whole images
+    for (int i=0; i<(int)matchings.size(); i++)
+    {
+        matchings[i].first.x += box1[0];
+        matchings[i].first.y += box1[1];
+        matchings[i].second.x += box2[0];
+        matchings[i].second.y += box2[1];
+    }
+    for (int i=0; i<(int)data.size(); i+=15)
+    {
+        data[i] += box1[0];
+        data[i+1] += box1[1];
+        data[i+7] += box2[0];
+        data[i+8] += box2[1];
+    }
+    for (int i=0; i<(int)IdentifiedMaps.size(); i++)
+        IdentifiedMaps[i] = translation(box2[0], box2[1])*IdentifiedMaps[i]*translation(-box1[0], -box1[1]);
+}
+
 #include <map>
 #include <string>
 #include <iostream>
-enum StringValue { _wrongvalue,_im1, _im2,_im3,_max_keys_im3,_im3_only, _applyfilter, _IMAS_INDEX, _covering,_match_ratio, _filter_precision, _eigen_threshold, _tensor_eigen_threshold, _filter_radius, _fixed_area,_im1_gdal, _im2_gdal, _bigpanorama, _framewidth};
+enum StringValue { _wrongvalue,_im1, _im2,_im3,_max_keys_im3,_im3_only, _applyfilter, _IMAS_INDEX, _covering,_match_ratio, _filter_precision, _eigen_threshold, _tensor_eigen_threshold, _filter_radius, _fixed_area,_im1_gdal, _im2_gdal, _bigpanorama, _framewidth, _ac_shortlist, _ac_shortlist_check, _ac_gradient_patches, _sim_gating, _group_cap, _group_tolerance, _min_support, _support_tilt, _kp_budget, _kp_budget_image, _kp_anms, _sift_half, _defer_desc, _desc_extra, _pca, _pca_train, _pca_dim, _prior, _prior_radius, _coarse_area, _coarse_crop, _orsa_seed};
 static std::map<std::string, int> strmap;
 void buildmap()
 {
@@ -450,6 +604,28 @@ void buildmap()
     strmap["-fixed_area"] = _fixed_area;
     strmap["-bigpanorama"] = _bigpanorama;
     strmap["-framewidth"] = _framewidth;
+    strmap["-ac_shortlist"] = _ac_shortlist;
+    strmap["-ac_shortlist_check"] = _ac_shortlist_check;
+    strmap["-ac_gradient_patches"] = _ac_gradient_patches;
+    strmap["-sim_gating"] = _sim_gating;
+    strmap["-prior"] = _prior;
+    strmap["-prior_radius"] = _prior_radius;
+    strmap["-coarse_area"] = _coarse_area;
+    strmap["-coarse_crop"] = _coarse_crop;
+    strmap["-orsa_seed"] = _orsa_seed;
+    strmap["-group_cap"] = _group_cap;
+    strmap["-group_tolerance"] = _group_tolerance;
+    strmap["-min_support"] = _min_support;
+    strmap["-support_tilt"] = _support_tilt;
+    strmap["-kp_budget"] = _kp_budget;
+    strmap["-kp_budget_image"] = _kp_budget_image;
+    strmap["-kp_anms"] = _kp_anms;
+    strmap["-sift_half"] = _sift_half;
+    strmap["-defer_desc"] = _defer_desc;
+    strmap["-desc_extra"] = _desc_extra;
+    strmap["-pca"] = _pca;
+    strmap["-pca_train"] = _pca_train;
+    strmap["-pca_dim"] = _pca_dim;
 
 
 }
@@ -615,6 +791,125 @@ void get_arguments(int argc, char **argv, std::vector<float>& im1,size_t& w1,siz
             framewidth = atof(argv[count]);
             break;
         }
+        case _ac_shortlist:
+        {
+            ac_shortlist_k = atoi(argv[count]);
+            break;
+        }
+        case _ac_shortlist_check:
+        {
+            ac_shortlist_check = true;
+            count--;
+            break;
+        }
+        case _ac_gradient_patches:
+        {
+            ac_gradient_patches = true;
+            count--;
+            break;
+        }
+        case _sim_gating:
+        {
+            sim_gating = atoi(argv[count]);
+            break;
+        }
+        case _prior:
+        {
+            prior_file = argv[count];
+            break;
+        }
+        case _prior_radius:
+        {
+            prior_radius = atof(argv[count]);
+            break;
+        }
+        case _coarse_area:
+        {
+            coarse_area = atof(argv[count]);
+            break;
+        }
+        case _coarse_crop:
+        {
+            coarse_crop = true;
+            count--;
+            break;
+        }
+        case _orsa_seed:
+        {
+            orsa_seed = (unsigned int) atol(argv[count]);
+            break;
+        }
+        case _group_cap:
+        {
+            group_cap = atoi(argv[count]);
+            break;
+        }
+        case _group_tolerance:
+        {
+            group_tolerance = atof(argv[count]);
+            break;
+        }
+        case _min_support:
+        {
+            min_support = atof(argv[count]);
+            break;
+        }
+        case _support_tilt:
+        {
+            support_tilt_weight = true;
+            count--;
+            break;
+        }
+        case _kp_budget:
+        {
+            keypoint_budget = atoi(argv[count]);
+            break;
+        }
+        case _kp_budget_image:
+        {
+            keypoint_budget_image = atoi(argv[count]);
+            break;
+        }
+        case _kp_anms:
+        {
+            keypoint_anms = true;
+            count--;
+            break;
+        }
+        case _sift_half:
+        {
+            sift_half_storage = true;
+            count--;
+            break;
+        }
+        case _defer_desc:
+        {
+            defer_description = true;
+            count--;
+            break;
+        }
+        case _desc_extra:
+        {
+            extra_extractors.push_back(GetDetectorDescriptor(atoi(argv[count])));
+            break;
+        }
+#ifdef _LDAHASH
+        case _pca:
+        {
+            pca_file = argv[count];
+            break;
+        }
+        case _pca_train:
+        {
+            pca_train_file = argv[count];
+            break;
+        }
+        case _pca_dim:
+        {
+            pca_dim = atoi(argv[count]);
+            break;
+        }
+#endif
         case _applyfilter:
         {
             applyfilter = atoi(argv[count]);
@@ -719,6 +1014,55 @@ int main(int argc, char **argv)
     }
 
     string algo_name = SetDetectorDescriptor(IMAS_INDEX);
+    for (int i=0; i<(int)extra_extractors.size(); i++)
+        algo_name = algo_name + " + " + extra_extractors[i].desc_name;
+
+#ifdef _ACD
+    // A-contrario descriptors share the patch settings of the SIFT library
+    int num_ac = (desc_type==IMAS_AC || desc_type==IMAS_AC_W || desc_type==IMAS_AC_Q) ? 1 : 0;
+    for (int i=0; i<(int)extra_extractors.size(); i++)
+        if (extra_extractors[i].desc_type==IMAS_AC || extra_extractors[i].desc_type==IMAS_AC_W || extra_extractors[i].desc_type==IMAS_AC_Q)
+            num_ac++;
+    if (num_ac>1)
+    {
+        cout<<"At most one a-contrario descriptor can be computed at once !"<<endl;
+        return 0;
+    }
+#endif
+
+#ifdef _LDAHASH
+    // PCA descriptors need a projection, unless it is being trained
+    bool uses_pca = (desc_type==IMAS_PCASIFT || desc_type==IMAS_PCAROOTSIFT);
+    for (int i=0; i<(int)extra_extractors.size(); i++)
+        if (extra_extractors[i].desc_type==IMAS_PCASIFT || extra_extractors[i].desc_type==IMAS_PCAROOTSIFT)
+            uses_pca = true;
+    if (!pca_file.empty())
+    {
+        int dim = IMAS_load_projection(pca_file.c_str());
+        if (dim==0)
+        {
+            cout<<"Wrong projection file: "<<pca_file<<" !"<<endl;
+            return 0;
+        }
+        my_Printf("PCA projection to %d dimensions loaded from %s\n",dim,pca_file.c_str());
+    }
+    else if (uses_pca && pca_train_file.empty())
+    {
+        cout<<"PCA descriptors need a projection file (-pca) !"<<endl;
+        return 0;
+    }
+    if (!pca_train_file.empty() && !(desc_type==IMAS_SIFT || desc_type==IMAS_ROOTSIFT || uses_pca))
+    {
+        cout<<"A projection can only be trained with SIFT, RootSIFT, PCA-SIFT or PCA-RootSIFT !"<<endl;
+        return 0;
+    }
+#endif
+
+    if (!prior_file.empty() && coarse_area>0.0f)
+    {
+        cout<<"A prior model (-prior) and coarse-to-fine matching (-coarse_area) can not be used together !"<<endl;
+        return 0;
+    }
 
     if (covering==-1.0f)
         covering = default_radius;
@@ -760,7 +1104,7 @@ int main(int argc, char **argv)
         IMAS_time tstart = IMAS::IMAS_getTickCount();
         my_Printf("Computing A-contrario hyper-descriptors...\n");
         std::vector<float> stats3;
-        int num_keys1 = IMAS_detectAndCompute(ipixels3, w3, h3, keys3, ic.getSimuDetails1(),stats3);
+        int num_keys1 = IMAS_detectAndCompute(ipixels3, w3, h3, keys3, keys3_descriptors, ic.getSimuDetails1(),stats3);
 
         my_Printf("   %d hyper-descriptors from %d SIIM descriptors have been found in %d simulated versions of the A-contrario image\n", num_keys1,(int)stats3[0],ic.getTotSimu1());
         my_Printf("      stats: group_min = %d , group_mean = %.3f, group_max = %d\n",(int)stats3[1],stats3[2],(int)stats3[3]);
@@ -770,10 +1114,40 @@ int main(int argc, char **argv)
     }
 
 
+#ifdef _LDAHASH
+    if (!pca_train_file.empty())
+    {
+        IMAS_time tstart = IMAS::IMAS_getTickCount();
+        my_Printf("Training a PCA projection to %d dimensions...\n",pca_dim);
+        int num_samples = IMAS_train_projection(ipixels1, (int)w1, (int)h1, ipixels2, (int)w2, (int)h2, ic, pca_dim, pca_train_file.c_str());
+        if (num_samples==0)
+        {
+            cout<<"The projection could not be trained !"<<endl;
+            return 0;
+        }
+        my_Printf("Projection trained on %d SIIM descriptors and written to %s in %.2f seconds.\n", num_samples, pca_train_file.c_str(), (IMAS::IMAS_getTickCount() - tstart)/ IMAS::IMAS_getTickFrequency());
+        return 0;
+    }
+#endif
+
     // IMAS
     matchingslist matchings;
     vector< float > data;
-    IMAS_Impl(ipixels1, (int)w1, (int)h1, ipixels2, (int)w2, (int)h2, data, matchings,ic, applyfilter);
+    if (!prior_file.empty())
+    {
+        TypeMap prior(3,3);
+        if (!read_prior(prior_file, prior) || prior_radius<=0.0f)
+        {
+            cout<<"Wrong prior model: "<<prior_file<<" !"<<endl;
+            return 0;
+        }
+        IMAS_Impl(ipixels1, (int)w1, (int)h1, ipixels2, (int)w2, (int)h2, data, matchings,ic, applyfilter, prior, prior_radius);
+    }
+    else if (coarse_area>0.0f)
+        coarse_to_fine_IMAS(ipixels1, (int)w1, (int)h1, ipixels2, (int)w2, (int)h2, data, matchings,ic, applyfilter, coarse_area, prior_radius, coarse_crop);
+    else
+        IMAS_Impl(ipixels1, (int)w1, (int)h1, ipixels2, (int)w2, (int)h2, data, matchings,ic, applyfilter);
+    IMAS_release(keys3, keys3_descriptors);
 
     write_images_matches(ipixels1,(int) w1, (int) h1, ipixels2, (int) w2, (int) h2, matchings);
 